@@ -9,6 +9,15 @@
 #include <time.h>
 #include "utils.h"
 #include "stdaln.h"
+#include "pipeline.h"
+#include "outstream.h"
+#include "qgram.h"
+#include "striped.h"
+#include "adapters.h"
+#include "demux.h"
+#include "dedup.h"
+#include "report.h"
+#include "profile.h"
 
 #define DEF_OL2MERGE_ADAPTER (10)
 #define DEF_OL2MERGE_READS (15)
@@ -22,6 +31,15 @@
 #define DEF_ADAPTER_SCORE_THRES (26)
 #define DEF_READ_SCORE_THRES (-500)
 #define DEF_READ_GAP_FRAC_CUTOFF (0.125)
+#define DEF_THREADS (1)
+#define DEF_BARCODE_MISMATCH (1)
+//lengths and scores past these share the last bin of the report histograms
+#define MAX_HIST_LEN (4095)
+#define MAX_HIST_SCORE (2047)
+//put at the end of the headers of duplicate pairs with -a
+#define DUP_TAG (" DUP")
+//number of read pairs handed to a worker at a time
+#define PAIRS_PER_BATCH (1024)
 //two revolutions of 4 positions = 5000 reads
 #define SPIN_INTERVAL (1250)
 //following primer sequences are from:
@@ -35,24 +53,44 @@
 char maximum_quality = MAX_QUAL;
 void help ( char *prog_name ) {
   fprintf(stderr, "\n\nUsage:\n%s [Required Args] [Options]\n",prog_name );
-  fprintf(stderr, "NOTE 1: The output is always gziped compressed.\n");
+  fprintf(stderr, "NOTE 1: The output is gziped compressed unless -u is given (with -T each file is a series of gzip members compressed in parallel).\n");
   fprintf(stderr, "NOTE 2: If the quality strings in the output contain characters less than ascii 33 on an ascii table (they look like lines from a binary file), try running again with or without the -6 option.\n");
   fprintf(stderr, "Required Arguments:\n" );
   fprintf(stderr, "\t-f <first read input fastq filename>\n" );
   fprintf(stderr, "\t-r <second read input fastq filename>\n" );
   fprintf(stderr, "\t-1 <first read output fastq filename>\n" );
   fprintf(stderr, "\t-2 <second read output fastq filename>\n" );
+  fprintf(stderr, "\t   (-i may be given instead of -f and -r, -j instead of -1 and -2; any one input and any one output may be - for stdin/stdout)\n" );
   fprintf(stderr, "General Arguments (Optional):\n" );
+  fprintf(stderr, "\t-i <interleaved input fastq filename, first and second reads alternate>\n" );
+  fprintf(stderr, "\t-j <interleaved output fastq filename, first and second reads alternate>\n" );
+  fprintf(stderr, "\t-u Write uncompressed output\n" );
   fprintf(stderr, "\t-S Display the spinner?\n" );
+  fprintf(stderr, "\t-T <number of worker threads, the output is identical to a single threaded run; default = %d>\n", DEF_THREADS );
+  fprintf(stderr, "\t-k <write -1, -2 and -s as BGZF with an index of every nth record in <file>%s>\n", OUT_INDEX_SUFFIX );
   fprintf(stderr, "\t-3 <first read discarded fastq filename>\n" );
   fprintf(stderr, "\t-4 <second read discarded fastq filename>\n" );
+  fprintf(stderr, "\t-D <sample sheet of \"<sample name> <barcode>\" lines to demultiplex by; every output file name gets the sample name and _ put in front of it,\n\t\t pairs matching no barcode go to files starting with %s_>\n", DEMUX_UNDETERMINED );
+  fprintf(stderr, "\t-I The barcodes are inline at the start of the first read, where they are cut off (default: the index in the first read's header)\n" );
+  fprintf(stderr, "\t-K <barcode mismatches allowed, 0 or 1; default = %d>\n", DEF_BARCODE_MISMATCH );
+  fprintf(stderr, "\t-c Time each stage of the processing and print a table of the times, and how often the alignment shortcuts applied, at exit\n" );
+  fprintf(stderr, "\t-l <write a JSON report of the run with length, insert size, adapter position and alignment score histograms to this file>\n" );
   fprintf(stderr, "\t-h Display this help message and exit (also works with no args) \n" );
   fprintf(stderr, "\t-6 Input sequence is in phred+64 rather than phred+33 format, the output will still be phred+33 \n" );
   fprintf(stderr, "\t-q <Quality score cutoff for mismatches to be counted in overlap; default = %d>\n", DEF_QCUT );
+  fprintf(stderr, "\t-Y <Quality score cutoff for trimming the 3' end of every read before anything else, with Mott's algorithm unless -J is given; default = no trimming>\n" );
+  fprintf(stderr, "\t-J <Trim the 3' ends with a sliding window of this many bases instead, until the mean quality of the window is at least the -Y cutoff>\n" );
+  fprintf(stderr, "\t-G <Trim poly-G tails (dark cycles of two colour chemistry) of at least this many bases off every read, allowing a mismatch per 8 bases; default = no trimming>\n" );
+  fprintf(stderr, "\t-H <Trim tails of any one base repeated at least this many times the same way; default = no trimming>\n" );
+  fprintf(stderr, "\t-C <Discard pairs with a read whose dinucleotide entropy is below this many bits (0-4, a dinucleotide repeat has 1) without aligning them; default = no filter>\n" );
+  fprintf(stderr, "\t-d <Megabytes of memory for spotting exact duplicate pairs, the first of each is kept and the rest go to -3/-4 without being aligned; default = no duplicate check>\n" );
+  fprintf(stderr, "\t-a Keep the duplicates -d finds and tag them with%s at the end of their headers instead\n", DUP_TAG );
   fprintf(stderr, "\t-L <Minimum length of a trimmed or merged read to print it; default = %d>\n", DEF_MIN_READ_LEN );
   fprintf(stderr, "Arguments for Adapter/Primer Trimming (Optional):\n" );
   fprintf(stderr, "\t-A <forward read primer/adapter sequence to trim as it would appear at the end of a read (recommend about 20bp of this)\n\t\t (should validate by grepping a file); default (genomic non-multiplexed adapter1) = %s>\n", DEF_FORWARD_PRIMER );
   fprintf(stderr, "\t-B <reverse read primer/adapter sequence to trim as it would appear at the end of a read (recommend about 20bp of this)\n\t\t (should validate by grepping a file); default (genomic non-multiplexed adapter2) = %s>\n", DEF_REVERSE_PRIMER );
+  fprintf(stderr, "\t-F <FASTA file of forward read adapters to use instead of -A, each read is checked against the one it shares the most %d-mers with>\n", ADAPTER_SEED_K );
+  fprintf(stderr, "\t-R <FASTA file of reverse read adapters to use instead of -B, each read is checked against the one it shares the most %d-mers with>\n", ADAPTER_SEED_K );
   fprintf(stderr, "\t-O <minimum overall base pair overlap with adapter sequence to trim; default = %d>\n", DEF_OL2MERGE_ADAPTER );
   fprintf(stderr, "\t-M <maximum fraction of good quality mismatching bases for primer/adapter overlap; default = %f>\n", DEF_MAX_MISMATCH_ADAPTER );
   fprintf(stderr, "\t-N <minimum fraction of matching bases for primer/adapter overlap; default = %f>\n", DEF_MIN_MATCH_ADAPTER );
@@ -97,22 +135,1054 @@ static void update_spinner(unsigned long long num_reads){
   }
 }
 
+/* Settings for a run, shared read only by every worker */
+typedef struct {
+  bool p64;
+  bool do_read_merging;
+  bool print_overhang;
+  bool write_discard;
+  bool use_mask;
+  bool pretty_print;
+  bool display_spinner;
+  bool interleave_out; //second reads go to the first read output
+  bool demux;
+  bool inline_barcode; //the barcode starts the first read rather than being in its header
+  unsigned long long max_pretty_print;
+  int adapter_thresh;
+  //adapters that can show up at the end of the first and the second reads
+  AdapterSet forward_adapters;
+  AdapterSet reverse_adapters;
+  //samples to split the pairs up by, each has its own output set and one more is for the rest
+  SampleSheet samples;
+  int n_sets;
+  int min_ol_adapter;
+  int min_ol_reads;
+  unsigned short min_read_len;
+  float read_frac_thresh;
+  float max_mismatch_adapter_frac;
+  float max_mismatch_reads_frac;
+  float min_match_adapter_frac;
+  float min_match_reads_frac;
+  char qcut;
+  char qtrim;       //3' quality trimming cutoff, 0 for none
+  int qtrim_window; //bases in the sliding window, 0 for Mott's algorithm
+  int polyg_len;    //shortest poly-G tail to trim, 0 for none
+  int polyx_len;    //shortest tail of any one base to trim, 0 for none
+  double min_entropy; //pairs with a read of lower dinucleotide entropy are junk
+  bool dedup;
+  bool tag_dups;    //duplicates are tagged and kept rather than dropped
+  bool report;      //fill the histograms of the JSON report
+  bool profile;     //time the stages of the processing
+} SeqPrepOpts;
 
-int main( int argc, char* argv[] ) {
+/* Counters kept privately by each worker and summed at the end */
+typedef struct {
   unsigned long long num_pairs;
   unsigned long long num_merged;
   unsigned long long num_adapter;
   unsigned long long num_discarded;
   unsigned long long num_too_ambiguous_to_merge;
-  unsigned long long max_pretty_print = DEF_MAX_PRETTY_PRINT;
-  unsigned long long num_pretty_print = 0;
-  int adapter_thresh = DEF_ADAPTER_SCORE_THRES;
-  int read_thresh = DEF_READ_SCORE_THRES;
+  unsigned long long num_adapter_aln_skipped; //adapter alignments the q-gram filter ruled out
+  unsigned long long num_adapter_aln_bounded; //and the ones the striped score bound did
+  unsigned long long num_adapter_unaligned; //reads no adapter was aligned to, kept out of adapter_score
+  unsigned long long num_read_aln;     //read-read alignments done
+  unsigned long long num_read_aln_fast; //of those, settled without the gapped aligner
+  unsigned long long num_barcode_corrected;
+  unsigned long long num_qtrim_reads;   //reads shortened by quality trimming
+  unsigned long long num_qtrim_bases;   //and the bases that took off them
+  unsigned long long num_tail_reads;    //reads with a poly-G/poly-X tail trimmed
+  unsigned long long num_tail_bases;
+  unsigned long long num_low_complexity;
+  unsigned long long num_dup_dropped;
+} SeqPrepStats;
+
+/* Distributions for the JSON report, kept by each worker and summed at the end */
+typedef struct {
+  Hist insert_size;       //merged reads, and adapter trimmed pairs written unmerged
+  Hist merged_len;
+  Hist trimmed_len[2];    //first and second reads written out as a pair
+  Hist adapter_pos[2];    //where adapter trimming cut each read
+  Hist adapter_score[2];  //local alignment scores of the reads aligned to an adapter
+  Hist read_score;        //global alignment scores between the reads
+} SeqPrepHists;
+
+static void hists_init(SeqPrepHists *h){
+  int i;
+  hist_init(&h->insert_size, 0, MAX_HIST_LEN);
+  hist_init(&h->merged_len, 0, MAX_HIST_LEN);
+  for(i=0;i<2;i++){
+    hist_init(&h->trimmed_len[i], 0, MAX_HIST_LEN);
+    hist_init(&h->adapter_pos[i], 0, MAX_HIST_LEN);
+    hist_init(&h->adapter_score[i], 0, MAX_HIST_SCORE);
+  }
+  hist_init(&h->read_score, -MAX_HIST_SCORE, MAX_HIST_SCORE);
+}
+
+static void hists_merge(SeqPrepHists *dst, const SeqPrepHists *src){
+  int i;
+  hist_merge(&dst->insert_size, &src->insert_size);
+  hist_merge(&dst->merged_len, &src->merged_len);
+  for(i=0;i<2;i++){
+    hist_merge(&dst->trimmed_len[i], &src->trimmed_len[i]);
+    hist_merge(&dst->adapter_pos[i], &src->adapter_pos[i]);
+    hist_merge(&dst->adapter_score[i], &src->adapter_score[i]);
+  }
+  hist_merge(&dst->read_score, &src->read_score);
+}
+
+static void hists_free(SeqPrepHists *h){
+  int i;
+  hist_free(&h->insert_size);
+  hist_free(&h->merged_len);
+  for(i=0;i<2;i++){
+    hist_free(&h->trimmed_len[i]);
+    hist_free(&h->adapter_pos[i]);
+    hist_free(&h->adapter_score[i]);
+  }
+  hist_free(&h->read_score);
+}
+
+//why a pair is thrown out before it is aligned
+enum { PAIR_KEEP, PAIR_LOW_COMPLEXITY, PAIR_DUPLICATE };
+
+//outputs of a set, the pretty printed alignments only go with the first
+enum { OUT_FORWARD, OUT_REVERSE, OUT_MERGED, OUT_DISCARD_F, OUT_DISCARD_R, OUT_PRETTY, NUM_OUTS };
+
+/* A batch of read pairs along with the output they produced */
+typedef struct {
+  SQP *sqps;
+  int n;
+  OutBuf *out; //NUM_OUTS for every output set
+  int n_out;
+  bool dup[PAIRS_PER_BATCH]; //the pair was seen before in the input
+  //pretty print groups: each is written only if the print limit was not hit yet
+  size_t *pp_end;
+  unsigned long long *pp_count;
+  int n_pp, m_pp;
+} SeqBatch;
+
+/* State owned by the reader and writer */
+typedef struct {
+  const SeqPrepOpts *opts;
+  FqReader *ffq, *rfq;
+  OutStream **outs; //NUM_OUTS for every output set, NULL for the ones not written
+  int n_outs;
+  DupTable dups; //read pairs seen so far, checked in input order
+  unsigned long long num_dups;
+  bool eof;
+  unsigned long long num_read;
+  unsigned long long num_pretty_print; //only the writer adds to this
+  Profile read_prof, write_prof; //stages timed on the reader and writer threads
+} SeqPrepIO;
+
+/* the candidate adapters of a read, most k-mer hits first */
+typedef struct {
+  int n;
+  int adapter[ADAPTER_MAX_PICKS];
+  int bound[ADAPTER_MAX_PICKS]; //local alignment score bound against each
+} AdapterPicks;
+
+typedef struct {
+  const SeqPrepOpts *opts;
+  SeqPrepIO *io;
+  SeqPrepStats stats;
+  SeqPrepHists hists; //left empty without -l
+  Profile prof;
+  //match tables, private so each worker can grow its own for long reads
+  OlapTable adapter_olap;
+  OlapTable reads_olap;
+  QgramWork qgram;
+  OlWork ol;
+  StripedWork striped;
+  AdapterWork adapters;
+  //output set of each pair of the current batch, and the pairs sent to each set
+  int set[PAIRS_PER_BATCH];
+  unsigned long long *set_pairs;
+  //pairs of the current batch that are thrown out unaligned, and why
+  unsigned char drop[PAIRS_PER_BATCH];
+  //adapters each read of the current batch may hold
+  AdapterPicks fpicks[PAIRS_PER_BATCH];
+  AdapterPicks rpicks[PAIRS_PER_BATCH];
+  //reads scored side by side, and the pairs they came from
+  const char *lane_seqs[PAIRS_PER_BATCH];
+  int lane_lens[PAIRS_PER_BATCH];
+  int lane_pairs[PAIRS_PER_BATCH];
+  int lane_scores[PAIRS_PER_BATCH];
+  //alignment buffers, reused from pair to pair
+  AlnWorkspace *aln_ws;
+  AlnAln *faaln, *raaln, *fraln;
+  AlnAln *spare_aln; //swapped with faaln or raaln as a better adapter alignment turns up
+} SeqPrepWorker;
+
+
+/**
+ * Returns false when the pretty print limit has already been reached
+ * by previously written batches, so there is no point in formatting more.
+ */
+static bool pretty_print_room(SeqPrepWorker *w){
+  return __sync_fetch_and_add(&w->io->num_pretty_print, 0) < w->opts->max_pretty_print;
+}
+
+/**
+ * Closes a group of pretty printed alignments that would have been
+ * guarded by a single check against the print limit
+ */
+static void pretty_print_group(SeqBatch *b, unsigned long long count){
+  if(b->n_pp == b->m_pp){
+    b->m_pp = b->m_pp ? b->m_pp << 1 : 64;
+    b->pp_end = (size_t*)realloc(b->pp_end, sizeof(size_t) * b->m_pp);
+    b->pp_count = (unsigned long long*)realloc(b->pp_count, sizeof(unsigned long long) * b->m_pp);
+  }
+  b->pp_end[b->n_pp] = b->out[OUT_PRETTY].l;
+  b->pp_count[b->n_pp] = count;
+  b->n_pp++;
+}
+
+static SeqBatch *SeqBatch_init(int n_sets){
+  int i;
+  SeqBatch *b = (SeqBatch*)calloc(1, sizeof(SeqBatch));
+  b->sqps = (SQP*)malloc(sizeof(SQP) * PAIRS_PER_BATCH);
+  for(i=0;i<PAIRS_PER_BATCH;i++)
+    b->sqps[i] = SQP_init();
+  b->n_out = n_sets * NUM_OUTS;
+  b->out = (OutBuf*)malloc(sizeof(OutBuf) * b->n_out);
+  for(i=0;i<b->n_out;i++)
+    outbuf_init(&b->out[i]);
+  return b;
+}
+
+static void SeqBatch_destroy(SeqBatch *b){
+  int i;
+  for(i=0;i<b->n_out;i++)
+    outbuf_free(&b->out[i]);
+  free(b->out);
+  free(b->pp_end);
+  free(b->pp_count);
+  for(i=0;i<PAIRS_PER_BATCH;i++)
+    SQP_destroy(b->sqps[i]);
+  free(b->sqps);
+  free(b);
+}
+
+/**
+ * Sends every pair of the batch to the output set of the sample its barcode
+ * belongs to, the pairs no sample claims go to the last set. The barcode is
+ * the index in the header of the first read, or the start of the first read
+ * itself, in which case it is cut off before anything else is done.
+ */
+static void demux_batch(SeqPrepWorker *w, SeqBatch *b){
+  const SeqPrepOpts *o = w->opts;
+  const SampleSheet *ss = &o->samples;
+  const char *bc;
+  size_t len;
+  bool corrected;
+  int i, set;
+  for(i=0;i<b->n;i++){
+    SQP sqp = b->sqps[i];
+    if(o->inline_barcode){
+      len = min(sqp->flen, (size_t)ss->barcode_len);
+      set = len == (size_t)ss->barcode_len ? sample_sheet_match(ss, sqp->fseq, len, &corrected) : -1;
+      memmove(sqp->fseq, sqp->fseq + len, sqp->flen - len + 1);
+      memmove(sqp->fqual, sqp->fqual + len, sqp->flen - len + 1);
+      sqp->flen -= len;
+    }else{
+      len = fastq_header_index(sqp->fid, &bc);
+      set = sample_sheet_match(ss, bc, len, &corrected);
+    }
+    if(set < 0)
+      set = ss->n;
+    else if(corrected)
+      w->stats.num_barcode_corrected++;
+    w->set[i] = set;
+    w->set_pairs[set]++;
+  }
+}
+
+/**
+ * Cuts the low quality 3' end off a read
+ */
+static void quality_trim(SeqPrepWorker *w, char *seq, char *qual, size_t *len){
+  const SeqPrepOpts *o = w->opts;
+  size_t l = o->qtrim_window ? qual_trim_window(qual, *len, o->qtrim, o->qtrim_window) :
+      qual_trim_mott(qual, *len, o->qtrim);
+  if(l < *len){
+    w->stats.num_qtrim_reads++;
+    w->stats.num_qtrim_bases += *len - l;
+    seq[l] = qual[l] = '\0';
+    *len = l;
+  }
+}
+
+/**
+ * Cuts a poly-G tail off a read, or a tail of any one base,
+ * if it is at least as long as asked for
+ */
+static void tail_trim(SeqPrepWorker *w, char *seq, char *qual, size_t *len){
+  const SeqPrepOpts *o = w->opts;
+  size_t run = 0;
+  if(o->polyx_len){
+    run = tail_run(seq, *len, 0);
+    if(run < (size_t)o->polyx_len)
+      run = 0;
+  }
+  if(run == 0 && o->polyg_len){
+    run = tail_run(seq, *len, 'G');
+    if(run < (size_t)o->polyg_len)
+      run = 0;
+  }
+  if(run == 0)
+    return;
+  w->stats.num_tail_reads++;
+  w->stats.num_tail_bases += run;
+  *len -= run;
+  seq[*len] = qual[*len] = '\0';
+}
+
+/**
+ * Puts the duplicate tag at the end of a header, cutting a header too
+ * long to take it short, just as read_fastq cuts any longer than MAX_ID_LEN
+ */
+static void tag_dup(char *id){
+  size_t len = min(strlen(id), MAX_ID_LEN - strlen(DUP_TAG));
+  strcpy(id + len, DUP_TAG);
+}
+
+/**
+ * Keeps a copy of a pair as it came in for the discard files,
+ * inline barcode included
+ */
+static void keep_untrimmed(SQP sqp){
+  strcpy(sqp->untrim_fseq,sqp->fseq);
+  strcpy(sqp->untrim_fqual,sqp->fqual);
+  strcpy(sqp->untrim_rseq,sqp->rseq);
+  strcpy(sqp->untrim_rqual,sqp->rqual);
+}
+
+/**
+ * Trims the low quality and poly-G/poly-X tails of both reads if that
+ * was asked for. Returns why the pair is thrown out, if it is.
+ */
+static int prepare_pair(SeqPrepWorker *w, SQP sqp, bool dup){
+  const SeqPrepOpts *o = w->opts;
+  if(dup && o->tag_dups){
+    tag_dup(sqp->fid);
+    tag_dup(sqp->rid);
+  }
+  if(dup && !o->tag_dups)
+    return PAIR_DUPLICATE;
+  if(o->qtrim){
+    quality_trim(w, sqp->fseq, sqp->fqual, &sqp->flen);
+    quality_trim(w, sqp->rseq, sqp->rqual, &sqp->rlen);
+    SQP_rc_stale(sqp);
+  }
+  if(o->polyg_len || o->polyx_len){
+    tail_trim(w, sqp->fseq, sqp->fqual, &sqp->flen);
+    tail_trim(w, sqp->rseq, sqp->rqual, &sqp->rlen);
+    SQP_rc_stale(sqp);
+  }
+  if(o->min_entropy > 0 && (dinuc_entropy(sqp->fseq, sqp->flen) < o->min_entropy ||
+      dinuc_entropy(sqp->rseq, sqp->rlen) < o->min_entropy))
+    return PAIR_LOW_COMPLEXITY;
+  return PAIR_KEEP;
+}
+
+/**
+ * Picks the candidate adapters for one read of every pair in the batch
+ * and bounds the local alignment score against each: 0 where the k-mers
+ * rule it out, the rest are scored many at a time, one read per SIMD lane.
+ */
+static void adapter_bounds(SeqPrepWorker *w, SeqBatch *b, bool forward, AdapterPicks *picks){
+  const SeqPrepOpts *o = w->opts;
+  const AdapterSet *as = forward ? &o->forward_adapters : &o->reverse_adapters;
+  const Adapter *a;
+  AdapterPicks *p;
+  int i, j, c, n;
+  for(i=0;i<b->n;i++){
+    SQP sqp = b->sqps[i];
+    const char *seq = forward ? sqp->fseq : sqp->rseq;
+    size_t len = forward ? sqp->flen : sqp->rlen;
+    p = &picks[i];
+    if(w->drop[i]){ //never aligned
+      p->n = 0;
+      continue;
+    }
+    p->n = adapter_set_pick(as, &w->adapters, seq, len, p->adapter);
+    if(p->n == 0){
+      //no seed, the candidates are the adapters the q-gram filter lets through
+      for(j=0;j<as->n && p->n<ADAPTER_MAX_PICKS;j++){
+        if(qgram_may_align(&as->a[j].qgram, &w->qgram, seq, len)){
+          p->adapter[p->n] = j;
+          p->bound[p->n++] = INT_MAX;
+        }else{
+          w->stats.num_adapter_aln_skipped++;
+        }
+      }
+      continue;
+    }
+    for(c=0;c<p->n;c++){
+      p->bound[c] = qgram_may_align(&as->a[p->adapter[c]].qgram, &w->qgram, seq, len) ? INT_MAX : 0;
+      if(p->bound[c] == 0)
+        w->stats.num_adapter_aln_skipped++;
+    }
+  }
+  for(j=0;j<as->n;j++){
+    a = &as->a[j];
+    if(!a->profile)
+      continue;
+    for(i=n=0;i<b->n;i++){
+      p = &picks[i];
+      for(c=0;c<p->n && p->adapter[c] != j;c++);
+      if(c == p->n || p->bound[c] == 0)
+        continue;
+      w->lane_seqs[n] = forward ? b->sqps[i]->fseq : b->sqps[i]->rseq;
+      w->lane_lens[n] = forward ? b->sqps[i]->flen : b->sqps[i]->rlen;
+      w->lane_pairs[n] = i * ADAPTER_MAX_PICKS + c;
+      n++;
+    }
+    if(n == 0)
+      continue;
+    striped_local_batch(a->profile, &w->striped, w->lane_seqs, w->lane_lens, n, w->lane_scores);
+    for(i=0;i<n;i++){
+      picks[w->lane_pairs[i] / ADAPTER_MAX_PICKS].bound[w->lane_pairs[i] % ADAPTER_MAX_PICKS] = w->lane_scores[i];
+      if(w->lane_scores[i] < o->adapter_thresh)
+        w->stats.num_adapter_aln_bounded++;
+    }
+  }
+}
+
+//stands in for the adapter of a read no adapter was found in
+static const Adapter no_adapter;
+
+//whether adapter_align runs stdaln for any of the candidates
+static bool adapter_aligned(const AdapterPicks *p, int thresh){
+  int c;
+  for(c=0;c<p->n;c++)
+    if(p->bound[c] >= thresh)
+      return true;
+  return false;
+}
+
+/**
+ * Local alignment of a read to its candidate adapters. Each candidate
+ * whose score bound reaches the adapter threshold gets the full stdaln
+ * alignment, and of those that pass, the one starting earliest in the
+ * read is kept in *aln (the higher score on ties): whatever follows an
+ * adapter is cut off with it. *adapter is set to that candidate, NULL
+ * when none passes, and *aln is then an empty alignment with the best
+ * score seen, below the threshold.
+ */
+static AlnAln *adapter_align(SeqPrepWorker *w, AlnAln **aln, const AdapterPicks *p,
+    const AdapterSet *as, const char *seq, size_t len, const Adapter **adapter){
+  const SeqPrepOpts *o = w->opts;
+  const Adapter *a;
+  AlnAln *t;
+  int c, pos, best_pos = 0, score = min(0, o->adapter_thresh - 1);
+  bool found = false;
+  *adapter = NULL;
+  for(c=0;c<p->n;c++){
+    a = &as->a[p->adapter[c]];
+    if(p->bound[c] < o->adapter_thresh){
+      score = c == 0 ? p->bound[c] : max(score, p->bound[c]);
+      continue;
+    }
+    t = aln_stdaln_ws(w->aln_ws, w->spare_aln, seq, a->seq, &aln_param_nt2nt,
+        ALN_TYPE_LOCAL, o->adapter_thresh, len, a->len);
+    if(t->score < o->adapter_thresh){
+      score = c == 0 ? t->score : max(score, t->score);
+      continue;
+    }
+    pos = max(t->start1 - t->start2, 0);
+    if(!found || pos < best_pos || (pos == best_pos && t->score > (*aln)->score)){
+      w->spare_aln = *aln;
+      *aln = t;
+      *adapter = a;
+      best_pos = pos;
+      found = true;
+    }
+  }
+  if(found)
+    return *aln;
+  t = *aln;
+  t->score = score;
+  t->subo = t->path_len = t->n_cigar = 0;
+  t->start1 = t->end1 = t->start2 = t->end2 = 0;
+  return t;
+}
+
+/**
+ * The adapter a read goes through adapter_trim with when the local
+ * alignment found none: the one compute_ol finds earliest in the read.
+ * Every adapter is tried, a tail too short or too mismatched to align
+ * often has no seed of its own. A lone adapter is left to adapter_trim.
+ */
+static const Adapter *adapter_olap_pick(SeqPrepWorker *w, const AdapterSet *as,
+    char *seq, char *qual, size_t len){
+  const SeqPrepOpts *o = w->opts;
+  const Adapter *a, *best = &no_adapter;
+  int i, pos, best_pos = INT_MAX;
+  if(as->n == 1)
+    return &as->a[0];
+  for(i=0;i<as->n;i++){
+    a = &as->a[i];
+    pos = adapter_olap_pos(&w->ol, seq, qual, len, a->seq, a->dummy_qual, a->len,
+        o->min_ol_adapter, w->adapter_olap.min_match, w->adapter_olap.max_mismatch, o->qcut);
+    if(pos >= 0 && pos < best_pos){
+      best = a;
+      best_pos = pos;
+    }
+  }
+  return best;
+}
+
+/**
+ * Writes a trimmed pair out
+ */
+static void write_pair(SeqPrepWorker *w, OutBuf *ffqw, OutBuf *rfqw, SQP sqp){
+  uint64_t t = prof_start(&w->prof);
+  hist_add(&w->hists.trimmed_len[0], sqp->flen);
+  hist_add(&w->hists.trimmed_len[1], sqp->rlen);
+  write_fastq(ffqw, sqp->fid, sqp->fseq, sqp->fqual);
+  write_fastq(rfqw, sqp->rid, sqp->rseq, sqp->rqual);
+  prof_end(&w->prof, PROF_FORMAT, t);
+}
+
+/**
+ * Writes the merged read of a pair out, its length is the insert size
+ */
+static void write_merged(SeqPrepWorker *w, OutBuf *mfqw, SQP sqp){
+  uint64_t t = prof_start(&w->prof);
+  int len = strlen(sqp->merged_seq);
+  hist_add(&w->hists.merged_len, len);
+  hist_add(&w->hists.insert_size, len);
+  write_fastq(mfqw,sqp->fid,sqp->merged_seq,sqp->merged_qual);
+  prof_end(&w->prof, PROF_FORMAT, t);
+}
+
+/**
+ * Trim and/or merge a single read pair, writing the results
+ * into the output buffers of its batch
+ */
+static void process_pair(SeqPrepWorker *w, SeqBatch *b, int pair){
+  SQP sqp = b->sqps[pair];
+  const SeqPrepOpts *o = w->opts;
+  SeqPrepStats *stats = &w->stats;
+  OutBuf *out = b->out + NUM_OUTS * w->set[pair];
+  OutBuf *ffqw = &out[OUT_FORWARD];
+  OutBuf *rfqw = o->interleave_out ? ffqw : &out[OUT_REVERSE];
+  OutBuf *mfqw = &out[OUT_MERGED];
+  OutBuf *dffqw = &out[OUT_DISCARD_F];
+  OutBuf *drfqw = &out[OUT_DISCARD_R];
+  OutBuf *ppaw = &b->out[OUT_PRETTY];
+  char *untrim_fseq = sqp->untrim_fseq;
+  char *untrim_fqual = sqp->untrim_fqual;
+  char *untrim_rseq = sqp->untrim_rseq;
+  char *untrim_rqual = sqp->untrim_rqual;
+  OlapTable *adapter_olap = &w->adapter_olap;
+  OlapTable *reads_olap = &w->reads_olap;
+  int read_thresh;
+  AlnAln *faaln, *raaln, *fraln;
+  const Adapter *fadapter, *radapter;
+  uint64_t t;
+  bool adapter_found;
+
+  stats->num_pairs++;
+  ol_work_next_pair(&w->ol);
+
+  if(w->drop[pair]){ //straight to the discards
+    if(w->drop[pair] == PAIR_DUPLICATE)
+      stats->num_dup_dropped++;
+    else
+      stats->num_low_complexity++;
+    stats->num_discarded++;
+    if(o->write_discard){
+      write_fastq(dffqw, sqp->fid, untrim_fseq, untrim_fqual);
+      write_fastq(drfqw, sqp->rid, untrim_rseq, untrim_rqual);
+    }
+    return;
+  }
+
+  //save length before adapter trimming (the original sequences were saved by keep_untrimmed)
+  int untrim_flen=sqp->flen;
+  int untrim_rlen=sqp->rlen;
+
+  t = prof_start(&w->prof);
+  faaln = adapter_align(w, &w->faaln, &w->fpicks[pair], &o->forward_adapters,
+      sqp->fseq, sqp->flen, &fadapter);
+  raaln = adapter_align(w, &w->raaln, &w->rpicks[pair], &o->reverse_adapters,
+      sqp->rseq, sqp->rlen, &radapter);
+  t = prof_end(&w->prof, PROF_ADAPTER_ALN, t);
+  //a read every candidate was skipped for only has a score bound
+  if(adapter_aligned(&w->fpicks[pair], o->adapter_thresh))
+    hist_add(&w->hists.adapter_score[0], faaln->score);
+  else
+    stats->num_adapter_unaligned++;
+  if(adapter_aligned(&w->rpicks[pair], o->adapter_thresh))
+    hist_add(&w->hists.adapter_score[1], raaln->score);
+  else
+    stats->num_adapter_unaligned++;
+
+  //overlaps can be as long as the longest read or adapter
+  size_t max_olap = max(max(sqp->flen, sqp->rlen),
+      (size_t)max(o->forward_adapters.max_len, o->reverse_adapters.max_len));
+  olap_table_reserve(adapter_olap, max_olap);
+  olap_table_reserve(reads_olap, max_olap);
+
+  if(fadapter == NULL)
+    fadapter = adapter_olap_pick(w, &o->forward_adapters, sqp->fseq, sqp->fqual, sqp->flen);
+  if(radapter == NULL)
+    radapter = adapter_olap_pick(w, &o->reverse_adapters, sqp->rseq, sqp->rqual, sqp->rlen);
+
+  //check for direct adapter match.
+  adapter_found = adapter_trim(&w->ol, sqp, o->min_ol_adapter,
+      fadapter->seq, fadapter->dummy_qual, fadapter->len,
+      radapter->seq, radapter->dummy_qual, radapter->len,
+      adapter_olap->min_match, adapter_olap->max_mismatch,
+      reads_olap->min_match, reads_olap->max_mismatch,
+      o->qcut, o->use_mask);
+  prof_end(&w->prof, PROF_ADAPTER_OLAP, t);
+  if(adapter_found ||
+      faaln->score >= o->adapter_thresh ||
+      raaln->score >= o->adapter_thresh){
+    stats->num_adapter++; //adapter present
+    //print it if user wants
+    if(o->pretty_print && pretty_print_room(w)){
+      unsigned long long num_pretty_print = 0;
+      if(faaln->score >= o->adapter_thresh){
+        num_pretty_print++;
+        pretty_print_alignment_stdaln(ppaw,sqp,faaln,true,false,false);
+      }
+      if(raaln->score >= o->adapter_thresh){
+        num_pretty_print++;
+        pretty_print_alignment_stdaln(ppaw,sqp,raaln,false,true,false);
+      }
+      pretty_print_group(b, num_pretty_print);
+    }
+
+    //do stuff to it
+    //assume full length adapter and squish it down to the read with no gaps
+    int rpos,fpos;
+    rpos = fpos = -1;
+    if(faaln->score >= o->adapter_thresh){
+      fpos = max(faaln->start1 - faaln->start2,0);
+    }
+    if(raaln->score >= o->adapter_thresh){
+      rpos = max(raaln->start1 - raaln->start2,0);
+    }
+
+    //make rlen the minimum of the two adapter search methods
+    if(rpos >= 0){
+      sqp->rlen = min(sqp->rlen,rpos);
+    }
+
+    //make flen the minimum of the two adapter search methods
+    if(fpos >= 0){
+      sqp->flen = min(sqp->flen,fpos);
+    }
+    if(sqp->flen < (size_t)untrim_flen)
+      hist_add(&w->hists.adapter_pos[0], sqp->flen);
+    if(sqp->rlen < (size_t)untrim_rlen)
+      hist_add(&w->hists.adapter_pos[1], sqp->rlen);
+
+    if(sqp->flen < o->min_read_len || sqp->rlen < o->min_read_len){
+      stats->num_discarded++;
+      if(o->write_discard){
+        write_fastq(dffqw, sqp->fid, untrim_fseq, untrim_fqual);
+        write_fastq(drfqw, sqp->rid, untrim_rseq, untrim_rqual);
+      }
+      return;
+    }else{ //trim the adapters
+      if(o->use_mask){  // Use base mask - do not trim
+        if (sqp->flen < untrim_flen)
+          sqp->flen = SQP_mask_tail(sqp, sqp->fseq, sqp->fqual, sqp->flen);
+        if (sqp->rlen < untrim_rlen)
+          sqp->rlen = SQP_mask_tail(sqp, sqp->rseq, sqp->rqual, sqp->rlen);
+
+      }
+      else{
+        sqp->fseq[sqp->flen] = '\0';
+        sqp->fqual[sqp->flen] = '\0';
+        sqp->rseq[sqp->rlen] = '\0';
+        sqp->rqual[sqp->rlen] = '\0';
+      }
+      SQP_rc_stale(sqp); //the RC read has to be redone from the trimmed one
+    }
+
+    //do a nice global alignment between two reads, and print consensus
+    SQP_rc(sqp);
+    int tmp_flen=sqp->flen;
+    int tmp_rclen=sqp->rlen;
+    char *aln_fseq = sqp->fseq;
+    char *aln_rcseq = sqp->rc_rseq;
+    int aln_flen = tmp_flen;
+    int aln_rclen = tmp_rclen;
+    char fseq[o->use_mask ? tmp_flen+1 : 1];
+    char rcseq[o->use_mask ? tmp_rclen+1 : 1];
+    if(o->use_mask){
+      // remove N's for alignment
+      int tmp_len=max(tmp_flen, tmp_rclen);
+      int k=0;
+      int j=0;
+      int i;
+      for(i=0;i<tmp_len;i++){
+        if(i<tmp_flen && (sqp->fseq[i] != 'N')){
+          fseq[k++]=sqp->fseq[i];
+        }
+        if(i<tmp_rclen && (sqp->rc_rseq[i] != 'N')){
+          rcseq[j++]=sqp->rc_rseq[i];
+        }
+      }
+      aln_fseq = fseq;
+      aln_rcseq = rcseq;
+      //only what was copied, the shorter read has no bases past its end to count as N
+      aln_flen = k;
+      aln_rclen = j;
+    }
+    //reads trimmed at the same insert end line up base for base, unless that
+    //ungapped overlap could be beaten by one with indels it is the alignment
+    t = prof_start(&w->prof);
+    stats->num_read_aln++;
+    fraln = NULL;
+    if(aln_flen == aln_rclen)
+      fraln = aln_ungapped_ws(w->aln_ws, w->fraln, aln_fseq, aln_rcseq, &aln_param_rd2rd, 1, aln_flen);
+    bool fast_aln = fraln != NULL;
+    if(fast_aln){
+      stats->num_read_aln_fast++;
+    }else{
+      //the score decides what happens to the pair, only a usable alignment needs its traceback
+      fraln = aln_stdaln_score_ws(w->aln_ws, w->fraln, aln_fseq, aln_rcseq, &aln_param_rd2rd,
+          ALN_TYPE_GLOBAL, 1, aln_flen, aln_rclen);
+    }
+
+    //calculate the minimum score we are willing to accept to merge the reads
+    //basically this is saying that 7/8 of the read must overlap perfectly
+
+    read_thresh = (((int)sqp->flen) + ((int)sqp->rlen)) -
+        (((int)sqp->flen) * o->read_frac_thresh * aln_param_rd2rd.gap_ext) -
+        (((int)sqp->rlen) * o->read_frac_thresh * aln_param_rd2rd.gap_ext) -
+        (aln_param_rd2rd.gap_open*2) - (aln_param_rd2rd.gap_end*2);
+    if(!fast_aln && fraln->score > read_thresh){
+      fraln = aln_stdaln_ws(w->aln_ws, w->fraln, aln_fseq, aln_rcseq, &aln_param_rd2rd,
+          ALN_TYPE_GLOBAL, 1, aln_flen, aln_rclen);
+    }
+    //now lets put something useful in the alignment suboptimal score thing since right now it
+    //is just left blank:
+    fraln->subo = read_thresh;
+    prof_end(&w->prof, PROF_READ_ALN, t);
+    hist_add(&w->hists.read_score, fraln->score);
+
+    if(o->do_read_merging && fraln->score > read_thresh){
+      //if we want read merging,
+      //and the alignment score is better than the threshold just calculated...
+
+      //write the merged sequence
+      t = prof_start(&w->prof);
+      fill_merged_sequence(sqp, fraln, true);
+      prof_end(&w->prof, PROF_MERGE, t);
+      if(o->pretty_print && pretty_print_room(w)){
+        pretty_print_alignment_stdaln(ppaw,sqp,fraln,false,false,true);
+        pretty_print_group(b, 1);
+      }
+      if(strlen(sqp->merged_seq) >= o->min_read_len && strlen(sqp->merged_qual) >= o->min_read_len){
+        stats->num_merged++;
+        write_merged(w, mfqw, sqp);
+      }
+      else{
+        stats->num_discarded++;
+        if(o->write_discard){
+          write_fastq(dffqw, sqp->fid, untrim_fseq, untrim_fqual);
+          write_fastq(drfqw, sqp->rid, untrim_rseq, untrim_rqual);
+        }
+      }
+    }else if(fraln->score > read_thresh){
+      // we know that the adapters are present, trimmed, and the resulting
+      // read lengths are both long enough to print.
+      // We also know that we aren't doing merging.
+      // Now we just need to print.
+      if(o->pretty_print && pretty_print_room(w)){
+        pretty_print_alignment_stdaln(ppaw,sqp,fraln,false,false,true);
+        pretty_print_group(b, 1);
+      }
+
+      //do end polishing to take care of examples like the following:
+      //          Read Alignment Score:59, Suboptimal Score:-85
+      //          ID:HWI-ST593:1:1101:14566:7002#ACA/1
+      //          READ1: ------------ATACAACTCGCTGACTTTGTCCTGGCATTTGACATATGCCTCGTAGTCTGCAAAGACTTTAAACCGGTCATGGTGGAACAGCATGTTGA
+      //                             ||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||
+      //          READ2: CTCTTCCGATCTATACAACTCGCTGACTTTGTCCTGGCATTTGACATATGCCTCGTAGTCTGCAAAGACTTTAAACCGGTCATGGTGGAACAGCATGTTG-
+
+      hist_add(&w->hists.insert_size, max(sqp->flen, sqp->rlen));
+      if(!o->use_mask){
+        t = prof_start(&w->prof);
+        make_blunt_ends(sqp,fraln);
+        prof_end(&w->prof, PROF_MERGE, t);
+      }
+
+      if(strlen(sqp->fseq) >= o->min_read_len &&
+          strlen(sqp->fqual) >= o->min_read_len &&
+          strlen(sqp->rseq) >= o->min_read_len &&
+          strlen(sqp->rqual) >= o->min_read_len){
+        write_pair(w, ffqw, rfqw, sqp);
+      }else{
+        stats->num_discarded++;
+        if(o->write_discard){
+          write_fastq(dffqw, sqp->fid, untrim_fseq, untrim_fqual);
+          write_fastq(drfqw, sqp->rid, untrim_rseq, untrim_rqual);
+        }
+      }
+
+
+    }else{ //there was a bad looking read-read alignment, so lets not risk it and junk it
+      stats->num_discarded++;
+      if(o->write_discard){
+        write_fastq(dffqw, sqp->fid, untrim_fseq, untrim_fqual);
+        write_fastq(drfqw, sqp->rid, untrim_rseq, untrim_rqual);
+      }
+    }
+  }else{
+    //no adapters present
+    //check for strong read overlap to assist trimming ends of adapters from end of read
+    if(o->do_read_merging){
+      bool ambiguous, merged;
+      t = prof_start(&w->prof);
+      merged = read_merge(&w->ol, sqp, o->min_ol_reads, reads_olap->min_match,
+          reads_olap->max_mismatch, o->qcut, &ambiguous);
+      prof_end(&w->prof, PROF_READ_OLAP, t);
+      if(merged){
+        //print merged output
+        if(strlen(sqp->merged_seq) >= o->min_read_len &&
+            strlen(sqp->merged_qual) >= o->min_read_len){
+          stats->num_merged++;
+          write_merged(w, mfqw, sqp);
+          if(o->pretty_print && pretty_print_room(w)){
+            pretty_print_alignment(ppaw,sqp,o->qcut,false); //false b/c merged input in fixed order
+            pretty_print_group(b, 1);
+          }
+        }else{
+          stats->num_discarded++;
+          if(o->write_discard){
+            write_fastq(dffqw, sqp->fid, untrim_fseq, untrim_fqual);
+            write_fastq(drfqw, sqp->rid, untrim_rseq, untrim_rqual);
+          }
+        }
+      }else{
+        //no significant overlap so just write them
+        if(ambiguous)
+          stats->num_too_ambiguous_to_merge++;
+        if(strlen(sqp->fseq) >= o->min_read_len &&
+            strlen(sqp->fqual) >= o->min_read_len &&
+            strlen(sqp->rseq) >= o->min_read_len &&
+            strlen(sqp->rqual) >= o->min_read_len){
+          write_pair(w, ffqw, rfqw, sqp);
+        }else{
+          stats->num_discarded++;
+          if(o->write_discard){
+            write_fastq(dffqw, sqp->fid, untrim_fseq, untrim_fqual);
+            write_fastq(drfqw, sqp->rid, untrim_rseq, untrim_rqual);
+          }
+        }
+
+      }
+      //done
+      return;
+    }else{ //just write reads to output fastqs
+      if(strlen(sqp->fseq) >= o->min_read_len &&
+          strlen(sqp->fqual) >= o->min_read_len &&
+          strlen(sqp->rseq) >= o->min_read_len &&
+          strlen(sqp->rqual) >= o->min_read_len){
+        write_pair(w, ffqw, rfqw, sqp);
+      }else{
+        stats->num_discarded++;
+        if(o->write_discard){
+          write_fastq(dffqw, sqp->fid, untrim_fseq, untrim_fqual);
+          write_fastq(drfqw, sqp->rid, untrim_rseq, untrim_rqual);
+        }
+      }
+      return;
+    }
+  }
+  //the alignments belong to the worker and are reused for the next pair
+}
+
+
+/**
+ * Pipeline reader: pull the next batch of pairs off of the input files
+ */
+static int read_batch(void *batch, void *ctx){
+  SeqBatch *b = (SeqBatch*)batch;
+  SeqPrepIO *io = (SeqPrepIO*)ctx;
+  uint64_t t;
+  b->n = 0;
+  while(!io->eof && b->n < PAIRS_PER_BATCH){
+    t = prof_start(&io->read_prof);
+    if(!next_fastqs( io->ffq, io->rfq, b->sqps[b->n], io->opts->p64 )){ //returns false when done
+      io->eof = true;
+      break;
+    }
+    t = prof_end(&io->read_prof, PROF_PARSE, t);
+    if(io->opts->display_spinner)
+      update_spinner(io->num_read);
+    //checked here so the first of a set of duplicates is the one kept, however many threads there are
+    if(io->opts->dedup){
+      SQP sqp = b->sqps[b->n];
+      b->dup[b->n] = dup_table_seen(&io->dups, sqp->fseq, sqp->flen, sqp->rseq, sqp->rlen);
+      io->num_dups += b->dup[b->n];
+      prof_end(&io->read_prof, PROF_DEDUP, t);
+    }
+    io->num_read++;
+    b->n++;
+  }
+  return b->n;
+}
+
+/**
+ * Pipeline worker: trim/merge every pair of a batch
+ */
+static void process_batch(void *batch, void *worker){
+  SeqBatch *b = (SeqBatch*)batch;
+  SeqPrepWorker *w = (SeqPrepWorker*)worker;
+  int i;
+  uint64_t t = prof_start(&w->prof);
+  b->n_pp = 0;
+  for(i=0;i<b->n;i++)
+    keep_untrimmed(b->sqps[i]);
+  if(w->opts->demux)
+    demux_batch(w, b);
+  for(i=0;i<b->n;i++)
+    w->drop[i] = prepare_pair(w, b->sqps[i], b->dup[i]);
+  t = prof_end(&w->prof, PROF_PREPARE, t);
+  //the untrimmed reads of the whole batch go against the adapters up front
+  adapter_bounds(w, b, true, w->fpicks);
+  adapter_bounds(w, b, false, w->rpicks);
+  prof_end(&w->prof, PROF_ADAPTER_SCREEN, t);
+  for(i=0;i<b->n;i++)
+    process_pair(w, b, i);
+}
+
+/**
+ * Pipeline writer: called in input order so the output is the
+ * same no matter how many workers there are
+ */
+static void write_batch(void *batch, void *ctx){
+  SeqBatch *b = (SeqBatch*)batch;
+  SeqPrepIO *io = (SeqPrepIO*)ctx;
+  int i;
+  uint64_t t = prof_start(&io->write_prof);
+  for(i=0;i<io->n_outs;i++){
+    if(i == OUT_PRETTY || io->outs[i] == NULL)
+      continue;
+    if(b->out[i].l > 0)
+      out_write(io->outs[i], b->out[i].s, b->out[i].l);
+    b->out[i].l = 0;
+  }
+  if(io->outs[OUT_PRETTY] != NULL){
+    size_t start = 0;
+    for(i=0;i<b->n_pp;i++){
+      if(io->num_pretty_print < io->opts->max_pretty_print){
+        if(b->pp_end[i] > start)
+          out_write(io->outs[OUT_PRETTY], b->out[OUT_PRETTY].s + start, b->pp_end[i] - start);
+        __sync_fetch_and_add(&io->num_pretty_print, b->pp_count[i]);
+      }
+      start = b->pp_end[i];
+    }
+  }
+  b->out[OUT_PRETTY].l = 0;
+  b->n_pp = 0;
+  prof_end(&io->write_prof, PROF_WRITE, t);
+}
+
+/**
+ * Name of one of the output files of a set: for a sample the sample
+ * name and an underscore go in front of the file name part of fn
+ */
+static void set_fn(char *dst, const char *fn, const char *sample){
+  const char *base = strrchr(fn, '/');
+  if(sample == NULL){
+    strcpy(dst, fn);
+    return;
+  }
+  base = base ? base + 1 : fn;
+  sprintf(dst, "%.*s%s_%s", (int)(base - fn), fn, sample, base);
+}
+
+/**
+ * Writes the JSON report (-l): the counters of the stderr summary, how
+ * long the run took and how much memory it used, and the histograms
+ */
+static void write_report(FILE *fp, const SeqPrepOpts *o, const SeqPrepIO *io,
+    const SeqPrepStats *total, const SeqPrepHists *h, const unsigned long long *set_pairs,
+    double wall_seconds, double cpu_seconds){
+  JsonOut j;
+  int i;
+  json_init(&j, fp);
+  json_begin(&j, NULL);
+  json_string(&j, "program", "SeqPrep");
+  json_begin(&j, "pairs");
+  json_int(&j, "processed", total->num_pairs);
+  json_int(&j, "merged", total->num_merged);
+  json_int(&j, "with_adapters", total->num_adapter);
+  json_int(&j, "discarded", total->num_discarded);
+  json_int(&j, "too_ambiguous_to_merge", total->num_too_ambiguous_to_merge);
+  json_int(&j, "low_complexity", total->num_low_complexity);
+  json_int(&j, "duplicates", io->num_dups);
+  json_end(&j);
+  json_begin(&j, "trimming");
+  json_int(&j, "reads_quality_trimmed", total->num_qtrim_reads);
+  json_int(&j, "bases_quality_trimmed", total->num_qtrim_bases);
+  json_int(&j, "reads_tail_trimmed", total->num_tail_reads);
+  json_int(&j, "bases_tail_trimmed", total->num_tail_bases);
+  json_end(&j);
+  json_begin(&j, "alignments");
+  json_int(&j, "adapter_skipped", total->num_adapter_aln_skipped);
+  json_int(&j, "adapter_bounded", total->num_adapter_aln_bounded);
+  json_int(&j, "adapter_unaligned_reads", total->num_adapter_unaligned);
+  json_int(&j, "read", total->num_read_aln);
+  json_int(&j, "read_fast", total->num_read_aln_fast);
+  json_end(&j);
+  if(o->demux){
+    json_begin(&j, "samples");
+    json_int(&j, "barcodes_corrected", total->num_barcode_corrected);
+    for(i=0;i<o->n_sets;i++)
+      json_int(&j, i < o->samples.n ? o->samples.names[i] : DEMUX_UNDETERMINED, set_pairs[i]);
+    json_end(&j);
+  }
+  json_begin(&j, "time");
+  json_double(&j, "wall_seconds", wall_seconds);
+  json_double(&j, "cpu_seconds", cpu_seconds);
+  json_end(&j);
+  json_int(&j, "peak_rss_kb", report_peak_rss_kb());
+  json_begin(&j, "histograms");
+  json_hist(&j, "insert_size", &h->insert_size);
+  json_hist(&j, "merged_length", &h->merged_len);
+  json_hist(&j, "trimmed_length_1", &h->trimmed_len[0]);
+  json_hist(&j, "trimmed_length_2", &h->trimmed_len[1]);
+  json_hist(&j, "adapter_position_1", &h->adapter_pos[0]);
+  json_hist(&j, "adapter_position_2", &h->adapter_pos[1]);
+  json_hist(&j, "adapter_score_1", &h->adapter_score[0]);
+  json_hist(&j, "adapter_score_2", &h->adapter_score[1]);
+  json_hist(&j, "read_alignment_score", &h->read_score);
+  json_end(&j);
+  json_end(&j);
+}
+
+
+int main( int argc, char* argv[] ) {
+  SeqPrepOpts opts;
+  SeqPrepOpts *o = &opts;
+  SeqPrepStats total;
+  SeqPrepIO io;
+  int num_threads = DEF_THREADS;
+  unsigned long long index_interval = 0;
+  bool interleave_in = false;
+  bool uncompressed = false;
   clock_t start, end;
-  //init to 0
-  num_pairs = num_merged = num_adapter = num_discarded = num_too_ambiguous_to_merge = 0;
+  double wall_start;
+  int exit_code = 0;
+  memset(&opts, 0, sizeof(opts));
+  memset(&total, 0, sizeof(total));
+  memset(&io, 0, sizeof(io));
+  o->max_pretty_print = DEF_MAX_PRETTY_PRINT;
+  o->adapter_thresh = DEF_ADAPTER_SCORE_THRES;
   extern char* optarg;
-  bool p64 = false;
   char forward_fn[MAX_FN_LEN];
   char reverse_fn[MAX_FN_LEN];
   char forward_out_fn[MAX_FN_LEN];
@@ -120,50 +1190,36 @@ int main( int argc, char* argv[] ) {
   char forward_discard_fn[MAX_FN_LEN];
   char reverse_discard_fn[MAX_FN_LEN];
   char merged_out_fn[MAX_FN_LEN];
-  bool do_read_merging = false;
-  bool print_overhang = false;
-  bool write_discard=false;
-  bool use_mask=false;
-  char forward_primer[MAX_SEQ_LEN+1];
-  strcpy(forward_primer, DEF_FORWARD_PRIMER); //set default
-  char forward_primer_dummy_qual[MAX_SEQ_LEN+1];
-  char reverse_primer[MAX_SEQ_LEN+1];
-  strcpy(reverse_primer, DEF_REVERSE_PRIMER); //set default
-  char reverse_primer_dummy_qual[MAX_SEQ_LEN+1];
-  int i;
-  for(i=0;i<MAX_SEQ_LEN+1;i++){
-    forward_primer_dummy_qual[i] = 'N';//phred score of 45
-    reverse_primer_dummy_qual[i] = 'N';
-  }
+  char *forward_primer = DEF_FORWARD_PRIMER; //set default
+  char *reverse_primer = DEF_REVERSE_PRIMER; //set default
+  char *forward_adapter_fn = NULL;
+  char *reverse_adapter_fn = NULL;
+  char *sample_sheet_fn = NULL;
+  int barcode_mismatch = DEF_BARCODE_MISMATCH;
+  long dedup_mb = 0;
+  char *report_fn = NULL;
+  FILE *report_fp = NULL;
+  char set_out_fn[MAX_FN_LEN + MAX_SAMPLE_NAME + 2];
+  int i, j;
   int ich;
-  int min_ol_adapter = DEF_OL2MERGE_ADAPTER;
-  int min_ol_reads = DEF_OL2MERGE_READS;
-  unsigned short int min_read_len =DEF_MIN_READ_LEN;
-  float min_match_adapter_frac = DEF_MIN_MATCH_ADAPTER;
-  float min_match_reads_frac = DEF_MIN_MATCH_READS;
-  float max_mismatch_adapter_frac = DEF_MAX_MISMATCH_ADAPTER;
-  float max_mismatch_reads_frac = DEF_MAX_MISMATCH_READS;
-
-  float read_frac_thresh = DEF_READ_GAP_FRAC_CUTOFF;
-  unsigned short max_mismatch_adapter[MAX_SEQ_LEN+1];
-  unsigned short max_mismatch_reads[MAX_SEQ_LEN+1];
-  unsigned short min_match_adapter[MAX_SEQ_LEN+1];
-  unsigned short min_match_reads[MAX_SEQ_LEN+1];
-  char qcut = (char)DEF_QCUT+33;
-  bool pretty_print = false;
-  bool display_spinner = false;
+  o->min_ol_adapter = DEF_OL2MERGE_ADAPTER;
+  o->min_ol_reads = DEF_OL2MERGE_READS;
+  o->min_read_len =DEF_MIN_READ_LEN;
+  o->min_match_adapter_frac = DEF_MIN_MATCH_ADAPTER;
+  o->min_match_reads_frac = DEF_MIN_MATCH_READS;
+  o->max_mismatch_adapter_frac = DEF_MAX_MISMATCH_ADAPTER;
+  o->max_mismatch_reads_frac = DEF_MAX_MISMATCH_READS;
+
+  o->read_frac_thresh = DEF_READ_GAP_FRAC_CUTOFF;
+  o->qcut = (char)DEF_QCUT+33;
   char pretty_print_fn[MAX_FN_LEN+1];
-  SQP sqp = SQP_init();
-  char untrim_fseq[MAX_SEQ_LEN+1];
-  char untrim_fqual[MAX_SEQ_LEN+1];
-  char untrim_rseq[MAX_SEQ_LEN+1];
-  char untrim_rqual[MAX_SEQ_LEN+1];
+  forward_fn[0] = reverse_fn[0] = forward_out_fn[0] = reverse_out_fn[0] = '\0';
   /* No args - help!  */
   if ( argc == 1 ) {
     help(argv[0]);
   }
   int req_args = 0;
-  while( (ich=getopt( argc, argv, "f:r:1:2:3:4:q:A:s:y:B:O:E:x:M:N:L:o:m:b:w:W:p:P:X:Q:t:e:Z:n:S6ghz" )) != -1 ) {
+  while( (ich=getopt( argc, argv, "f:r:1:2:3:4:q:A:s:y:B:F:R:O:E:x:M:N:L:o:m:b:w:W:p:P:X:Q:t:e:Z:n:T:k:i:j:D:K:Y:J:G:H:C:d:l:uS6ghzIac" )) != -1 ) {
     switch( ich ) {
 
     //REQUIRED ARGUMENTS
@@ -183,47 +1239,118 @@ int main( int argc, char* argv[] ) {
       req_args ++;
       strcpy(reverse_out_fn, optarg);
       break;
+    case 'i' :
+      req_args += 2;
+      interleave_in = true;
+      strcpy(forward_fn, optarg);
+      strcpy(reverse_fn, optarg);
+      break;
+    case 'j' :
+      req_args += 2;
+      o->interleave_out = true;
+      strcpy(forward_out_fn, optarg);
+      strcpy(reverse_out_fn, optarg);
+      break;
 
       //OPTIONAL GENERAL ARGUMENTS
     case 'S':
-      display_spinner = true;
+      o->display_spinner = true;
+      break;
+    case 'T':
+      num_threads = atoi(optarg);
+      if(num_threads < 1)
+        num_threads = 1;
+      break;
+    case 'u':
+      uncompressed = true;
+      break;
+    case 'k':
+      index_interval = strtoull(optarg, NULL, 10);
+      if(index_interval < 1){
+        fprintf(stderr, "-k needs a record interval of at least 1\n");
+        exit(1);
+      }
+      break;
+    case 'D':
+      sample_sheet_fn = optarg;
+      break;
+    case 'I':
+      o->inline_barcode = true;
+      break;
+    case 'K':
+      barcode_mismatch = atoi(optarg);
       break;
     case '3' :
-      write_discard=true;
+      o->write_discard=true;
       strcpy(forward_discard_fn, optarg);
       break;
     case '4' :
-      write_discard=true;
+      o->write_discard=true;
       strcpy(reverse_discard_fn, optarg);
       break;
     case 'h' :
       help(argv[0]);
       break;
     case '6' :
-      p64 = true;
+      o->p64 = true;
       break;
     case 'q' :
-      qcut = atoi(optarg)+33;
+      o->qcut = atoi(optarg)+33;
       break;
     case 'L' :
-      min_read_len = atoi(optarg);
+      o->min_read_len = atoi(optarg);
+      break;
+    case 'Y' :
+      o->qtrim = atoi(optarg)+33;
+      break;
+    case 'J' :
+      o->qtrim_window = atoi(optarg);
+      break;
+    case 'G' :
+      o->polyg_len = atoi(optarg);
+      break;
+    case 'H' :
+      o->polyx_len = atoi(optarg);
+      break;
+    case 'C' :
+      o->min_entropy = atof(optarg);
+      break;
+    case 'd' :
+      o->dedup = true;
+      dedup_mb = atol(optarg);
+      break;
+    case 'a' :
+      o->tag_dups = true;
+      break;
+    case 'c' :
+      o->profile = true;
+      break;
+    case 'l' :
+      o->report = true;
+      report_fn = optarg;
       break;
 
       //OPTIONAL ADAPTER/PRIMER TRIMMING ARGUMENTS
     case 'A':
-      strcpy(forward_primer, optarg);
+      forward_primer = optarg;
       break;
     case 'B':
-      strcpy(reverse_primer, optarg);
+      reverse_primer = optarg;
+      break;
+    case 'F':
+      forward_adapter_fn = optarg;
+      break;
+    case 'R':
+      reverse_adapter_fn = optarg;
       break;
     case 'O':
-      min_ol_adapter = atoi(optarg);
+      o->min_ol_adapter = atoi(optarg);
       break;
     case 'M':
-      max_mismatch_adapter_frac = atof(optarg);
+      o->max_mismatch_adapter_frac = atof(optarg);
       break;
     case 'N':
-      min_match_adapter_frac = atof(optarg);
+      o->min_match_adapter_frac = atof(optarg);
       break;
     case 'b':
       aln_param_nt2nt.band_width = atoi(optarg);
@@ -238,7 +1365,7 @@ int main( int argc, char* argv[] ) {
       aln_param_nt2nt.gap_end = atoi(optarg);
       break;
     case 'Z':
-      adapter_thresh = atoi(optarg);
+      o->adapter_thresh = atoi(optarg);
       break;
 
 
@@ -255,10 +1382,10 @@ int main( int argc, char* argv[] ) {
       aln_param_rd2rd.gap_end = atoi(optarg);
       break;
     case 'X':
-      read_frac_thresh = atof(optarg);
+      o->read_frac_thresh = atof(optarg);
       break;
     case 'z':
-      use_mask = true;
+      o->use_mask = true;
       break;
 
       //OPTIONAL MERGING ARGUMENTS
@@ -266,27 +1393,27 @@ int main( int argc, char* argv[] ) {
       maximum_quality = optarg[0];
       break;
     case 'g' :
-      print_overhang = true;
+      o->print_overhang = true;
       break;
     case 's' :
-      do_read_merging = true;
+      o->do_read_merging = true;
       strcpy( merged_out_fn, optarg );
       break;
     case 'o':
-      min_ol_reads = atoi(optarg);
+      o->min_ol_reads = atoi(optarg);
       break;
     case 'm':
-      max_mismatch_reads_frac = atof(optarg);
+      o->max_mismatch_reads_frac = atof(optarg);
       break;
     case 'n':
-      min_match_reads_frac = atof(optarg);
+      o->min_match_reads_frac = atof(optarg);
       break;
     case 'E':
-      pretty_print = true;
+      o->pretty_print = true;
       strcpy(pretty_print_fn,optarg);
       break;
     case 'x':
-      max_pretty_print = atol(optarg);
+      o->max_pretty_print = atol(optarg);
       break;
 
 
@@ -298,7 +1425,77 @@ int main( int argc, char* argv[] ) {
     fprintf(stderr, "Missing a required argument!\n");
     help(argv[0]);
   }
+  if(req_args > 4){
+    fprintf(stderr, "-i can't be used with -f/-r and -j can't be used with -1/-2\n");
+    exit(1);
+  }
+  if(uncompressed && index_interval){
+    fprintf(stderr, "-k writes BGZF so it can't be used with -u\n");
+    exit(1);
+  }
+  if(o->inline_barcode && !sample_sheet_fn){
+    fprintf(stderr, "-I needs a sample sheet given with -D\n");
+    exit(1);
+  }
+  if(o->qtrim_window && !o->qtrim){
+    fprintf(stderr, "-J needs a quality cutoff given with -Y\n");
+    exit(1);
+  }
+  if(o->qtrim_window < 0){
+    fprintf(stderr, "-J needs a window of at least 1 base\n");
+    exit(1);
+  }
+  if(o->tag_dups && !o->dedup){
+    fprintf(stderr, "-a needs the duplicate check turned on with -d\n");
+    exit(1);
+  }
+  if(o->dedup && !dup_table_init(&io.dups, (size_t)max(dedup_mb, 0) << 20)){
+    fprintf(stderr, "-d needs at least 1 megabyte that can be allocated\n");
+    exit(1);
+  }
+  if(o->polyg_len < 0 || o->polyx_len < 0){
+    fprintf(stderr, "-G and -H need a tail length of at least 1\n");
+    exit(1);
+  }
+  if(barcode_mismatch < 0 || barcode_mismatch > 1){
+    fprintf(stderr, "-K can only allow 0 or 1 barcode mismatches\n");
+    exit(1);
+  }
+  if(!interleave_in && strcmp(forward_fn, "-") == 0 && strcmp(reverse_fn, "-") == 0){
+    fprintf(stderr, "Only one of -f and -r can be read from stdin, use -i for interleaved input\n");
+    exit(1);
+  }
+  {
+    //at most one output can go to stdout
+    int n_stdout = 0;
+    n_stdout += strcmp(forward_out_fn, "-") == 0;
+    n_stdout += !o->interleave_out && strcmp(reverse_out_fn, "-") == 0;
+    n_stdout += o->do_read_merging && strcmp(merged_out_fn, "-") == 0;
+    n_stdout += o->pretty_print && strcmp(pretty_print_fn, "-") == 0;
+    n_stdout += o->write_discard && strcmp(forward_discard_fn, "-") == 0;
+    n_stdout += o->write_discard && strcmp(reverse_discard_fn, "-") == 0;
+    n_stdout += o->report && strcmp(report_fn, "-") == 0;
+    if(n_stdout > 1){
+      fprintf(stderr, "Only one output can be written to stdout\n");
+      exit(1);
+    }
+    //every sample has files of its own
+    if(sample_sheet_fn && n_stdout > (o->pretty_print && strcmp(pretty_print_fn, "-") == 0) +
+        (o->report && strcmp(report_fn, "-") == 0)){
+      fprintf(stderr, "Only the -E or -l output can be written to stdout with -D\n");
+      exit(1);
+    }
+  }
+  if(o->report){
+    report_fp = strcmp(report_fn, "-") == 0 ? stdout : fopen(report_fn, "w");
+    if(report_fp == NULL){
+      fprintf(stderr, "%s\n", report_fn);
+      perror("Cannot open report file");
+      exit(1);
+    }
+  }
   start = clock();
+  wall_start = report_wall_seconds();
   //allocate alignment memory
 
   //  int min_match = 8;
@@ -309,358 +1506,259 @@ int main( int argc, char* argv[] ) {
   //
 
 
-  //Calculate table matching overlap length to min matches and max mismatches
-  for(i=0;i<MAX_SEQ_LEN+1;i++){
-    max_mismatch_reads[i] = floor(((float)i)*max_mismatch_reads_frac);
-    max_mismatch_adapter[i] = floor(((float)i)*max_mismatch_adapter_frac);
-    min_match_reads[i] = ceil(((float)i)*min_match_reads_frac);
-    min_match_adapter[i] = ceil(((float)i)*min_match_adapter_frac);
+  //an adapter FASTA takes the place of -A/-B for its read
+  if(forward_adapter_fn){
+    if(!adapter_set_read_fasta(&o->forward_adapters, forward_adapter_fn))
+      exit(1);
+  }else{
+    adapter_set_add(&o->forward_adapters, "A", forward_primer);
   }
-  //get length of forward and reverse primers
-  int forward_primer_len = strlen(forward_primer);
-  int reverse_primer_len = strlen(reverse_primer);
-
-
-  gzFile ffq = fileOpen(forward_fn, "r");
-  gzFile ffqw = fileOpen(forward_out_fn,"w");
-  gzFile rfq = fileOpen(reverse_fn, "r");
-  gzFile rfqw = fileOpen(reverse_out_fn,"w");
-  gzFile mfqw = NULL;
-  gzFile ppaw = NULL;
-  gzFile dffqw = NULL;
-  gzFile drfqw = NULL;
-  if(do_read_merging)
-    mfqw = fileOpen(merged_out_fn,"w");
-  if(pretty_print)
-    ppaw = fileOpen(pretty_print_fn,"w");
-  if(write_discard){
-    dffqw = fileOpen(forward_discard_fn,"w");
-    drfqw = fileOpen(reverse_discard_fn,"w");    
+  if(reverse_adapter_fn){
+    if(!adapter_set_read_fasta(&o->reverse_adapters, reverse_adapter_fn))
+      exit(1);
+  }else{
+    adapter_set_add(&o->reverse_adapters, "B", reverse_primer);
   }
+  adapter_set_prepare(&o->forward_adapters, &aln_param_nt2nt, o->adapter_thresh, o->min_ol_adapter);
+  adapter_set_prepare(&o->reverse_adapters, &aln_param_nt2nt, o->adapter_thresh, o->min_ol_adapter);
 
+  o->n_sets = 1;
+  if(sample_sheet_fn){
+    if(!sample_sheet_read(&o->samples, sample_sheet_fn, barcode_mismatch))
+      exit(1);
+    if(o->inline_barcode && o->samples.barcode_len <= 0){
+      fprintf(stderr, "Inline barcodes (-I) all have to be the same length\n");
+      exit(1);
+    }
+    o->demux = true;
+    o->n_sets = o->samples.n + 1;
+  }
 
-  /**
-   * Loop over all of the reads
-   */
-  while(next_fastqs( ffq, rfq, sqp, p64 )){ //returns false when done
-    if(display_spinner)
-      update_spinner(num_pairs++);  
-
-    AlnAln *faaln, *raaln, *fraln;
-
-    //save a copy of the original sequences/qualities first
-    strcpy(untrim_fseq,sqp->fseq);
-    strcpy(untrim_fqual,sqp->fqual);
-    strcpy(untrim_rseq,sqp->rseq);
-    strcpy(untrim_rqual,sqp->rqual);
-
-    //save original length
-    int untrim_flen=sqp->flen;
-    int untrim_rlen=sqp->rlen;
-
-    faaln = aln_stdaln_aux(sqp->fseq, forward_primer, &aln_param_nt2nt,
-        ALN_TYPE_LOCAL, adapter_thresh , sqp->flen, forward_primer_len);
-    raaln = aln_stdaln_aux(sqp->rseq, reverse_primer, &aln_param_nt2nt,
-        ALN_TYPE_LOCAL, adapter_thresh, sqp->rlen, reverse_primer_len);
-
-    //check for direct adapter match.
-    if(adapter_trim(sqp, min_ol_adapter,
-        forward_primer, forward_primer_dummy_qual,
-        forward_primer_len,
-        reverse_primer, reverse_primer_dummy_qual,
-        reverse_primer_len,
-        min_match_adapter,
-        max_mismatch_adapter,
-        min_match_reads,
-        max_mismatch_reads,
-        qcut, use_mask) ||
-        faaln->score >= adapter_thresh ||
-        raaln->score >= adapter_thresh){
-      num_adapter++; //adapter present
-      //print it if user wants
-      if(pretty_print && num_pretty_print < max_pretty_print){
-        //void pretty_print_alignment_stdaln(gzFile out, SQP sqp, AlnAln *aln, bool first_adapter, bool second_adapter)
-        if(faaln->score >= adapter_thresh){
-          num_pretty_print++;
-          pretty_print_alignment_stdaln(ppaw,sqp,faaln,true,false,false);
-        }
-        if(raaln->score >= adapter_thresh){
-          num_pretty_print++;
-          pretty_print_alignment_stdaln(ppaw,sqp,raaln,false,true,false);
-        }
-      }
-
-      //do stuff to it
-      //assume full length adapter and squish it down to the read with no gaps
-      int rpos,fpos;
-      rpos = fpos = (- MAX_SEQ_LEN);
-      if(faaln->score >= adapter_thresh){
-        fpos = max(faaln->start1 - faaln->start2,0);
-      }
-      if(raaln->score >= adapter_thresh){
-        rpos = max(raaln->start1 - raaln->start2,0);
-      }
-
-      //make rlen the minimum of the two adapter search methods
-      if(rpos >= 0){
-        sqp->rlen = min(sqp->rlen,rpos);
-      }
-
-      //make flen the minimum of the two adapter search methods
-      if(fpos >= 0){
-        sqp->flen = min(sqp->flen,fpos);
-      }
-
-      if(sqp->flen < min_read_len || sqp->rlen < min_read_len){
-        num_discarded++;
-        if(write_discard){
-          write_fastq(dffqw, sqp->fid, untrim_fseq, untrim_fqual);
-          write_fastq(drfqw, sqp->rid, untrim_rseq, untrim_rqual);
-        }
-        goto CLEAN_ADAPTERS;
-      }else{ //trim the adapters
-        if(use_mask){  // Use base mask - do not trim
-          int mask_iter;
-          int sz_sqp = sizeof(sqp->fseq);
-          if (sqp->flen < untrim_flen){
-            for(mask_iter = sqp->flen ; mask_iter < sz_sqp && (sqp->fseq[mask_iter] != '\0'); mask_iter++){
-              sqp->fseq[mask_iter]='N';
-            }
-            sqp->flen=mask_iter;
-          }
-          if (sqp->rlen < untrim_rlen){
-            sz_sqp = sizeof(sqp->rseq);
-            for(mask_iter = sqp->rlen ; mask_iter < sz_sqp && (sqp->rseq[mask_iter] != '\0'); mask_iter++){
-              sqp->rseq[mask_iter]='N';
-            }
-            sqp->rlen=mask_iter;
-          }
-          
-        }
-        else{
-          sqp->fseq[sqp->flen] = '\0';
-          sqp->fqual[sqp->flen] = '\0';
-          sqp->rseq[sqp->rlen] = '\0';
-          sqp->rqual[sqp->rlen] = '\0';
-        }
-        strncpy(sqp->rc_rseq,sqp->rseq,sqp->rlen+1); //move regular reads now trimmed into RC read's place
-        strncpy(sqp->rc_rqual,sqp->rqual,sqp->rlen+1);
-        rev_qual(sqp->rc_rqual, sqp->rlen);        //amd re-reverse the RC reads
-        revcom_seq(sqp->rc_rseq, sqp->rlen);
-      }
-
-      //do a nice global alignment between two reads, and print consensus
-      if(use_mask){
-              // remove N's for alignment
-              int tmp_flen=sizeof(sqp->fseq);
-              int tmp_rclen=sizeof(sqp->rc_rseq);
-              int tmp_len=max(tmp_flen, tmp_rclen);
-              char fseq[tmp_flen];
-              char rcseq[tmp_rclen];
-              int fNct=0;
-              int rcNct=0;
-              int k=0;
-              int j=0;
-              int i;
-              for(i=0;i<tmp_len;i++){
-                    if(i<tmp_flen && (sqp->fseq[i] != 'N')){
-                          fseq[k++]=sqp->fseq[i];
-                    }
-                    else{
-                          fNct++;
-                    }
-                    if(i<tmp_rclen && (sqp->rc_rseq[i] != 'N')){
-                          rcseq[j++]=sqp->rc_rseq[i];
-                    }
-                    else{
-                          rcNct++;
-                    }
-              }
-	      fraln = aln_stdaln_aux(fseq, rcseq, &aln_param_rd2rd,
-		  ALN_TYPE_GLOBAL, 1, tmp_flen-fNct, tmp_rclen - rcNct );
-
-      }else{
-	      fraln = aln_stdaln_aux(sqp->fseq, sqp->rc_rseq, &aln_param_rd2rd,
-		  ALN_TYPE_GLOBAL, 1, sqp->flen, sqp->rlen);
-      }
-
-      //calculate the minimum score we are willing to accept to merge the reads
-      //basically this is saying that 7/8 of the read must overlap perfectly
-
-      read_thresh = (((int)sqp->flen) + ((int)sqp->rlen)) -
-          (((int)sqp->flen) * read_frac_thresh * aln_param_rd2rd.gap_ext) -
-          (((int)sqp->rlen) * read_frac_thresh * aln_param_rd2rd.gap_ext) -
-          (aln_param_rd2rd.gap_open*2) - (aln_param_rd2rd.gap_end*2);
-      //now lets put something useful in the alignment suboptimal score thing since right now it
-      //is just left blank:
-      //fprintf(stderr, "rt:%d\tfl:%d\trl:%d\trft:%f\tgx:%d\tgo:%d\tge%d\n", read_thresh,((int)sqp->flen),((int)sqp->rlen),read_frac_thresh,aln_param_rd2rd.gap_ext,aln_param_rd2rd.gap_open,aln_param_rd2rd.gap_end);
-      fraln->subo = read_thresh;
-
-      if(do_read_merging && fraln->score > read_thresh){
-        //if we want read merging,
-        //and the alignment score is better than the threshold just calculated...
-
-        //write the merged sequence
-        fill_merged_sequence(sqp, fraln, true);
-        if(pretty_print && num_pretty_print < max_pretty_print){
-          num_pretty_print++;
-          pretty_print_alignment_stdaln(ppaw,sqp,fraln,false,false,true);
-        }
-        if(strlen(sqp->merged_seq) >= min_read_len && strlen(sqp->merged_qual) >= min_read_len){
-          num_merged++;
-          write_fastq(mfqw,sqp->fid,sqp->merged_seq,sqp->merged_qual);
-        }
-        else{
-          num_discarded++;
-          if(write_discard){
-            write_fastq(dffqw, sqp->fid, untrim_fseq, untrim_fqual);
-            write_fastq(drfqw, sqp->rid, untrim_rseq, untrim_rqual);
-          }
-        }
-      }else if(fraln->score > read_thresh){
-        // we know that the adapters are present, trimmed, and the resulting
-        // read lengths are both long enough to print.
-        // We also know that we aren't doing merging.
-        // Now we just need to print.
-        if(pretty_print && num_pretty_print < max_pretty_print){
-          num_pretty_print++;
-          pretty_print_alignment_stdaln(ppaw,sqp,fraln,false,false,true);
-        }
-
-
-
-
-        //do end polishing to take care of examples like the following:
-        //          Read Alignment Score:59, Suboptimal Score:-85
-        //          ID:HWI-ST593:1:1101:14566:7002#ACA/1
-        //          READ1: ------------ATACAACTCGCTGACTTTGTCCTGGCATTTGACATATGCCTCGTAGTCTGCAAAGACTTTAAACCGGTCATGGTGGAACAGCATGTTGA
-        //                             ||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||||
-        //          READ2: CTCTTCCGATCTATACAACTCGCTGACTTTGTCCTGGCATTTGACATATGCCTCGTAGTCTGCAAAGACTTTAAACCGGTCATGGTGGAACAGCATGTTG-
-
-
-	if(!use_mask)
-		make_blunt_ends(sqp,fraln);
-
-        if(strlen(sqp->fseq) >= min_read_len &&
-            strlen(sqp->fqual) >= min_read_len &&
-            strlen(sqp->rseq) >= min_read_len &&
-            strlen(sqp->rqual) >= min_read_len){
-          write_fastq(ffqw, sqp->fid, sqp->fseq, sqp->fqual);
-          write_fastq(rfqw, sqp->rid, sqp->rseq, sqp->rqual);
-        }else{
-          num_discarded++;
-          if(write_discard){
-            write_fastq(dffqw, sqp->fid, untrim_fseq, untrim_fqual);
-            write_fastq(drfqw, sqp->rid, untrim_rseq, untrim_rqual);
-          }
-        }
-
-
-      }else{ //there was a bad looking read-read alignment, so lets not risk it and junk it
-        num_discarded++;
-        if(write_discard){
-          //write_fastq(dffqw, sqp->fid, sqp->fseq, sqp->fqual);
-          //write_fastq(drfqw, sqp->rid, sqp->rseq, sqp->rqual);
-          write_fastq(dffqw, sqp->fid, untrim_fseq, untrim_fqual);
-          write_fastq(drfqw, sqp->rid, untrim_rseq, untrim_rqual);
-        }
-      }
-    }else{
-      //no adapters present
-      //check for strong read overlap to assist trimming ends of adapters from end of read
-      if(do_read_merging){
-        if(read_merge(sqp, min_ol_reads, min_match_reads, max_mismatch_reads, qcut)){
-          //print merged output
-          if(strlen(sqp->merged_seq) >= min_read_len &&
-              strlen(sqp->merged_qual) >= min_read_len){
-            num_merged++;
-            write_fastq(mfqw,sqp->fid,sqp->merged_seq,sqp->merged_qual);
-            if(pretty_print && num_pretty_print < max_pretty_print){
-              num_pretty_print++;
-              pretty_print_alignment(ppaw,sqp,qcut,false); //false b/c merged input in fixed order
-            }
-          }else{
-            num_discarded++;
-            if(write_discard){
-              write_fastq(dffqw, sqp->fid, untrim_fseq, untrim_fqual);
-              write_fastq(drfqw, sqp->rid, untrim_rseq, untrim_rqual);
-            }
-          }
-        }else{
-          //no significant overlap so just write them
-          if(strlen(sqp->fseq) >= min_read_len &&
-              strlen(sqp->fqual) >= min_read_len &&
-              strlen(sqp->rseq) >= min_read_len &&
-              strlen(sqp->rqual) >= min_read_len){
-            write_fastq(ffqw, sqp->fid, sqp->fseq, sqp->fqual);
-            write_fastq(rfqw, sqp->rid, sqp->rseq, sqp->rqual);
-          }else{
-            num_discarded++;
-            if(write_discard){
-              write_fastq(dffqw, sqp->fid, untrim_fseq, untrim_fqual);
-              write_fastq(drfqw, sqp->rid, untrim_rseq, untrim_rqual);
-            }
-          }
 
-        }
-        //done
-        goto CLEAN_ADAPTERS;
-      }else{ //just write reads to output fastqs
-        if(strlen(sqp->fseq) >= min_read_len &&
-            strlen(sqp->fqual) >= min_read_len &&
-            strlen(sqp->rseq) >= min_read_len &&
-            strlen(sqp->rqual) >= min_read_len){
-          write_fastq(ffqw, sqp->fid, sqp->fseq, sqp->fqual);
-          write_fastq(rfqw, sqp->rid, sqp->rseq, sqp->rqual);
-        }else{
-          num_discarded++;
-          if(write_discard){
-            write_fastq(dffqw, sqp->fid, untrim_fseq, untrim_fqual);
-            write_fastq(drfqw, sqp->rid, untrim_rseq, untrim_rqual);
-          }
-        }
-        goto CLEAN_ADAPTERS;
-      }
+  io.opts = o;
+  //with more than one thread the outputs are compressed block by block on a pool
+  TPool *zpool = NULL;
+  int out_mode = OUT_MODE_GZIP;
+  if(num_threads > 1){
+    zpool = tpool_init(num_threads);
+    out_mode = OUT_MODE_PGZIP;
+  }
+  //the trimmed/merged reads can be BGZF so that they can be split up by record later
+  int seq_out_mode = index_interval ? OUT_MODE_BGZF : out_mode;
+  if(uncompressed)
+    out_mode = seq_out_mode = OUT_MODE_PLAIN;
+  //with a pool each input is also inflated ahead on a thread of its own
+  io.ffq = fq_open(forward_fn, zpool);
+  io.rfq = interleave_in ? io.ffq : fq_open(reverse_fn, zpool);
+  if(io.ffq == NULL || io.rfq == NULL)
+    exit(1);
+  io.n_outs = NUM_OUTS * o->n_sets;
+  io.outs = (OutStream**)calloc(io.n_outs, sizeof(OutStream*));
+  for(i=0;i<o->n_sets;i++){
+    OutStream **outs = io.outs + NUM_OUTS * i;
+    const char *sample = !o->demux ? NULL : i < o->samples.n ? o->samples.names[i] : DEMUX_UNDETERMINED;
+    set_fn(set_out_fn, forward_out_fn, sample);
+    outs[OUT_FORWARD] = out_open(set_out_fn, seq_out_mode, zpool, 2*num_threads);
+    if(outs[OUT_FORWARD] == NULL)
+      exit(1);
+    out_index(outs[OUT_FORWARD], set_out_fn, index_interval);
+    if(!o->interleave_out){
+      set_fn(set_out_fn, reverse_out_fn, sample);
+      outs[OUT_REVERSE] = out_open(set_out_fn, seq_out_mode, zpool, 2*num_threads);
+      if(outs[OUT_REVERSE] == NULL)
+        exit(1);
+      out_index(outs[OUT_REVERSE], set_out_fn, index_interval);
     }
+    if(o->do_read_merging){
+      set_fn(set_out_fn, merged_out_fn, sample);
+      outs[OUT_MERGED] = out_open(set_out_fn, seq_out_mode, zpool, 2*num_threads);
+      if(outs[OUT_MERGED] == NULL)
+        exit(1);
+      out_index(outs[OUT_MERGED], set_out_fn, index_interval);
+    }
+    if(o->write_discard){
+      set_fn(set_out_fn, forward_discard_fn, sample);
+      outs[OUT_DISCARD_F] = out_open(set_out_fn, out_mode, zpool, 2*num_threads);
+      if(outs[OUT_DISCARD_F] == NULL)
+        exit(1);
+      set_fn(set_out_fn, reverse_discard_fn, sample);
+      outs[OUT_DISCARD_R] = out_open(set_out_fn, out_mode, zpool, 2*num_threads);
+      if(outs[OUT_DISCARD_R] == NULL)
+        exit(1);
+    }
+  }
+  if(o->pretty_print){
+    io.outs[OUT_PRETTY] = out_open(pretty_print_fn, out_mode, zpool, 2*num_threads);
+    if(io.outs[OUT_PRETTY] == NULL)
+      exit(1);
+  }
 
 
-    /**
-     * Section for heirarchial cleanup
-     *
-     * In every case we will at least have to free up the alignment between the adapter and two reads.
-     * however in some cases there will be an additional alignment between the two reads. We can do
-     * good cleanup in this case with gotos
-     */
-    aln_free_AlnAln(fraln);
-
-    CLEAN_ADAPTERS:
-    aln_free_AlnAln(faaln);
-    aln_free_AlnAln(raaln);
+  /**
+   * Loop over all of the reads, with more than one thread the reading,
+   * processing and writing of batches of reads all overlap.
+   */
+  Pipeline pipe;
+  pipe.n_workers = num_threads;
+  pipe.n_batches = num_threads > 1 ? 2 * num_threads + 2 : 1;
+  pipe.batches = (void**)malloc(sizeof(void*) * pipe.n_batches);
+  for(i=0;i<pipe.n_batches;i++)
+    pipe.batches[i] = SeqBatch_init(o->n_sets);
+  SeqPrepWorker *workers = (SeqPrepWorker*)calloc(num_threads, sizeof(SeqPrepWorker));
+  pipe.worker_ctxs = (void**)malloc(sizeof(void*) * num_threads);
+  for(i=0;i<num_threads;i++){
+    workers[i].opts = o;
+    workers[i].io = &io;
+    //tables matching overlap length to min matches and max mismatches
+    olap_table_init(&workers[i].adapter_olap, o->min_match_adapter_frac, o->max_mismatch_adapter_frac);
+    olap_table_init(&workers[i].reads_olap, o->min_match_reads_frac, o->max_mismatch_reads_frac);
+    workers[i].aln_ws = aln_init_workspace();
+    workers[i].faaln = aln_init_AlnAln();
+    workers[i].raaln = aln_init_AlnAln();
+    workers[i].spare_aln = aln_init_AlnAln();
+    workers[i].fraln = aln_init_AlnAln();
+    workers[i].set_pairs = (unsigned long long*)calloc(o->n_sets, sizeof(unsigned long long));
+    if(o->report)
+      hists_init(&workers[i].hists);
+    workers[i].prof.on = o->profile;
+    //the adapters are compared to every read, encode them once
+    for(j=0;j<o->forward_adapters.n;j++)
+      ol_work_fix(&workers[i].ol, o->forward_adapters.a[j].seq,
+          o->forward_adapters.a[j].dummy_qual, o->forward_adapters.a[j].len, o->qcut);
+    for(j=0;j<o->reverse_adapters.n;j++)
+      ol_work_fix(&workers[i].ol, o->reverse_adapters.a[j].seq,
+          o->reverse_adapters.a[j].dummy_qual, o->reverse_adapters.a[j].len, o->qcut);
+    pipe.worker_ctxs[i] = &workers[i];
+  }
+  io.read_prof.on = io.write_prof.on = o->profile;
+  pipe.read = read_batch;
+  pipe.work = process_batch;
+  pipe.write = write_batch;
+  pipe.ctx = &io;
+  pipeline_run(&pipe);
+  //a reader that hit a bad block stopped there, so the outputs only hold the pairs before it
+  if(io.ffq->error || io.rfq->error)
+    exit_code = 1;
 
-    //End the loop over reads
+  //sum up the counters from each worker
+  for(i=0;i<num_threads;i++){
+    total.num_pairs += workers[i].stats.num_pairs;
+    total.num_merged += workers[i].stats.num_merged;
+    total.num_adapter += workers[i].stats.num_adapter;
+    total.num_discarded += workers[i].stats.num_discarded;
+    total.num_too_ambiguous_to_merge += workers[i].stats.num_too_ambiguous_to_merge;
+    total.num_adapter_aln_skipped += workers[i].stats.num_adapter_aln_skipped;
+    total.num_adapter_aln_bounded += workers[i].stats.num_adapter_aln_bounded;
+    total.num_adapter_unaligned += workers[i].stats.num_adapter_unaligned;
+    total.num_read_aln += workers[i].stats.num_read_aln;
+    total.num_read_aln_fast += workers[i].stats.num_read_aln_fast;
+    total.num_barcode_corrected += workers[i].stats.num_barcode_corrected;
+    total.num_qtrim_reads += workers[i].stats.num_qtrim_reads;
+    total.num_qtrim_bases += workers[i].stats.num_qtrim_bases;
+    total.num_tail_reads += workers[i].stats.num_tail_reads;
+    total.num_tail_bases += workers[i].stats.num_tail_bases;
+    total.num_low_complexity += workers[i].stats.num_low_complexity;
+    total.num_dup_dropped += workers[i].stats.num_dup_dropped;
   }
   end = clock();
   double cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
-  fprintf(stderr,"\nPairs Processed:\t%lld\n",num_pairs);
-  fprintf(stderr,"Pairs Merged:\t%lld\n",num_merged);
-  fprintf(stderr,"Pairs With Adapters:\t%lld\n",num_adapter);
-  fprintf(stderr,"Pairs Discarded:\t%lld\n",num_discarded);
+  fprintf(stderr,"\nPairs Processed:\t%lld\n",total.num_pairs);
+  fprintf(stderr,"Pairs Merged:\t%lld\n",total.num_merged);
+  fprintf(stderr,"Pairs With Adapters:\t%lld\n",total.num_adapter);
+  fprintf(stderr,"Pairs Discarded:\t%lld\n",total.num_discarded);
+  fprintf(stderr,"Adapter Alignments Skipped:\t%lld\n",total.num_adapter_aln_skipped);
+  if(o->qtrim){
+    fprintf(stderr,"Reads Quality Trimmed:\t%lld\n",total.num_qtrim_reads);
+    fprintf(stderr,"Bases Quality Trimmed:\t%lld\n",total.num_qtrim_bases);
+  }
+  if(o->polyg_len || o->polyx_len){
+    fprintf(stderr,"Reads With Tails Trimmed:\t%lld\n",total.num_tail_reads);
+    fprintf(stderr,"Bases Tail Trimmed:\t%lld\n",total.num_tail_bases);
+  }
+  if(o->min_entropy > 0)
+    fprintf(stderr,"Pairs Low Complexity:\t%lld\n",total.num_low_complexity);
+  if(o->dedup){
+    fprintf(stderr,"Duplicate Pairs:\t%lld (%.1f%%)\n",io.num_dups,
+        total.num_pairs ? 100.0 * io.num_dups / total.num_pairs : 0.0);
+    if(io.dups.n_untracked)
+      fprintf(stderr,"Warning: the duplicate table filled up, %lld pairs were not remembered; give -d more memory\n",
+          io.dups.n_untracked);
+  }
+  if(o->demux){
+    fprintf(stderr,"Barcodes Corrected:\t%lld\n",total.num_barcode_corrected);
+    for(i=0;i<o->n_sets;i++){
+      unsigned long long set_pairs = 0;
+      int j;
+      for(j=0;j<num_threads;j++)
+        set_pairs += workers[j].set_pairs[i];
+      fprintf(stderr,"Pairs For %s:\t%lld\n", i < o->samples.n ? o->samples.names[i] : DEMUX_UNDETERMINED, set_pairs);
+    }
+  }
   fprintf(stderr,"CPU Time Used (Minutes):\t%lf\n",cpu_time_used/60.0);
+  if(o->profile){
+    Profile prof;
+    fprintf(stderr,"Adapter Alignments Bounded Out:\t%lld\n",total.num_adapter_aln_bounded);
+    fprintf(stderr,"Fast Path Read Alignments:\t%lld/%lld (%.1f%%)\n",total.num_read_aln_fast,total.num_read_aln,
+        total.num_read_aln ? 100.0 * total.num_read_aln_fast / total.num_read_aln : 0.0);
+    memset(&prof, 0, sizeof(prof));
+    prof_merge(&prof, &io.read_prof);
+    for(i=0;i<num_threads;i++)
+      prof_merge(&prof, &workers[i].prof);
+    prof_merge(&prof, &io.write_prof);
+    prof_print(stderr, &prof);
+  }
+  if(o->report){
+    SeqPrepHists hists;
+    unsigned long long *set_pairs = (unsigned long long*)calloc(o->n_sets, sizeof(unsigned long long));
+    int j;
+    hists_init(&hists);
+    for(i=0;i<num_threads;i++){
+      hists_merge(&hists, &workers[i].hists);
+      for(j=0;j<o->n_sets;j++)
+        set_pairs[j] += workers[i].set_pairs[j];
+    }
+    write_report(report_fp, o, &io, &total, &hists, set_pairs,
+        report_wall_seconds() - wall_start, cpu_time_used);
+    if(report_fp != stdout)
+      fclose(report_fp);
+    hists_free(&hists);
+    free(set_pairs);
+  }
 
 
 
-  SQP_destroy(sqp);
-  gzclose(ffq);
-  gzclose(ffqw);
-  gzclose(rfq);
-  gzclose(rfqw);
-  if(mfqw != NULL)
-    gzclose(mfqw);
-  if(ppaw != NULL)
-    gzclose(ppaw);
-  if(dffqw != NULL)
-    gzclose(dffqw);
-  if(drfqw != NULL)
-    gzclose(drfqw);
-  return 0;
+  for(i=0;i<pipe.n_batches;i++)
+    SeqBatch_destroy((SeqBatch*)pipe.batches[i]);
+  free(pipe.batches);
+  free(pipe.worker_ctxs);
+  for(i=0;i<num_threads;i++){
+    olap_table_free(&workers[i].adapter_olap);
+    olap_table_free(&workers[i].reads_olap);
+    qgram_work_free(&workers[i].qgram);
+    ol_work_free(&workers[i].ol);
+    striped_work_free(&workers[i].striped);
+    adapter_work_free(&workers[i].adapters);
+    aln_free_workspace(workers[i].aln_ws);
+    aln_free_AlnAln(workers[i].faaln);
+    aln_free_AlnAln(workers[i].raaln);
+    aln_free_AlnAln(workers[i].spare_aln);
+    aln_free_AlnAln(workers[i].fraln);
+    free(workers[i].set_pairs);
+    hists_free(&workers[i].hists);
+  }
+  free(workers);
+  adapter_set_free(&o->forward_adapters);
+  adapter_set_free(&o->reverse_adapters);
+  sample_sheet_free(&o->samples);
+  dup_table_free(&io.dups);
+  fq_close(io.ffq);
+  if(io.rfq != io.ffq)
+    fq_close(io.rfq);
+  //the last blocks are only written here, a full disk has to fail the run
+  for(i=0;i<io.n_outs;i++)
+    if(out_close(io.outs[i]) != 0)
+      exit_code = 1;
+  free(io.outs);
+  tpool_destroy(zpool);
+  return exit_code;
 }
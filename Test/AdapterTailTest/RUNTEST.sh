@@ -0,0 +1,64 @@
+#!/bin/bash
+#Checks that a short adapter tail (9-12 bases, one mismatch, so no exact
+#seed in it) is trimmed the same with an adapter library (-F) as with the
+#adapter on its own (-A). Exits non zero if a read is left untrimmed.
+#pushd ../.. && make clean && make && popd
+
+SEQPREP=${SEQPREP:-$(dirname $0)/../../SeqPrep}
+ADAPTER=AGATCGGAAGAGCGGTTCAG
+DIR=$(mktemp -d)
+trap 'rm -rf $DIR' EXIT
+RANDOM=42
+
+#sets SEQ to $1 random bases, in this shell so RANDOM=42 repeats it
+rand_seq(){
+  local i
+  SEQ=""
+  for((i=0;i<$1;i++)); do
+    SEQ+=${BASES:$((RANDOM % 4)):1}
+  done
+}
+BASES=ACGT
+
+#the adapter behind more decoys than a read gets as candidates (ADAPTER_MAX_PICKS)
+for((i=0;i<8;i++)); do
+  rand_seq 20
+  printf '>decoy%d\n%s\n' $i $SEQ
+done > $DIR/library.fa
+echo ">real" >> $DIR/library.fa
+echo $ADAPTER >> $DIR/library.fa
+
+#forward reads are a 50 base insert and the first 9-12 adapter bases with
+#base 4 changed, so every 8-mer of the tail has the mismatch in it. The
+#reverse read is just the insert, nothing but the adapter can trim the pair.
+n=0
+for tail in 9 10 11 12; do
+  for((k=0;k<5;k++)); do
+    t=${ADAPTER:0:$tail}
+    case ${t:4:1} in C) x=A;; *) x=C;; esac
+    t=${t:0:4}$x${t:5}
+    rand_seq 50
+    f=$SEQ$t
+    r=$(echo $SEQ | rev | tr ACGT TGCA)
+    printf '@p%d/1\n%s\n+\n%s\n' $n $f $(printf 'I%.0s' $(seq ${#f})) >> $DIR/r1.fastq
+    printf '@p%d/2\n%s\n+\n%s\n' $n $r $(printf 'I%.0s' $(seq ${#r})) >> $DIR/r2.fastq
+    n=$((n+1))
+  done
+done
+
+OPTS="-f $DIR/r1.fastq -r $DIR/r2.fastq -M 0.12 -O 9"
+$SEQPREP $OPTS -A $ADAPTER -1 $DIR/single_1.fastq.gz -2 $DIR/single_2.fastq.gz 2> $DIR/err || { cat $DIR/err; exit 1; }
+$SEQPREP $OPTS -F $DIR/library.fa -R $DIR/library.fa -1 $DIR/library_1.fastq.gz -2 $DIR/library_2.fastq.gz 2> $DIR/err || { cat $DIR/err; exit 1; }
+
+fail=0
+untrimmed=$(gzip -dc $DIR/single_1.fastq.gz | awk 'NR % 4 == 2 && length($0) != 50' | wc -l)
+if [ $untrimmed -ne 0 ]; then
+  echo "$untrimmed reads not trimmed with -A"
+  fail=1
+fi
+if ! cmp -s <(gzip -dc $DIR/single_1.fastq.gz) <(gzip -dc $DIR/library_1.fastq.gz); then
+  echo "adapter library trims differently from -A"
+  fail=1
+fi
+[ $fail -eq 0 ] && echo "adapter tails: ok ($n pairs)"
+exit $fail
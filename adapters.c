@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <zlib.h>
+#include "adapters.h"
+
+#ifndef max
+  #define max( a, b ) ( ((a) > (b)) ? (a) : (b) )
+#endif
+
+#ifndef min
+  #define min( a, b ) ( ((a) < (b)) ? (a) : (b) )
+#endif
+
+//2 bit code of a base, -1 for anything but ACGT
+static int adapter_base(char c){
+  switch(c){
+  case 'A': case 'a': return 0;
+  case 'C': case 'c': return 1;
+  case 'G': case 'g': return 2;
+  case 'T': case 't': return 3;
+  default: return -1;
+  }
+}
+
+static char *adapter_strndup(const char *s, size_t len){
+  char *d = (char*)malloc(len + 1);
+  memcpy(d, s, len);
+  d[len] = '\0';
+  return d;
+}
+
+void adapter_set_add(AdapterSet *s, const char *name, const char *seq){
+  Adapter *a;
+  if(s->n == s->m){
+    s->m = s->m ? s->m << 1 : 4;
+    s->a = (Adapter*)realloc(s->a, sizeof(Adapter) * s->m);
+  }
+  a = &s->a[s->n++];
+  memset(a, 0, sizeof(Adapter));
+  a->len = strlen(seq);
+  a->name = adapter_strndup(name, strlen(name));
+  a->seq = adapter_strndup(seq, a->len);
+  a->dummy_qual = (char*)malloc(a->len + 1);
+  memset(a->dummy_qual, 'N', a->len); //phred score of 45
+  a->dummy_qual[a->len] = '\0';
+  s->max_len = max(s->max_len, a->len);
+}
+
+/* the record just read, false if it has no sequence */
+static bool adapter_fasta_record(AdapterSet *s, const char *fn, const char *name, char *seq, size_t l){
+  if(l == 0){
+    fprintf(stderr, "Adapter %s in %s has no sequence\n", name, fn);
+    return false;
+  }
+  seq[l] = '\0';
+  adapter_set_add(s, name, seq);
+  return true;
+}
+
+bool adapter_set_read_fasta(AdapterSet *s, const char *fn){
+  gzFile f = gzopen(fn, "r");
+  char line[1024], name[MAX_ADAPTER_NAME + 1], *seq = NULL, *p;
+  size_t l = 0, m = 0, n;
+  int n0 = s->n;
+  bool ok = true, have = false, in_header = false, eol;
+  if(f == Z_NULL){
+    fprintf(stderr, "%s\n", fn);
+    perror("Cannot open adapter file");
+    return false;
+  }
+  while(ok && gzgets(f, line, sizeof(line))){
+    n = strlen(line);
+    eol = n > 0 && line[n - 1] == '\n';
+    if(in_header){ //rest of a long header line
+      in_header = !eol;
+      continue;
+    }
+    if(line[0] == '>'){
+      if(have)
+        ok = adapter_fasta_record(s, fn, name, seq, l);
+      //the name is the first word of the header
+      n = strcspn(line + 1, " \t\r\n");
+      n = min(n, MAX_ADAPTER_NAME);
+      memcpy(name, line + 1, n);
+      name[n] = '\0';
+      have = true;
+      in_header = !eol;
+      l = 0;
+      continue;
+    }
+    for(p=line;*p;p++){
+      if(isspace((unsigned char)*p))
+        continue;
+      if(!have){
+        fprintf(stderr, "%s does not look like a FASTA file\n", fn);
+        ok = false;
+        break;
+      }
+      if(l + 1 >= m){
+        m = m ? m << 1 : 64;
+        seq = (char*)realloc(seq, m);
+      }
+      seq[l++] = toupper((unsigned char)*p);
+    }
+  }
+  if(ok && have)
+    ok = adapter_fasta_record(s, fn, name, seq, l);
+  gzclose(f);
+  free(seq);
+  if(ok && s->n == n0){
+    fprintf(stderr, "No adapters in %s\n", fn);
+    ok = false;
+  }
+  return ok;
+}
+
+/* follow (or make) the path of seq from the root, returns its last node */
+static int adapter_insert(AdapterSet *s, const char *seq, int len){
+  int i, c, node = 0;
+  for(i=0;i<len;i++){
+    c = adapter_base(seq[i]);
+    if(s->go[4 * node + c] < 0){
+      if(s->n_nodes == s->m_nodes){
+        s->m_nodes <<= 1;
+        s->go = (int*)realloc(s->go, sizeof(int) * 4 * s->m_nodes);
+        s->depth = (int*)realloc(s->depth, sizeof(int) * s->m_nodes);
+        s->seeds = (int*)realloc(s->seeds, sizeof(int) * s->m_nodes);
+        s->prefixes = (int*)realloc(s->prefixes, sizeof(int) * s->m_nodes);
+      }
+      memset(s->go + 4 * s->n_nodes, -1, sizeof(int) * 4);
+      s->depth[s->n_nodes] = i + 1;
+      s->seeds[s->n_nodes] = s->prefixes[s->n_nodes] = -1;
+      s->go[4 * node + c] = s->n_nodes++;
+    }
+    node = s->go[4 * node + c];
+  }
+  return node;
+}
+
+/* put adapter a on a hit list, once */
+static void adapter_list_add(AdapterSet *s, int *first, int a){
+  int h;
+  for(h=*first;h>=0;h=s->hit_next[h])
+    if(s->hit_adapter[h] == a)
+      return;
+  if(s->n_hits == s->m_hits){
+    s->m_hits = s->m_hits ? s->m_hits << 1 : 64;
+    s->hit_adapter = (int*)realloc(s->hit_adapter, sizeof(int) * s->m_hits);
+    s->hit_next = (int*)realloc(s->hit_next, sizeof(int) * s->m_hits);
+  }
+  s->hit_adapter[s->n_hits] = a;
+  s->hit_next[s->n_hits] = *first;
+  *first = s->n_hits++;
+}
+
+/* length of the run of ACGT starting at seq */
+static int adapter_acgt_run(const char *seq, int len){
+  int i;
+  for(i=0;i<len && adapter_base(seq[i]) >= 0;i++);
+  return i;
+}
+
+static void adapter_build_automaton(AdapterSet *s){
+  int i, j, k, c, u, v, node, head = 0, tail = 0, *queue;
+  const Adapter *a;
+  s->n_nodes = 1;
+  s->m_nodes = 1024;
+  s->go = (int*)malloc(sizeof(int) * 4 * s->m_nodes);
+  s->depth = (int*)malloc(sizeof(int) * s->m_nodes);
+  s->seeds = (int*)malloc(sizeof(int) * s->m_nodes);
+  s->prefixes = (int*)malloc(sizeof(int) * s->m_nodes);
+  memset(s->go, -1, sizeof(int) * 4);
+  s->depth[0] = 0;
+  s->seeds[0] = s->prefixes[0] = -1;
+  for(j=0;j<s->n;j++){
+    a = &s->a[j];
+    //every k-mer is a seed, an adapter shorter than that is one as a whole
+    k = min(ADAPTER_SEED_K, a->len);
+    for(i=0;i+k<=a->len;i++){
+      if(adapter_acgt_run(a->seq + i, k) < k)
+        continue;
+      node = adapter_insert(s, a->seq + i, k);
+      adapter_list_add(s, &s->seeds[node], j);
+    }
+    //shorter prefixes only count where a read ends
+    k = adapter_acgt_run(a->seq, min(a->len, ADAPTER_SEED_K) - 1);
+    adapter_insert(s, a->seq, k);
+    for(node=i=0;i<k;i++){
+      node = s->go[4 * node + adapter_base(a->seq[i])];
+      if(i + 1 >= s->min_tail)
+        adapter_list_add(s, &s->prefixes[node], j);
+    }
+  }
+  //breadth first: fail links, seed outputs and the missing transitions
+  s->fail = (int*)malloc(sizeof(int) * s->n_nodes);
+  s->out = (int*)malloc(sizeof(int) * s->n_nodes);
+  queue = (int*)malloc(sizeof(int) * s->n_nodes);
+  s->fail[0] = s->out[0] = 0;
+  for(c=0;c<4;c++){
+    v = s->go[c];
+    if(v < 0){
+      s->go[c] = 0;
+    }else{
+      s->fail[v] = 0;
+      queue[tail++] = v;
+    }
+  }
+  while(head < tail){
+    u = queue[head++];
+    s->out[u] = s->seeds[u] >= 0 ? u : s->out[s->fail[u]];
+    for(c=0;c<4;c++){
+      v = s->go[4 * u + c];
+      if(v < 0){
+        s->go[4 * u + c] = s->go[4 * s->fail[u] + c];
+      }else{
+        s->fail[v] = s->go[4 * s->fail[u] + c];
+        queue[tail++] = v;
+      }
+    }
+  }
+  free(queue);
+}
+
+void adapter_set_prepare(AdapterSet *s, const AlnParam *ap, int thresh, int min_tail){
+  int i;
+  Adapter *a;
+  for(i=0;i<s->n;i++){
+    a = &s->a[i];
+    qgram_init(&a->qgram, a->seq, a->len, ap, thresh);
+    //every alignment reaches a threshold of 0 or less, nothing to rule out
+    if(thresh > 0)
+      a->profile = striped_profile_init(a->seq, a->len, ap);
+  }
+  //only prefixes shorter than a seed are on the prefix lists
+  s->min_tail = max(min(min_tail, ADAPTER_SEED_K - 1), 1);
+  if(s->n > 1)
+    adapter_build_automaton(s);
+}
+
+static void adapter_hit(AdapterWork *w, int a){
+  if(w->count[a]++ == 0)
+    w->touched[w->n_touched++] = a;
+}
+
+int adapter_set_pick(const AdapterSet *s, AdapterWork *w, const char *seq, size_t len,
+    int picks[ADAPTER_MAX_PICKS]){
+  size_t i;
+  int c, h, x, t, j, state = 0, n = 0;
+  if(s->go == NULL){
+    picks[0] = 0;
+    return 1;
+  }
+  if(w->cap < s->n){
+    w->cap = s->n;
+    w->count = (int*)realloc(w->count, sizeof(int) * w->cap);
+    w->touched = (int*)realloc(w->touched, sizeof(int) * w->cap);
+    memset(w->count, 0, sizeof(int) * w->cap);
+  }
+  w->n_touched = 0;
+  for(i=0;i<len;i++){
+    c = adapter_base(seq[i]);
+    if(c < 0){
+      state = 0;
+      continue;
+    }
+    state = s->go[4 * state + c];
+    for(x=s->out[state];x;x=s->out[s->fail[x]])
+      for(h=s->seeds[x];h>=0;h=s->hit_next[h])
+        adapter_hit(w, s->hit_adapter[h]);
+  }
+  //the read running into the start of an adapter
+  for(x=state;x && s->depth[x]>=s->min_tail;x=s->fail[x])
+    for(h=s->prefixes[x];h>=0;h=s->hit_next[h])
+      adapter_hit(w, s->hit_adapter[h]);
+  //keep the ADAPTER_MAX_PICKS with the most hits, the lower index first on ties
+  for(i=0;i<(size_t)w->n_touched;i++){
+    t = w->touched[i];
+    for(j=n;j>0;j--){
+      x = picks[j - 1];
+      if(w->count[x] > w->count[t] || (w->count[x] == w->count[t] && x < t))
+        break;
+      if(j < ADAPTER_MAX_PICKS)
+        picks[j] = x;
+    }
+    if(j < ADAPTER_MAX_PICKS){
+      picks[j] = t;
+      n = min(n + 1, ADAPTER_MAX_PICKS);
+    }
+  }
+  for(i=0;i<(size_t)w->n_touched;i++)
+    w->count[w->touched[i]] = 0;
+  //a library that fits is checked in full, the hits only order it
+  if(s->n <= ADAPTER_MAX_PICKS){
+    for(t=0;t<s->n;t++){
+      for(j=0;j<n && picks[j]!=t;j++);
+      if(j == n)
+        picks[n++] = t;
+    }
+  }
+  return n;
+}
+
+void adapter_set_free(AdapterSet *s){
+  int i;
+  for(i=0;i<s->n;i++){
+    free(s->a[i].name);
+    free(s->a[i].seq);
+    free(s->a[i].dummy_qual);
+    qgram_free(&s->a[i].qgram);
+    striped_profile_free(s->a[i].profile);
+  }
+  free(s->a);
+  free(s->go);
+  free(s->fail);
+  free(s->out);
+  free(s->depth);
+  free(s->seeds);
+  free(s->prefixes);
+  free(s->hit_adapter);
+  free(s->hit_next);
+  memset(s, 0, sizeof(AdapterSet));
+}
+
+void adapter_work_free(AdapterWork *w){
+  free(w->count);
+  free(w->touched);
+  memset(w, 0, sizeof(AdapterWork));
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include "stdaln.h"
+#include "qgram.h"
+#include "striped.h"
+
+/**
+ * Adapter library for one end of the read pairs: the -A/-B adapter, or
+ * every record of a FASTA file.
+ *
+ * With more than one adapter, each read is first run through an
+ * Aho-Corasick automaton over the k-mers of all the adapters and their
+ * prefixes. Every exact k-mer hit counts for its adapter, and so does an
+ * adapter prefix shorter than a k-mer that the read ends in (of at least
+ * the minimum adapter overlap, capped at ADAPTER_SEED_K - 1).
+ * The few adapters with the most hits are the candidates the read is
+ * aligned to, so aligning it with dozens of adapters costs about as much
+ * as with a few. The counts only rank them: a repeat such as a poly-A
+ * adapter scores at every base of a poly-A tail, and a sequencing error
+ * costs the right adapter up to ADAPTER_SEED_K hits, so a short adapter
+ * tail with an error in it may have none. A library of no more adapters
+ * than there are candidates is always picked in full, and a read the
+ * local alignment finds no adapter in still has its overlap checked
+ * against every adapter.
+ */
+
+//seed length used to pick among several adapters
+#define ADAPTER_SEED_K (8)
+//longer FASTA names are cut
+#define MAX_ADAPTER_NAME (255)
+//most candidates adapter_set_pick returns for a read
+#define ADAPTER_MAX_PICKS (4)
+
+typedef struct {
+  char *name;
+  char *seq;
+  char *dummy_qual;         //'N' for every base, what compute_ol sees as its quality
+  int len;
+  QgramFilter qgram;        //rules reads out before aligning them to it
+  StripedProfile *profile;  //scores reads before the full alignment
+} Adapter;
+
+typedef struct {
+  Adapter *a;
+  int n, m;
+  int max_len;
+  int min_tail;   //shortest adapter prefix counted at the end of a read, under ADAPTER_SEED_K
+  //automaton, only built when there is a choice to make
+  int n_nodes, m_nodes;
+  int *go;        //4 per node, next state on A, C, G and T
+  int *fail;
+  int *out;       //closest node on the fail chain, itself included, where seeds end; 0 for none
+  int *depth;
+  int *seeds;     //first hit list entry for the seeds ending at a node, -1 for none
+  int *prefixes;  //first hit list entry for the adapters starting with the path to a node
+  int *hit_adapter;
+  int *hit_next;
+  int n_hits, m_hits;
+} AdapterSet;
+
+/* per thread hit counts */
+typedef struct {
+  int *count;
+  int *touched;
+  int n_touched;
+  int cap;
+} AdapterWork;
+
+void adapter_set_add(AdapterSet *s, const char *name, const char *seq);
+/* add every record of a FASTA file, false if it can't be read or holds no adapter */
+bool adapter_set_read_fasta(AdapterSet *s, const char *fn);
+/* set up the filters for local alignments with ap scoring at least thresh, and the automaton */
+void adapter_set_prepare(AdapterSet *s, const AlnParam *ap, int thresh, int min_tail);
+/* fill picks with the adapters seq may hold, most hits first, and return
+   how many there are; 0 when no adapter has a hit. A set of at most
+   ADAPTER_MAX_PICKS adapters always picks all of them. */
+int adapter_set_pick(const AdapterSet *s, AdapterWork *w, const char *seq, size_t len,
+    int picks[ADAPTER_MAX_PICKS]);
+void adapter_set_free(AdapterSet *s);
+void adapter_work_free(AdapterWork *w);
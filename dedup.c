@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dedup.h"
+
+#define DUP_MUL (0x9E3779B97F4A7C15ull)
+
+/* fold len bytes of s into h 8 at a time, the length goes in with the last word */
+static uint64_t dup_hash(uint64_t h, const char *s, size_t len){
+  uint64_t k;
+  for(;len>=8;s+=8,len-=8){
+    memcpy(&k, s, 8);
+    h = (h ^ k) * DUP_MUL;
+    h ^= h >> 29;
+  }
+  k = 0;
+  memcpy(&k, s, len);
+  h = (h ^ k ^ ((uint64_t)len << 56)) * DUP_MUL;
+  return h ^ (h >> 29);
+}
+
+/* murmur3 finalizer, spreads the bits over the table index */
+static uint64_t dup_mix(uint64_t h){
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+bool dup_table_init(DupTable *t, size_t bytes){
+  size_t n_slots = 1024;
+  memset(t, 0, sizeof(DupTable));
+  if(bytes < n_slots * sizeof(uint64_t))
+    return false;
+  while(n_slots * 2 * sizeof(uint64_t) <= bytes)
+    n_slots <<= 1;
+  //untouched pages of a calloc'ed table cost nothing until pairs land on them
+  t->slots = (uint64_t*)calloc(n_slots, sizeof(uint64_t));
+  if(t->slots == NULL)
+    return false;
+  t->mask = n_slots - 1;
+  t->max_n = n_slots / 8 * DUP_MAX_LOAD;
+  return true;
+}
+
+bool dup_table_seen(DupTable *t, const char *fseq, size_t flen, const char *rseq, size_t rlen){
+  uint64_t h = dup_mix(dup_hash(dup_hash(0, fseq, flen), rseq, rlen));
+  size_t i;
+  if(h == 0)
+    h = 1;
+  for(i=h&t->mask;t->slots[i];i=(i+1)&t->mask)
+    if(t->slots[i] == h)
+      return true;
+  if(t->n < t->max_n){
+    t->slots[i] = h;
+    t->n++;
+  }else{
+    t->n_untracked++;
+  }
+  return false;
+}
+
+void dup_table_free(DupTable *t){
+  free(t->slots);
+  memset(t, 0, sizeof(DupTable));
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Exact duplicate detection for read pairs in a fixed amount of memory.
+ *
+ * Every pair is reduced to a 64 bit fingerprint of its two sequences
+ * (qualities play no part) kept in an open addressing table. The table
+ * never grows: once it is 7/8 full new pairs are still checked against
+ * the ones in it but are no longer added, and are counted as untracked.
+ */
+
+//fraction of the slots filled before pairs stop being added, in eighths
+#define DUP_MAX_LOAD (7)
+
+typedef struct {
+  uint64_t *slots;  //0 marks an empty slot
+  size_t mask;      //number of slots - 1
+  size_t n, max_n;
+  unsigned long long n_untracked;
+} DupTable;
+
+/* a table in at most bytes of memory, false if that is too little */
+bool dup_table_init(DupTable *t, size_t bytes);
+/* true if the pair was seen before, otherwise it is remembered (if there is room) */
+bool dup_table_seen(DupTable *t, const char *fseq, size_t flen, const char *rseq, size_t rlen);
+void dup_table_free(DupTable *t);
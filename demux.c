@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "demux.h"
+
+//substitutions tried at every barcode position
+static const char demux_bases[] = "ACGTN";
+
+static char *demux_strdup(const char *s){
+  size_t len = strlen(s);
+  char *d = (char*)malloc(len + 1);
+  memcpy(d, s, len + 1);
+  return d;
+}
+
+static uint32_t demux_hash(const char *s, int len){
+  uint32_t h = 2166136261u; //FNV-1a
+  int i;
+  for(i=0;i<len;i++){
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static BarcodeEntry *demux_slot(const SampleSheet *s, const char *key, int len, uint32_t h){
+  size_t i;
+  BarcodeEntry *e;
+  for(i=h&s->mask;;i=(i+1)&s->mask){
+    e = &s->table[i];
+    if(e->key == NULL || (e->hash == h && e->len == len && memcmp(e->key, key, len) == 0))
+      return e;
+  }
+}
+
+/* put key in the table for sample, exact barcodes have to go in before any neighbour */
+static void demux_insert(SampleSheet *s, const char *key, int len, int sample, bool exact){
+  uint32_t h = demux_hash(key, len);
+  BarcodeEntry *e = demux_slot(s, key, len, h);
+  if(e->key == NULL){
+    e->key = (char*)malloc(len + 1);
+    memcpy(e->key, key, len);
+    e->key[len] = '\0';
+    e->len = len;
+    e->hash = h;
+    e->sample = sample;
+    e->exact = exact;
+  }else if(!e->exact && e->sample != sample){
+    e->sample = -1;
+  }
+}
+
+static int demux_distance(const char *a, const char *b){
+  int d = 0;
+  for(;*a;a++,b++)
+    d += *a != *b;
+  return d;
+}
+
+static bool demux_add(SampleSheet *s, const char *fn, int line_no, const char *name, const char *bc){
+  const char *p;
+  int i;
+  if(strlen(name) > MAX_SAMPLE_NAME || strchr(name, '/') || strcmp(name, DEMUX_UNDETERMINED) == 0){
+    fprintf(stderr, "%s line %d: %s can't be used as a sample name\n", fn, line_no, name);
+    return false;
+  }
+  if(strlen(bc) > MAX_BARCODE_LEN){
+    fprintf(stderr, "%s line %d: barcodes can be at most %d long\n", fn, line_no, MAX_BARCODE_LEN);
+    return false;
+  }
+  for(p=bc;*p;p++){
+    if(!strchr(demux_bases, *p) && *p != '+'){
+      fprintf(stderr, "%s line %d: %s is not a barcode\n", fn, line_no, bc);
+      return false;
+    }
+  }
+  for(i=0;i<s->n;i++){
+    if(strcmp(s->names[i], name) == 0 || strcmp(s->barcodes[i], bc) == 0){
+      fprintf(stderr, "%s line %d: sample %s or barcode %s is already in the sheet\n", fn, line_no, name, bc);
+      return false;
+    }
+  }
+  if(s->n == s->m){
+    s->m = s->m ? s->m << 1 : 16;
+    s->names = (char**)realloc(s->names, sizeof(char*) * s->m);
+    s->barcodes = (char**)realloc(s->barcodes, sizeof(char*) * s->m);
+  }
+  s->names[s->n] = demux_strdup(name);
+  s->barcodes[s->n] = demux_strdup(bc);
+  s->n++;
+  return true;
+}
+
+static void demux_build(SampleSheet *s){
+  int i, j, k, len;
+  size_t size, n_keys = 0;
+  char key[MAX_BARCODE_LEN + 1];
+  for(i=0;i<s->n;i++)
+    n_keys += 1 + (s->max_mismatch ? 4 * strlen(s->barcodes[i]) : 0);
+  for(size=64;size<2*n_keys;size<<=1);
+  s->mask = size - 1;
+  s->table = (BarcodeEntry*)calloc(size, sizeof(BarcodeEntry));
+  for(i=0;i<s->n;i++)
+    demux_insert(s, s->barcodes[i], strlen(s->barcodes[i]), i, true);
+  if(s->max_mismatch == 0)
+    return;
+  for(i=0;i<s->n;i++){
+    len = strlen(s->barcodes[i]);
+    memcpy(key, s->barcodes[i], len + 1);
+    for(j=0;j<len;j++){
+      if(key[j] == '+') //between the two halves of a dual index
+        continue;
+      for(k=0;demux_bases[k];k++){
+        if(demux_bases[k] == s->barcodes[i][j])
+          continue;
+        key[j] = demux_bases[k];
+        demux_insert(s, key, len, i, false);
+      }
+      key[j] = s->barcodes[i][j];
+    }
+  }
+  //reads half way between two barcodes can't be told apart
+  for(i=0;i<s->n;i++){
+    for(j=i+1;j<s->n;j++){
+      if(strlen(s->barcodes[i]) != strlen(s->barcodes[j]))
+        continue;
+      k = demux_distance(s->barcodes[i], s->barcodes[j]);
+      if(k <= 2 * s->max_mismatch)
+        fprintf(stderr, "Warning: barcodes of %s and %s are %d apart, reads in between them are left undetermined\n",
+            s->names[i], s->names[j], k);
+    }
+  }
+}
+
+bool sample_sheet_read(SampleSheet *s, const char *fn, int max_mismatch){
+  FILE *f = fopen(fn, "r");
+  char line[1024], name[1024], bc[1024], *p;
+  int line_no = 0, i;
+  bool ok = true;
+  memset(s, 0, sizeof(SampleSheet));
+  s->max_mismatch = max_mismatch;
+  if(f == NULL){
+    fprintf(stderr, "%s\n", fn);
+    perror("Cannot open sample sheet");
+    return false;
+  }
+  while(ok && fgets(line, sizeof(line), f)){
+    line_no++;
+    for(p=line;isspace((unsigned char)*p);p++);
+    if(*p == '\0' || *p == '#')
+      continue;
+    if(sscanf(p, "%1023s %1023s", name, bc) != 2){
+      fprintf(stderr, "%s line %d: expected a sample name and a barcode\n", fn, line_no);
+      ok = false;
+      break;
+    }
+    for(p=bc;*p;p++)
+      *p = toupper((unsigned char)*p);
+    ok = demux_add(s, fn, line_no, name, bc);
+  }
+  fclose(f);
+  if(ok && s->n == 0){
+    fprintf(stderr, "No samples in %s\n", fn);
+    ok = false;
+  }
+  if(!ok)
+    return false;
+  s->barcode_len = strlen(s->barcodes[0]);
+  for(i=1;i<s->n;i++)
+    if((int)strlen(s->barcodes[i]) != s->barcode_len)
+      s->barcode_len = -1;
+  demux_build(s);
+  return true;
+}
+
+int sample_sheet_match(const SampleSheet *s, const char *bc, size_t len, bool *corrected){
+  char key[MAX_BARCODE_LEN];
+  const BarcodeEntry *e;
+  size_t i;
+  *corrected = false;
+  if(len == 0 || len > MAX_BARCODE_LEN)
+    return -1;
+  for(i=0;i<len;i++)
+    key[i] = toupper((unsigned char)bc[i]);
+  e = demux_slot(s, key, len, demux_hash(key, len));
+  if(e->key == NULL)
+    return -1;
+  *corrected = !e->exact;
+  return e->sample;
+}
+
+size_t fastq_header_index(const char *id, const char **index){
+  const char *comment = strpbrk(id, " \t"), *p, *end;
+  if(comment){ //CASAVA 1.8: the index is the last field of the comment
+    end = comment + strcspn(comment, "\r\n");
+    while(end > comment && isspace((unsigned char)end[-1]))
+      end--;
+    for(p=end;p>comment && p[-1]!=':';p--);
+    if(p == comment)
+      return 0;
+  }else{ //older headers: name#index/1
+    p = strchr(id, '#');
+    if(p == NULL)
+      return 0;
+    p++;
+    end = p + strcspn(p, "/\r\n");
+  }
+  *index = p;
+  return end - p;
+}
+
+void sample_sheet_free(SampleSheet *s){
+  size_t i;
+  for(i=0;i<(size_t)s->n;i++){
+    free(s->names[i]);
+    free(s->barcodes[i]);
+  }
+  if(s->table)
+    for(i=0;i<=s->mask;i++)
+      free(s->table[i].key);
+  free(s->names);
+  free(s->barcodes);
+  free(s->table);
+  memset(s, 0, sizeof(SampleSheet));
+}
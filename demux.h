@@ -0,0 +1,47 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Sample sheet for splitting a multiplexed lane up by barcode.
+ *
+ * Every barcode goes into one hash table together with all of the
+ * sequences a substitution away from it, so the barcode of a read is
+ * matched with up to one mismatch by a single lookup. An exact match
+ * always wins, a sequence that is one off from two barcodes belongs
+ * to neither of them.
+ */
+
+#define MAX_BARCODE_LEN (64)
+//sample names end up in file names
+#define MAX_SAMPLE_NAME (255)
+//name of the output set for pairs that match no barcode
+#define DEMUX_UNDETERMINED ("Undetermined")
+
+typedef struct {
+  char *key;        //NULL for an empty slot
+  int len;
+  uint32_t hash;
+  int sample;       //-1 when the sequence is as close to two barcodes
+  bool exact;
+} BarcodeEntry;
+
+typedef struct {
+  char **names;
+  char **barcodes;
+  int n, m;
+  int barcode_len;  //shared by every barcode, -1 when they differ
+  int max_mismatch;
+  BarcodeEntry *table;
+  size_t mask;      //table size - 1
+} SampleSheet;
+
+/* read "<sample name> <barcode>" lines, false if the sheet can't be used */
+bool sample_sheet_read(SampleSheet *s, const char *fn, int max_mismatch);
+/* sample the barcode bc belongs to, -1 for none; corrected is set when it took a mismatch */
+int sample_sheet_match(const SampleSheet *s, const char *bc, size_t len, bool *corrected);
+/* the index read given in a fastq header, "<name> 1:N:0:<index>" or "<name>#<index>/1",
+   returns its length and 0 when there is none */
+size_t fastq_header_index(const char *id, const char **index);
+void sample_sheet_free(SampleSheet *s);
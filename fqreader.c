@@ -0,0 +1,559 @@
+//mmap and posix_madvise are not part of c99
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fqreader.h"
+
+//buffer handed to zlib internally, the default of 8k means lots of tiny reads
+#define FQ_GZ_BUFFER (1<<20)
+
+//character translation tables, 0 means skip the character
+static char seq_table[256];
+static char qual33_table[256];
+static char qual64_table[256];
+static bool tables_ready = false;
+
+/**
+ * Bases are upper cased with '.' turned into 'N',
+ * phred+64 qualities are shifted down to phred+33
+ */
+static void fq_init_tables(){
+  int c;
+  if(tables_ready)
+    return;
+  for(c=1;c<256;c++){
+    if(isspace(c))
+      continue;
+    seq_table[c] = (toupper(c) == '.') ? 'N' : toupper(c);
+    qual33_table[c] = c;
+    qual64_table[c] = (c=='B') ? '!' : c-31;
+  }
+  tables_ready = true;
+}
+
+static size_t fq_copy_table(char *dst, const char *src, size_t len, size_t max_len, const char *table){
+  size_t i, j;
+  char c;
+  for(i=j=0; i<len && j<max_len; i++){
+    c = table[(unsigned char)src[i]];
+    if(c)
+      dst[j++] = c;
+  }
+  return j;
+}
+
+size_t fq_copy_seq(char *dst, const char *src, size_t len, size_t max_len){
+  return fq_copy_table(dst, src, len, max_len, seq_table);
+}
+
+size_t fq_copy_qual(char *dst, const char *src, size_t len, size_t max_len, bool p64){
+  return fq_copy_table(dst, src, len, max_len, p64 ? qual64_table : qual33_table);
+}
+
+
+//BGZF blocks handed to one pool job
+#define FQ_BGZF_JOB_BLOCKS (8)
+//at most this many BGZF blocks go in one chunk, however small they are
+#define FQ_BGZF_MAX_BLOCKS (256)
+#define FQ_BGZF_MAX_BLOCK (0x10000)
+
+typedef struct {
+  size_t raw_off;   //start of the deflate data in raw
+  size_t raw_len;
+  size_t out_off;   //where the inflated data goes in the chunk
+  size_t out_len;
+  uint32_t crc;
+} FqBgzfBlock;
+
+typedef struct {
+  char *data;
+  size_t len;
+} FqChunk;
+
+typedef struct {
+  FqInflater *inf;
+  char *dst;
+  int first, last;  //blocks [first, last) of the current chunk
+} FqBgzfJob;
+
+struct fq_inflater {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  FqChunk ring[FQ_RING];
+  int head;         //next chunk for the parser
+  int n_ready;      //chunks inflated and not yet used up by the parser
+  size_t head_pos;  //bytes of the head chunk already handed to the parser
+  bool finished;    //the inflating thread has reached the end of the file
+  bool stop;        //the reader is being closed
+  bool error;       //set and read under the lock, pool jobs set it too
+  gzFile gz;
+  //BGZF input, read raw and inflated on the pool
+  FILE *fp;
+  TPool *pool;
+  unsigned char *raw;
+  size_t raw_len, raw_cap;
+  FqBgzfBlock blocks[FQ_BGZF_MAX_BLOCKS];
+  int n_blocks;
+  FqBgzfJob jobs[FQ_BGZF_MAX_BLOCKS / FQ_BGZF_JOB_BLOCKS + 1];
+  int n_jobs;       //jobs still running on the pool
+};
+
+static unsigned get_le16(const unsigned char *p){
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const unsigned char *p){
+  return get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+/**
+ * Size of the BGZF block starting with this gzip header, or 0 if the
+ * header has no 'BC' subfield. xlen is the length of the extra field.
+ */
+static size_t fq_bgzf_bsize(const unsigned char *h, const unsigned char *extra, size_t xlen){
+  size_t i;
+  if(h[0] != 0x1f || h[1] != 0x8b || h[2] != 8 || !(h[3] & 4))
+    return 0;
+  for(i=0; i + 4 <= xlen; i += 4 + get_le16(extra + i + 2)){
+    if(extra[i] == 'B' && extra[i+1] == 'C' && get_le16(extra + i + 2) == 2 && i + 6 <= xlen)
+      return get_le16(extra + i + 4) + 1;
+  }
+  return 0;
+}
+
+static bool fq_is_bgzf(const char *name){
+  unsigned char h[18];
+  FILE *fp = strcmp(name, "-") == 0 ? NULL : fopen(name, "rb");
+  bool ret;
+  if(fp == NULL)
+    return false;
+  ret = fread(h, 1, sizeof(h), fp) == sizeof(h) && fq_bgzf_bsize(h, h + 12, 6) > 0;
+  fclose(fp);
+  return ret;
+}
+
+/**
+ * Read the next BGZF block onto the end of inf->raw,
+ * returns 1 on success, 0 at the end of the file and -1 on a bad block
+ */
+static int fq_bgzf_read_block(FqInflater *inf, FqBgzfBlock *b){
+  unsigned char *h;
+  size_t xlen, bsize;
+  if(inf->raw_len + FQ_BGZF_MAX_BLOCK > inf->raw_cap){
+    inf->raw_cap = (inf->raw_len + FQ_BGZF_MAX_BLOCK) << 1;
+    inf->raw = (unsigned char*)realloc(inf->raw, inf->raw_cap);
+  }
+  h = inf->raw + inf->raw_len;
+  if(fread(h, 1, 12, inf->fp) != 12)
+    return 0;
+  xlen = get_le16(h + 10);
+  if(12 + xlen + 8 > FQ_BGZF_MAX_BLOCK || fread(h + 12, 1, xlen, inf->fp) != xlen)
+    return -1;
+  bsize = fq_bgzf_bsize(h, h + 12, xlen);
+  if(bsize < 12 + xlen + 8 || fread(h + 12 + xlen, 1, bsize - 12 - xlen, inf->fp) != bsize - 12 - xlen)
+    return -1;
+  b->raw_off = inf->raw_len + 12 + xlen;
+  b->raw_len = bsize - 12 - xlen - 8;
+  b->crc = get_le32(h + bsize - 8);
+  b->out_len = get_le32(h + bsize - 4);
+  if(b->out_len > FQ_BGZF_MAX_BLOCK)
+    return -1;
+  inf->raw_len += bsize;
+  return 1;
+}
+
+/** Pool job: inflate a run of BGZF blocks into their place in the chunk **/
+static void fq_bgzf_job(void *arg){
+  FqBgzfJob *job = (FqBgzfJob*)arg;
+  FqInflater *inf = job->inf;
+  bool ok = true;
+  int i;
+  for(i=job->first; i<job->last && ok; i++){
+    FqBgzfBlock *b = &inf->blocks[i];
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    inflateInit2(&z, -15);
+    z.next_in = inf->raw + b->raw_off;
+    z.avail_in = b->raw_len;
+    z.next_out = (Bytef*)job->dst + b->out_off;
+    z.avail_out = b->out_len;
+    ok = inflate(&z, Z_FINISH) == Z_STREAM_END && z.total_out == b->out_len
+        && crc32(crc32(0L, Z_NULL, 0), (Bytef*)job->dst + b->out_off, b->out_len) == b->crc;
+    inflateEnd(&z);
+  }
+  pthread_mutex_lock(&inf->lock);
+  if(!ok)
+    inf->error = true;
+  inf->n_jobs--;
+  pthread_cond_broadcast(&inf->cond);
+  pthread_mutex_unlock(&inf->lock);
+}
+
+/**
+ * Fill a chunk with as many whole BGZF blocks as are sure to fit,
+ * inflating them in parallel, returns the number of bytes inflated
+ */
+static size_t fq_bgzf_fill(FqInflater *inf, char *dst){
+  size_t len = 0;
+  int i, n, ret = 1;
+  bool error;
+  inf->n_blocks = 0;
+  while(inf->n_blocks < FQ_BGZF_MAX_BLOCKS){
+    FqBgzfBlock *b = &inf->blocks[inf->n_blocks];
+    ret = fq_bgzf_read_block(inf, b);
+    if(ret <= 0)
+      break;
+    b->out_off = len;
+    len += b->out_len;
+    inf->n_blocks++;
+    if(len + FQ_BGZF_MAX_BLOCK > FQ_BLOCK_SIZE)
+      break;
+  }
+  pthread_mutex_lock(&inf->lock);
+  if(ret < 0){
+    fprintf(stderr, "Error reading fastq: bad BGZF block\n");
+    inf->error = true;
+  }
+  for(i=n=0; i<inf->n_blocks; i+=FQ_BGZF_JOB_BLOCKS, n++){
+    FqBgzfJob *job = &inf->jobs[n];
+    inf->n_jobs++;
+    job->inf = inf;
+    job->dst = dst;
+    job->first = i;
+    job->last = (i + FQ_BGZF_JOB_BLOCKS < inf->n_blocks) ? i + FQ_BGZF_JOB_BLOCKS : inf->n_blocks;
+    tpool_submit(inf->pool, fq_bgzf_job, job);
+  }
+  while(inf->n_jobs > 0)
+    pthread_cond_wait(&inf->cond, &inf->lock);
+  error = inf->error;
+  pthread_mutex_unlock(&inf->lock);
+  inf->raw_len = 0;
+  if(error && ret >= 0){
+    fprintf(stderr, "Error reading fastq: corrupt BGZF block\n");
+    return 0;
+  }
+  return len;
+}
+static size_t fq_gz_fill(FqInflater *inf, char *dst){
+  int n = gzread(inf->gz, dst, FQ_BLOCK_SIZE);
+  int errnum;
+  //a truncated file reads as its end, only gzerror tells them apart
+  if(n < 0 || (n == 0 && (gzerror(inf->gz, &errnum), errnum != Z_OK))){
+    fprintf(stderr, "Error reading fastq: %s\n", gzerror(inf->gz, &errnum));
+    pthread_mutex_lock(&inf->lock);
+    inf->error = true;
+    pthread_mutex_unlock(&inf->lock);
+    return 0;
+  }
+  return n;
+}
+
+/**
+ * Background thread: keep the ring topped up with
+ * inflated chunks until the file runs out
+ */
+static void *fq_inflater_main(void *arg){
+  FqInflater *inf = (FqInflater*)arg;
+  FqChunk *c;
+  for(;;){
+    pthread_mutex_lock(&inf->lock);
+    while(inf->n_ready == FQ_RING && !inf->stop)
+      pthread_cond_wait(&inf->cond, &inf->lock);
+    if(inf->stop){
+      pthread_mutex_unlock(&inf->lock);
+      return NULL;
+    }
+    //only the parser touches the chunks that are ready
+    c = &inf->ring[(inf->head + inf->n_ready) % FQ_RING];
+    pthread_mutex_unlock(&inf->lock);
+
+    c->len = inf->fp ? fq_bgzf_fill(inf, c->data) : fq_gz_fill(inf, c->data);
+
+    pthread_mutex_lock(&inf->lock);
+    if(c->len > 0)
+      inf->n_ready++;
+    if(c->len == 0 || inf->error)
+      inf->finished = true;
+    pthread_cond_broadcast(&inf->cond);
+    pthread_mutex_unlock(&inf->lock);
+    if(inf->finished)
+      return NULL;
+  }
+}
+
+//"-" reads stdin, plain or gzip'ed
+static gzFile fq_gzopen(const char *name){
+  if(strcmp(name, "-") == 0)
+    return gzdopen(STDIN_FILENO, "r");
+  return gzopen(name, "r");
+}
+
+static FqInflater *fq_inflater_open(const char *name, TPool *pool){
+  FqInflater *inf = (FqInflater*)calloc(1, sizeof(FqInflater));
+  int i;
+  if(fq_is_bgzf(name)){
+    inf->fp = fopen(name, "rb");
+    if(inf->fp)
+      setvbuf(inf->fp, NULL, _IOFBF, FQ_GZ_BUFFER);
+    inf->pool = pool;
+  }else{
+    inf->gz = fq_gzopen(name);
+    if(inf->gz != Z_NULL)
+      gzbuffer(inf->gz, FQ_GZ_BUFFER);
+  }
+  if(inf->fp == NULL && inf->gz == Z_NULL){
+    free(inf);
+    return NULL;
+  }
+  for(i=0;i<FQ_RING;i++)
+    inf->ring[i].data = (char*)malloc(FQ_BLOCK_SIZE);
+  pthread_mutex_init(&inf->lock, NULL);
+  pthread_cond_init(&inf->cond, NULL);
+  pthread_create(&inf->thread, NULL, fq_inflater_main, inf);
+  return inf;
+}
+
+static void fq_inflater_close(FqInflater *inf){
+  int i;
+  pthread_mutex_lock(&inf->lock);
+  inf->stop = true;
+  pthread_cond_broadcast(&inf->cond);
+  pthread_mutex_unlock(&inf->lock);
+  pthread_join(inf->thread, NULL);
+  if(inf->fp)
+    fclose(inf->fp);
+  if(inf->gz)
+    gzclose(inf->gz);
+  for(i=0;i<FQ_RING;i++)
+    free(inf->ring[i].data);
+  free(inf->raw);
+  pthread_cond_destroy(&inf->cond);
+  pthread_mutex_destroy(&inf->lock);
+  free(inf);
+}
+
+/**
+ * Copy up to len inflated bytes out of the ring,
+ * returns 0 once the file is used up
+ */
+static size_t fq_inflater_read(FqInflater *inf, char *dst, size_t len){
+  FqChunk *c;
+  pthread_mutex_lock(&inf->lock);
+  while(inf->n_ready == 0 && !inf->finished)
+    pthread_cond_wait(&inf->cond, &inf->lock);
+  if(inf->n_ready == 0){
+    pthread_mutex_unlock(&inf->lock);
+    return 0;
+  }
+  c = &inf->ring[inf->head];
+  pthread_mutex_unlock(&inf->lock);
+  if(len > c->len - inf->head_pos)
+    len = c->len - inf->head_pos;
+  memcpy(dst, c->data + inf->head_pos, len);
+  inf->head_pos += len;
+  if(inf->head_pos == c->len){
+    pthread_mutex_lock(&inf->lock);
+    inf->head = (inf->head + 1) % FQ_RING;
+    inf->n_ready--;
+    inf->head_pos = 0;
+    pthread_cond_broadcast(&inf->cond);
+    pthread_mutex_unlock(&inf->lock);
+  }
+  return len;
+}
+
+/* true once the inflating thread has given up on a bad file */
+static bool fq_inflater_failed(FqInflater *inf){
+  bool error;
+  pthread_mutex_lock(&inf->lock);
+  error = inf->error;
+  pthread_mutex_unlock(&inf->lock);
+  return error;
+}
+
+/**
+ * Map an uncompressed regular file straight into memory, the whole
+ * mapping then serves as the reader's buffer and records point into it.
+ * Returns NULL for anything else (gzip, pipes, empty files).
+ */
+static FqReader *fq_map(const char *name){
+  FqReader *r;
+  struct stat st;
+  unsigned char magic[2];
+  void *map;
+  int fd = strcmp(name, "-") == 0 ? -1 : open(name, O_RDONLY);
+  if(fd < 0)
+    return NULL;
+  if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 2
+      || read(fd, magic, 2) != 2 || (magic[0] == 0x1f && magic[1] == 0x8b)){
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    return NULL;
+  posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+  r = (FqReader*)calloc(1, sizeof(FqReader));
+  r->buf = (char*)map;
+  r->cap = r->len = st.st_size;
+  r->eof = true; //all of the file is already in the buffer
+  r->mapped = true;
+  return r;
+}
+
+/** fq_open **/
+FqReader *fq_open(const char *name, TPool *pool){
+  FqReader *r;
+  gzFile gz = Z_NULL;
+  FqInflater *inf = NULL;
+  fq_init_tables();
+  if((r = fq_map(name)) != NULL)
+    return r;
+  if(pool)
+    inf = fq_inflater_open(name, pool);
+  else
+    gz = fq_gzopen(name);
+  if (gz == Z_NULL && inf == NULL) {
+    fprintf( stderr, "%s\n", name);
+    perror("Cannot open file");
+    return NULL;
+  }
+  if(gz)
+    gzbuffer(gz, FQ_GZ_BUFFER);
+  r = (FqReader*)calloc(1, sizeof(FqReader));
+  r->gz = gz;
+  r->inf = inf;
+  r->cap = FQ_BLOCK_SIZE;
+  r->buf = (char*)malloc(r->cap);
+  return r;
+}
+
+void fq_close(FqReader *r){
+  if(r == NULL)
+    return;
+  if(r->mapped){
+    munmap(r->buf, r->len);
+    free(r);
+    return;
+  }
+  if(r->inf)
+    fq_inflater_close(r->inf);
+  else
+    gzclose(r->gz);
+  free(r->buf);
+  free(r);
+}
+
+/**
+ * Move the unread part of the buffer to the front and top
+ * it off with the next block of the file
+ */
+static void fq_fill(FqReader *r){
+  int n, errnum;
+  if(r->pos > 0){
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+  }
+  if(r->len == r->cap){
+    //a single record bigger than the buffer, make room for it
+    r->cap <<= 1;
+    r->buf = (char*)realloc(r->buf, r->cap);
+    if(r->buf == NULL){
+      fprintf(stderr, "Out of memory reading fastq\n");
+      exit(1);
+    }
+  }
+  if(r->inf){ //the background thread reports its own errors
+    n = fq_inflater_read(r->inf, r->buf + r->len, r->cap - r->len);
+    if(n == 0 && fq_inflater_failed(r->inf))
+      r->error = true;
+  }else{
+    n = gzread(r->gz, r->buf + r->len, r->cap - r->len);
+  }
+  if(n < 0 || (n == 0 && !r->inf && (gzerror(r->gz, &errnum), errnum != Z_OK))){
+    fprintf(stderr, "Error reading fastq: %s\n", gzerror(r->gz, &errnum));
+    r->error = true;
+    r->eof = true;
+  }else if(n == 0){
+    r->eof = true;
+  }else{
+    r->len += n;
+  }
+}
+
+/* fq_next_record
+   Find the four lines of the next record in the buffer.
+   Return 1 => rec points to another record
+          0 => EOF
+ */
+int fq_next_record(FqReader *r, FqRecord *rec){
+  size_t ends[4]; //offsets of the newlines, relative to r->pos
+  size_t scan = 0;
+  int n = 0;
+  char *p;
+
+  if(r->done)
+    return 0;
+  for(;;){
+    while(n < 4){
+      p = (char*)memchr(r->buf + r->pos + scan, '\n', r->len - r->pos - scan);
+      if(p == NULL)
+        break;
+      ends[n++] = p - (r->buf + r->pos);
+      scan = ends[n-1] + 1;
+    }
+    if(n == 4 || r->eof)
+      break;
+    scan = r->len - r->pos; //everything there so far has been searched
+    fq_fill(r);
+  }
+
+  p = r->buf + r->pos;
+  if(r->pos == r->len){
+    r->done = true;
+    return 0;
+  }
+  if(p[0] != '@'){
+    fprintf( stderr, "fastq record not beginning with @\n" );
+    r->done = true;
+    return 0;
+  }
+  if(n < 2){
+    //ran out of file in the middle of the header or the sequence
+    r->done = true;
+    return 0;
+  }
+  rec->id = p + 1;
+  rec->id_len = ends[0] - 1;
+  rec->seq = p + ends[0] + 1;
+  rec->seq_len = ends[1] - ends[0] - 1;
+  rec->bad_plus = false;
+  if(r->pos + ends[1] + 1 >= r->len || p[ends[1]+1] != '+'){
+    //caller complains about this, we can't go any further
+    rec->bad_plus = true;
+    rec->qual = rec->seq + rec->seq_len;
+    rec->qual_len = 0;
+    r->done = true;
+    return 1;
+  }
+  if(n < 4){
+    fprintf(stderr,"\nWarning: Your last read may have been discarded because you are missing a new line at the end of the file.\n\n");
+    r->done = true;
+    return 0;
+  }
+  rec->qual = p + ends[2] + 1;
+  rec->qual_len = ends[3] - ends[2] - 1;
+  r->pos += ends[3] + 1;
+  return 1;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <zlib.h>
+#include "tpool.h"
+
+/**
+ * Block buffered fastq reader.
+ *
+ * The input is inflated into a large buffer and each record
+ * is located with memchr, the lines of a record are handed back
+ * as pointers into that buffer so nothing is copied until the
+ * caller decides where the bases should go.
+ *
+ * An uncompressed file is mmap'ed instead and the mapping is the buffer,
+ * so reading it costs no copies until the bases are pulled out of a record.
+ *
+ * When opened with a thread pool the file is inflated ahead of the
+ * parser on a thread of its own into a small ring of chunks. BGZF
+ * input (every member records its own size) is split up further and
+ * its blocks are inflated in parallel on the pool.
+ */
+
+//size of the blocks read from the (possibly compressed) file
+#define FQ_BLOCK_SIZE (4<<20)
+//decompressed chunks a background reader may get ahead by
+#define FQ_RING (4)
+
+typedef struct {
+  const char *id;   //header line without the leading '@'
+  size_t id_len;
+  const char *seq;
+  size_t seq_len;
+  const char *qual;
+  size_t qual_len;
+  bool bad_plus;    //the third line did not start with '+'
+} FqRecord;
+
+typedef struct fq_inflater FqInflater;
+
+typedef struct {
+  gzFile gz;        //NULL when the file is inflated in the background
+  FqInflater *inf;
+  char *buf;
+  size_t cap;       //allocated size of buf
+  size_t len;       //bytes of valid data in buf
+  size_t pos;       //start of the next record in buf
+  bool eof;         //no more data to be had from gz
+  bool done;        //no more records to be had at all
+  bool mapped;      //buf is a read only mapping of an uncompressed file
+  bool error;       //the file could not be decompressed to its end
+} FqReader;
+
+/* pool may be NULL to inflate the file on the calling thread */
+FqReader *fq_open(const char *name, TPool *pool);
+void fq_close(FqReader *r);
+/* returns 1 and fills rec if there is another record, 0 at the end */
+int fq_next_record(FqReader *r, FqRecord *rec);
+/* copy at most max_len bases/quals of a record line, skipping whitespace,
+   returns the number of characters written (dst is not null terminated) */
+size_t fq_copy_seq(char *dst, const char *src, size_t len, size_t max_len);
+size_t fq_copy_qual(char *dst, const char *src, size_t len, size_t max_len, bool p64);
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include "outstream.h"
+
+//empty BGZF block that marks the end of the file
+static const unsigned char bgzf_eof[28] = {
+  0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+  0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+#define BGZF_HEADER_LEN (18)
+#define BGZF_FOOTER_LEN (8)
+
+/** out_open **/
+OutStream *out_open(const char *name, int mode, TPool *pool, int max_pending){
+  OutStream *os = (OutStream*)calloc(1, sizeof(OutStream));
+  if(pool == NULL && mode == OUT_MODE_PGZIP)
+    mode = OUT_MODE_GZIP;
+  os->mode = mode;
+  os->pool = pool;
+  os->max_pending = max_pending > 0 ? max_pending : 1;
+  os->to_stdout = strcmp(name, "-") == 0;
+  os->name = (char*)malloc(strlen(name) + 1);
+  strcpy(os->name, name);
+  if(mode == OUT_MODE_GZIP){
+    os->gz = os->to_stdout ? gzdopen(STDOUT_FILENO, "w") : gzopen(name, "w");
+    if(os->gz == Z_NULL){
+      fprintf( stderr, "%s\n", name);
+      perror("Cannot open file");
+      free(os->name);
+      free(os);
+      return NULL;
+    }
+  }else{
+    os->fp = os->to_stdout ? stdout : fopen(name, "wb");
+    if(os->fp == NULL){
+      fprintf( stderr, "%s\n", name);
+      perror("Cannot open file");
+      free(os->name);
+      free(os);
+      return NULL;
+    }
+    if(mode == OUT_MODE_PLAIN){
+      setvbuf(os->fp, NULL, _IOFBF, OUT_PLAIN_BUFFER);
+      return os;
+    }
+    os->block_size = (mode == OUT_MODE_BGZF) ? OUT_BGZF_BLOCK_SIZE : OUT_PGZIP_BLOCK_SIZE;
+    pthread_mutex_init(&os->lock, NULL);
+    pthread_cond_init(&os->cond, NULL);
+  }
+  return os;
+}
+
+void out_index(OutStream *os, const char *name, unsigned long long interval){
+  if(os->mode != OUT_MODE_BGZF || interval == 0)
+    return;
+  if(os->to_stdout){
+    fprintf(stderr, "No record index is kept for output written to stdout\n");
+    return;
+  }
+  os->index_fn = (char*)malloc(strlen(name) + strlen(OUT_INDEX_SUFFIX) + 1);
+  strcpy(os->index_fn, name);
+  strcat(os->index_fn, OUT_INDEX_SUFFIX);
+  os->index_interval = interval;
+}
+
+static OutBlock *out_block_get(OutStream *os){
+  OutBlock *b;
+  pthread_mutex_lock(&os->lock);
+  b = os->spare;
+  if(b)
+    os->spare = b->next;
+  pthread_mutex_unlock(&os->lock);
+  if(b == NULL){
+    b = (OutBlock*)calloc(1, sizeof(OutBlock));
+    b->in = (char*)malloc(os->block_size);
+    b->os = os;
+  }
+  b->in_len = 0;
+  b->out_len = 0;
+  b->done = false;
+  b->next = NULL;
+  return b;
+}
+
+static void out_block_free(OutBlock *b){
+  free(b->in);
+  free(b->out);
+  free(b);
+}
+
+static void out_block_reserve(OutBlock *b, size_t len){
+  if(len > b->out_cap){
+    b->out_cap = len;
+    b->out = (unsigned char*)realloc(b->out, b->out_cap);
+  }
+}
+
+/**
+ * Compress one block into a complete gzip member, false if zlib failed
+ */
+static bool out_deflate_block(OutBlock *b){
+  z_stream z;
+  bool ok = true;
+  memset(&z, 0, sizeof(z));
+  if(deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+    fprintf(stderr, "Error compressing output block\n");
+    b->out_len = 0;
+    return false;
+  }
+  out_block_reserve(b, deflateBound(&z, b->in_len));
+  z.next_in = (Bytef*)b->in;
+  z.avail_in = b->in_len;
+  z.next_out = b->out;
+  z.avail_out = b->out_cap;
+  if(deflate(&z, Z_FINISH) != Z_STREAM_END){
+    fprintf(stderr, "Error compressing output block\n");
+    ok = false;
+  }
+  b->out_len = b->out_cap - z.avail_out;
+  deflateEnd(&z);
+  return ok;
+}
+
+static void put_le16(unsigned char *p, unsigned v){
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+}
+
+static void put_le32(unsigned char *p, uint32_t v){
+  put_le16(p, v & 0xffff);
+  put_le16(p + 2, v >> 16);
+}
+
+/**
+ * Compress one block into a BGZF member: a gzip header carrying the
+ * 'BC' extra field with the size of the whole member, a raw deflate
+ * stream, then the crc32 and the uncompressed length. False if zlib failed.
+ */
+static bool out_bgzf_block(OutBlock *b){
+  z_stream z;
+  int level = Z_DEFAULT_COMPRESSION;
+  size_t clen;
+  static const unsigned char header[BGZF_HEADER_LEN - 2] = {
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00
+  };
+  out_block_reserve(b, OUT_BGZF_MAX_BLOCK);
+  for(;;){
+    memset(&z, 0, sizeof(z));
+    if(deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+      fprintf(stderr, "Error compressing BGZF block\n");
+      b->out_len = 0;
+      return false;
+    }
+    z.next_in = (Bytef*)b->in;
+    z.avail_in = b->in_len;
+    z.next_out = b->out + BGZF_HEADER_LEN;
+    z.avail_out = OUT_BGZF_MAX_BLOCK - BGZF_HEADER_LEN - BGZF_FOOTER_LEN;
+    int ret = deflate(&z, Z_FINISH);
+    clen = z.total_out;
+    deflateEnd(&z);
+    if(ret == Z_STREAM_END)
+      break;
+    //Z_OK or Z_BUF_ERROR only mean the output did not fit
+    if(level == Z_NO_COMPRESSION || (ret != Z_OK && ret != Z_BUF_ERROR)){
+      fprintf(stderr, "Error compressing BGZF block\n");
+      b->out_len = 0;
+      return false;
+    }
+    //did not fit in 64k, incompressible data gets stored as is
+    level = Z_NO_COMPRESSION;
+  }
+  memcpy(b->out, header, sizeof(header));
+  b->out_len = BGZF_HEADER_LEN + clen + BGZF_FOOTER_LEN;
+  put_le16(b->out + 16, b->out_len - 1);
+  put_le32(b->out + BGZF_HEADER_LEN + clen, crc32(crc32(0L, Z_NULL, 0), (Bytef*)b->in, b->in_len));
+  put_le32(b->out + BGZF_HEADER_LEN + clen + 4, b->in_len);
+  return true;
+}
+
+static void out_note_block(OutStream *os, OutBlock *b){
+  if(os->index_fn){
+    if(os->n_block == os->m_block){
+      os->m_block = os->m_block ? os->m_block << 1 : 1024;
+      os->block_off = (unsigned long long*)realloc(os->block_off, sizeof(unsigned long long) * os->m_block);
+    }
+    os->block_off[os->n_block++] = os->c_bytes;
+  }
+  os->c_bytes += b->out_len;
+}
+
+/* remember the first failed write, reported when the stream is closed */
+static void out_error(OutStream *os){
+  if(!os->error)
+    os->error_no = errno;
+  os->error = true;
+}
+
+/**
+ * Pool job: compress a block and then write out whatever
+ * is finished at the front of the stream's queue
+ */
+static void out_block_job(void *arg){
+  OutBlock *b = (OutBlock*)arg;
+  OutStream *os = b->os;
+  bool ok = os->mode == OUT_MODE_BGZF ? out_bgzf_block(b) : out_deflate_block(b);
+  pthread_mutex_lock(&os->lock);
+  if(!ok){
+    errno = EIO; //zlib leaves no errno of its own
+    out_error(os);
+  }
+  b->done = true;
+  while(os->head && os->head->done){
+    OutBlock *h = os->head;
+    if(fwrite(h->out, 1, h->out_len, os->fp) != h->out_len)
+      out_error(os);
+    out_note_block(os, h);
+    os->head = h->next;
+    if(os->head == NULL)
+      os->tail = NULL;
+    h->next = os->spare;
+    os->spare = h;
+    os->n_pending--;
+  }
+  pthread_cond_broadcast(&os->cond);
+  pthread_mutex_unlock(&os->lock);
+}
+
+static void out_submit(OutStream *os){
+  OutBlock *b = os->cur;
+  os->cur = NULL;
+  pthread_mutex_lock(&os->lock);
+  while(os->n_pending >= os->max_pending)
+    pthread_cond_wait(&os->cond, &os->lock);
+  if(os->tail)
+    os->tail->next = b;
+  else
+    os->head = b;
+  os->tail = b;
+  os->n_pending++;
+  os->wrote_block = true;
+  pthread_mutex_unlock(&os->lock);
+  if(os->pool)
+    tpool_submit(os->pool, out_block_job, b);
+  else
+    out_block_job(b);
+}
+
+/**
+ * Remember where every interval'th record starts, records are
+ * found by counting newlines since a fastq record is always four lines
+ */
+static void out_index_records(OutStream *os, const char *s, size_t len){
+  const char *p = s;
+  const char *end = s + len;
+  unsigned long long every = os->index_interval * 4;
+  while(p < end && (p = (const char*)memchr(p, '\n', end - p)) != NULL){
+    p++;
+    os->n_lines++;
+    if(os->n_lines % every == 0){
+      if(os->n_rec == os->m_rec){
+        os->m_rec = os->m_rec ? os->m_rec << 1 : 1024;
+        os->rec_off = (unsigned long long*)realloc(os->rec_off, sizeof(unsigned long long) * os->m_rec);
+      }
+      os->rec_off[os->n_rec++] = os->n_bytes + (p - s);
+    }
+  }
+}
+
+void out_write(OutStream *os, const char *s, size_t len){
+  size_t n;
+  if(os->mode == OUT_MODE_GZIP){
+    if(len > 0)
+      gzwrite(os->gz, s, len);
+    return;
+  }
+  if(os->mode == OUT_MODE_PLAIN){
+    if(fwrite(s, 1, len, os->fp) != len)
+      out_error(os);
+    return;
+  }
+  if(os->index_fn)
+    out_index_records(os, s, len);
+  os->n_bytes += len;
+  while(len > 0){
+    if(os->cur == NULL)
+      os->cur = out_block_get(os);
+    n = os->block_size - os->cur->in_len;
+    if(n > len)
+      n = len;
+    memcpy(os->cur->in + os->cur->in_len, s, n);
+    os->cur->in_len += n;
+    s += n;
+    len -= n;
+    if(os->cur->in_len == os->block_size)
+      out_submit(os);
+  }
+}
+
+/**
+ * Write "record number <tab> virtual offset" for every indexed record
+ */
+static int out_write_index(OutStream *os){
+  FILE *fp = fopen(os->index_fn, "w");
+  size_t i;
+  int ret;
+  if(fp == NULL){
+    fprintf( stderr, "%s\n", os->index_fn);
+    perror("Cannot open file");
+    return -1;
+  }
+  fprintf(fp, "#record\tvirtual_offset\n");
+  if(os->n_bytes > 0)
+    fprintf(fp, "0\t0\n");
+  for(i=0;i<os->n_rec;i++){
+    unsigned long long off = os->rec_off[i];
+    if(off >= os->n_bytes)
+      break; //end of the file, not the start of a record
+    unsigned long long block = off / os->block_size;
+    fprintf(fp, "%llu\t%llu\n", (i + 1) * os->index_interval,
+        (os->block_off[block] << 16) | (off % os->block_size));
+  }
+  ret = ferror(fp) ? -1 : 0;
+  if(fclose(fp) != 0)
+    ret = -1;
+  if(ret != 0){
+    fprintf( stderr, "%s\n", os->index_fn);
+    perror("Error writing output");
+  }
+  return ret;
+}
+
+static void out_close_error(OutStream *os){
+  if(os->error_no)
+    errno = os->error_no;
+  fprintf( stderr, "%s\n", os->name);
+  perror("Error writing output");
+}
+
+int out_close(OutStream *os){
+  int ret = 0;
+  OutBlock *b;
+  if(os == NULL)
+    return 0;
+  if(os->mode == OUT_MODE_GZIP){
+    //gzwrite only buffers, a failed write shows up here at the latest
+    ret = gzclose(os->gz) == Z_OK ? 0 : -1;
+    if(ret != 0)
+      out_close_error(os);
+    free(os->name);
+    free(os);
+    return ret;
+  }
+  if(os->mode == OUT_MODE_PLAIN){
+    ret = (fclose(os->fp) == 0 && !os->error) ? 0 : -1;
+    if(ret != 0)
+      out_close_error(os);
+    free(os->name);
+    free(os);
+    return ret;
+  }
+  //flush the partial block, an empty gzip file still gets one (empty) member
+  if(os->cur && os->cur->in_len > 0)
+    out_submit(os);
+  else if(!os->wrote_block && os->mode != OUT_MODE_BGZF){
+    if(os->cur == NULL)
+      os->cur = out_block_get(os);
+    out_submit(os);
+  }
+  pthread_mutex_lock(&os->lock);
+  while(os->n_pending > 0)
+    pthread_cond_wait(&os->cond, &os->lock);
+  pthread_mutex_unlock(&os->lock);
+  if(os->mode == OUT_MODE_BGZF && fwrite(bgzf_eof, 1, sizeof(bgzf_eof), os->fp) != sizeof(bgzf_eof))
+    out_error(os);
+  if(os->cur)
+    out_block_free(os->cur);
+  while((b = os->spare) != NULL){
+    os->spare = b->next;
+    out_block_free(b);
+  }
+  if(os->error)
+    ret = -1;
+  if(fclose(os->fp) != 0)
+    ret = -1;
+  if(ret != 0)
+    out_close_error(os);
+  if(os->index_fn && out_write_index(os) != 0)
+    ret = -1;
+  free(os->name);
+  free(os->index_fn);
+  free(os->rec_off);
+  free(os->block_off);
+  pthread_cond_destroy(&os->cond);
+  pthread_mutex_destroy(&os->lock);
+  free(os);
+  return ret;
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "tpool.h"
+
+/**
+ * Output file that is either a single gzip stream written through zlib,
+ * or a series of independent gzip members that are compressed in parallel
+ * on a thread pool and written out in order. Concatenated gzip members
+ * are still a valid gzip file so zcat/gzip -d read both the same way.
+ * OUT_MODE_PLAIN skips compression altogether for writing into a pipe.
+ *
+ * BGZF is the blocked gzip flavour from samtools: every member holds at
+ * most 64k and says how big it is, so a reader can seek to a virtual file
+ * offset (compressed block start << 16 | offset inside the block). A BGZF
+ * stream can also keep a record index next to the file, see out_index().
+ */
+
+#define OUT_MODE_GZIP (0)   //one zlib stream, compressed on the calling thread
+#define OUT_MODE_PGZIP (1)  //independent blocks compressed on a thread pool
+#define OUT_MODE_BGZF (2)   //BGZF blocks, compressed on the pool if there is one
+#define OUT_MODE_PLAIN (3)  //uncompressed, zlib is not involved at all
+
+//uncompressed bytes per gzip member in parallel mode
+#define OUT_PGZIP_BLOCK_SIZE (1<<20)
+//uncompressed bytes per BGZF block, leaves room for the header and footer
+#define OUT_BGZF_BLOCK_SIZE (0xff00)
+#define OUT_BGZF_MAX_BLOCK (0x10000)
+//suffix of the record index kept beside a BGZF file
+#define OUT_INDEX_SUFFIX ".ridx"
+//stdio buffer for uncompressed output
+#define OUT_PLAIN_BUFFER (1<<20)
+
+typedef struct out_block {
+  char *in;
+  size_t in_len;
+  unsigned char *out;
+  size_t out_len;
+  size_t out_cap;
+  bool done;
+  struct out_stream *os;
+  struct out_block *next;
+} OutBlock;
+
+typedef struct out_stream {
+  int mode;
+  char *name;            //for error messages
+  gzFile gz;
+  FILE *fp;
+  TPool *pool;
+  size_t block_size;
+  int max_pending;       //blocks in flight before writers have to wait
+  OutBlock *cur;         //block currently being filled
+  OutBlock *head, *tail; //blocks handed to the pool, in file order
+  OutBlock *spare;       //finished blocks ready for reuse
+  int n_pending;
+  bool wrote_block;
+  bool error;
+  int error_no;          //errno of the first failed write, it may have been on a pool thread
+  bool to_stdout;
+  //record index (BGZF only)
+  char *index_fn;
+  unsigned long long index_interval; //records between index entries
+  unsigned long long n_lines;        //newlines seen so far, 4 per fastq record
+  unsigned long long n_bytes;        //uncompressed bytes written so far
+  unsigned long long *rec_off;       //uncompressed offset of every indexed record
+  size_t n_rec, m_rec;
+  unsigned long long *block_off;     //compressed offset of every written block
+  size_t n_block, m_block;
+  unsigned long long c_bytes;        //compressed bytes written so far
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} OutStream;
+
+/* pool may be NULL, in which case OUT_MODE_PGZIP becomes OUT_MODE_GZIP,
+   a name of "-" writes to stdout */
+OutStream *out_open(const char *name, int mode, TPool *pool, int max_pending);
+/* keep an index of every interval'th fastq record of a BGZF stream,
+   it is written to <name>.ridx when the stream is closed */
+void out_index(OutStream *os, const char *name, unsigned long long interval);
+void out_write(OutStream *os, const char *s, size_t len);
+/* flush everything, close the file and free the stream, returns 0 on success
+   and reports the file on stderr otherwise */
+int out_close(OutStream *os);
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "pipeline.h"
+
+#define SLOT_FREE (0)
+#define SLOT_QUEUED (1)
+#define SLOT_DONE (2)
+
+typedef struct {
+  Pipeline *p;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int *state;                   //per batch slot state
+  unsigned long long *seq;      //per batch slot input order
+  int *work_q;                  //ring of queued slots
+  int work_head, work_tail, work_n;
+  unsigned long long n_read;    //number of batches handed to the workers
+  bool eof;
+} PipeState;
+
+typedef struct {
+  PipeState *ps;
+  int id;
+} WorkerArg;
+
+static int take_free_slot(PipeState *ps){
+  int i;
+  for(i=0;i<ps->p->n_batches;i++){
+    if(ps->state[i] == SLOT_FREE)
+      return i;
+  }
+  return -1;
+}
+
+static void *reader_main(void *arg){
+  PipeState *ps = (PipeState*)arg;
+  Pipeline *p = ps->p;
+  int slot;
+  for(;;){
+    pthread_mutex_lock(&ps->lock);
+    while((slot = take_free_slot(ps)) < 0)
+      pthread_cond_wait(&ps->cond, &ps->lock);
+    ps->state[slot] = SLOT_QUEUED; //reserve it while we read
+    pthread_mutex_unlock(&ps->lock);
+
+    int n = p->read(p->batches[slot], p->ctx);
+
+    pthread_mutex_lock(&ps->lock);
+    if(n <= 0){
+      ps->state[slot] = SLOT_FREE;
+      ps->eof = true;
+      pthread_cond_broadcast(&ps->cond);
+      pthread_mutex_unlock(&ps->lock);
+      return NULL;
+    }
+    ps->seq[slot] = ps->n_read++;
+    ps->work_q[ps->work_tail] = slot;
+    ps->work_tail = (ps->work_tail + 1) % p->n_batches;
+    ps->work_n++;
+    pthread_cond_broadcast(&ps->cond);
+    pthread_mutex_unlock(&ps->lock);
+  }
+}
+
+static void *worker_main(void *arg){
+  WorkerArg *wa = (WorkerArg*)arg;
+  PipeState *ps = wa->ps;
+  Pipeline *p = ps->p;
+  int slot;
+  for(;;){
+    pthread_mutex_lock(&ps->lock);
+    while(ps->work_n == 0 && !ps->eof)
+      pthread_cond_wait(&ps->cond, &ps->lock);
+    if(ps->work_n == 0){ //eof and nothing left to do
+      pthread_mutex_unlock(&ps->lock);
+      return NULL;
+    }
+    slot = ps->work_q[ps->work_head];
+    ps->work_head = (ps->work_head + 1) % p->n_batches;
+    ps->work_n--;
+    pthread_mutex_unlock(&ps->lock);
+
+    p->work(p->batches[slot], p->worker_ctxs[wa->id]);
+
+    pthread_mutex_lock(&ps->lock);
+    ps->state[slot] = SLOT_DONE;
+    pthread_cond_broadcast(&ps->cond);
+    pthread_mutex_unlock(&ps->lock);
+  }
+}
+
+static int find_done_slot(PipeState *ps, unsigned long long seq){
+  int i;
+  for(i=0;i<ps->p->n_batches;i++){
+    if(ps->state[i] == SLOT_DONE && ps->seq[i] == seq)
+      return i;
+  }
+  return -1;
+}
+
+/**
+ * Run the single threaded version, no locking required
+ */
+static void pipeline_run_inline(Pipeline *p){
+  void *batch = p->batches[0];
+  while(p->read(batch, p->ctx) > 0){
+    p->work(batch, p->worker_ctxs[0]);
+    p->write(batch, p->ctx);
+  }
+}
+
+void pipeline_run(Pipeline *p){
+  if(p->n_workers <= 1){
+    pipeline_run_inline(p);
+    return;
+  }
+  PipeState ps;
+  int i, slot;
+  ps.p = p;
+  pthread_mutex_init(&ps.lock, NULL);
+  pthread_cond_init(&ps.cond, NULL);
+  ps.state = (int*)calloc(p->n_batches, sizeof(int));
+  ps.seq = (unsigned long long*)calloc(p->n_batches, sizeof(unsigned long long));
+  ps.work_q = (int*)calloc(p->n_batches, sizeof(int));
+  ps.work_head = ps.work_tail = ps.work_n = 0;
+  ps.n_read = 0;
+  ps.eof = false;
+
+  pthread_t reader;
+  pthread_t *workers = (pthread_t*)malloc(sizeof(pthread_t) * p->n_workers);
+  WorkerArg *wargs = (WorkerArg*)malloc(sizeof(WorkerArg) * p->n_workers);
+  pthread_create(&reader, NULL, reader_main, &ps);
+  for(i=0;i<p->n_workers;i++){
+    wargs[i].ps = &ps;
+    wargs[i].id = i;
+    pthread_create(&workers[i], NULL, worker_main, &wargs[i]);
+  }
+
+  //this thread is the writer, emit batches strictly in input order
+  unsigned long long next = 0;
+  for(;;){
+    pthread_mutex_lock(&ps.lock);
+    while((slot = find_done_slot(&ps, next)) < 0 && !(ps.eof && next == ps.n_read))
+      pthread_cond_wait(&ps.cond, &ps.lock);
+    pthread_mutex_unlock(&ps.lock);
+    if(slot < 0)
+      break; //everything has been written
+
+    p->write(p->batches[slot], p->ctx);
+
+    pthread_mutex_lock(&ps.lock);
+    ps.state[slot] = SLOT_FREE;
+    next++;
+    pthread_cond_broadcast(&ps.cond);
+    pthread_mutex_unlock(&ps.lock);
+  }
+
+  pthread_join(reader, NULL);
+  for(i=0;i<p->n_workers;i++)
+    pthread_join(workers[i], NULL);
+  free(workers);
+  free(wargs);
+  free(ps.state);
+  free(ps.seq);
+  free(ps.work_q);
+  pthread_cond_destroy(&ps.cond);
+  pthread_mutex_destroy(&ps.lock);
+}
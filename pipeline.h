@@ -0,0 +1,34 @@
+#pragma once
+#include <stdbool.h>
+#include <pthread.h>
+
+/**
+ * Ordered batch pipeline:
+ *   one reader thread fills batches,
+ *   a pool of workers processes them in any order,
+ *   and the calling thread writes them back out in input order.
+ *
+ * The batches themselves are opaque to the pipeline, the caller
+ * supplies a pool of them along with the three stage callbacks.
+ * With n_workers <= 1 everything runs inline on the calling thread.
+ */
+
+/* fill a batch, return the number of records read (0 => EOF) */
+typedef int (*PipeReadFn)(void *batch, void *ctx);
+/* process a batch, worker_ctx is private to the worker thread */
+typedef void (*PipeWorkFn)(void *batch, void *worker_ctx);
+/* write a processed batch, always called in input order */
+typedef void (*PipeWriteFn)(void *batch, void *ctx);
+
+typedef struct {
+  void **batches;
+  int n_batches;
+  void **worker_ctxs;
+  int n_workers;
+  PipeReadFn read;
+  PipeWorkFn work;
+  PipeWriteFn write;
+  void *ctx;
+} Pipeline;
+
+void pipeline_run(Pipeline *p);
@@ -0,0 +1,94 @@
+#define _POSIX_C_SOURCE 200112L
+#include <time.h>
+#include "profile.h"
+
+static const char *prof_names[PROF_N_STAGES] = {
+  "Parse FASTQ",
+  "Duplicate check",
+  "Prepare batch",
+  "Adapter screen",
+  "Adapter alignment",
+  "Adapter overlap",
+  "Read alignment",
+  "Read overlap",
+  "Merge/blunt ends",
+  "Format output",
+  "Write output"
+};
+
+static uint64_t prof_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+uint64_t prof_start(const Profile *p){
+  return p->on ? prof_now() : 0;
+}
+
+uint64_t prof_end(Profile *p, int stage, uint64_t t0){
+  ProfStage *s;
+  uint64_t now, d;
+  int b = 0;
+  if(!p->on)
+    return 0;
+  now = prof_now();
+  d = now - t0;
+  s = &p->stage[stage];
+  s->calls++;
+  s->ns += d;
+  if(d > s->max_ns)
+    s->max_ns = d;
+  while(d && b < PROF_BINS - 1){
+    d >>= 1;
+    b++;
+  }
+  s->bins[b]++;
+  return now;
+}
+
+void prof_merge(Profile *dst, const Profile *src){
+  int i, b;
+  for(i=0;i<PROF_N_STAGES;i++){
+    ProfStage *d = &dst->stage[i];
+    const ProfStage *s = &src->stage[i];
+    d->calls += s->calls;
+    d->ns += s->ns;
+    if(s->max_ns > d->max_ns)
+      d->max_ns = s->max_ns;
+    for(b=0;b<PROF_BINS;b++)
+      d->bins[b] += s->bins[b];
+  }
+}
+
+/* upper end of the bin the call at fraction q of the way through falls in (at most the longest call), in microseconds */
+static double prof_quantile(const ProfStage *s, double q){
+  unsigned long long seen = 0, want = (unsigned long long)(q * (s->calls - 1)) + 1;
+  uint64_t end;
+  int b;
+  for(b=0;b<PROF_BINS;b++){
+    seen += s->bins[b];
+    if(seen >= want)
+      break;
+  }
+  end = (uint64_t)1 << b;
+  return (end < s->max_ns ? end : s->max_ns) / 1000.0;
+}
+
+void prof_print(FILE *fp, const Profile *p){
+  uint64_t total = 0;
+  int i;
+  for(i=0;i<PROF_N_STAGES;i++)
+    total += p->stage[i].ns;
+  fprintf(fp, "\n%-18s %12s %10s %6s %10s %10s %10s %10s\n",
+      "Stage", "Calls", "Total(s)", "Share", "Mean(us)", "p50(us)", "p99(us)", "Max(us)");
+  for(i=0;i<PROF_N_STAGES;i++){
+    const ProfStage *s = &p->stage[i];
+    if(s->calls == 0)
+      continue;
+    fprintf(fp, "%-18s %12llu %10.3f %5.1f%% %10.2f %10.2f %10.2f %10.2f\n",
+        prof_names[i], s->calls, s->ns / 1e9, total ? 100.0 * s->ns / total : 0.0,
+        s->ns / 1000.0 / s->calls, prof_quantile(s, 0.5), prof_quantile(s, 0.99), s->max_ns / 1000.0);
+  }
+  fprintf(fp, "(p50 and p99 are rounded up to a power of two nanoseconds)\n");
+}
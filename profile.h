@@ -0,0 +1,50 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Per-stage timing of a run (-c).
+ *
+ * Every thread times the stages it runs into a Profile of its own, so
+ * nothing is shared until the profiles are added up at the end. A stage
+ * keeps its number of calls, total and longest time and a histogram of
+ * its call times in power of two nanosecond bins. With profiling off
+ * both calls below return 0 straight away without reading the clock.
+ */
+
+enum {
+  PROF_PARSE,          //reader: next pair off of the input
+  PROF_DEDUP,          //reader: duplicate table check
+  PROF_PREPARE,        //worker, per batch: demultiplexing, quality and tail trimming
+  PROF_ADAPTER_SCREEN, //worker, per batch: q-gram and striped adapter score bounds
+  PROF_ADAPTER_ALN,    //local alignments of both reads to the adapters
+  PROF_ADAPTER_OLAP,   //adapter_trim overlaps
+  PROF_READ_ALN,       //read to read alignment
+  PROF_READ_OLAP,      //read_merge overlap of pairs without adapters
+  PROF_MERGE,          //merged sequence and blunt ends from the read alignment
+  PROF_FORMAT,         //fastq records of the kept reads into the batch buffers
+  PROF_WRITE,          //writer, per batch: handing buffers to the output streams
+  PROF_N_STAGES
+};
+
+#define PROF_BINS (40) //2^39 ns is over 9 minutes
+
+typedef struct {
+  unsigned long long calls;
+  uint64_t ns, max_ns;
+  unsigned long long bins[PROF_BINS]; //bin b holds calls of under 2^b ns
+} ProfStage;
+
+typedef struct {
+  bool on;
+  ProfStage stage[PROF_N_STAGES];
+} Profile;
+
+/* the time a stage starts at */
+uint64_t prof_start(const Profile *p);
+/* count a call of stage that started at t0, returns the time now so the next stage can start from it */
+uint64_t prof_end(Profile *p, int stage, uint64_t t0);
+void prof_merge(Profile *dst, const Profile *src);
+/* a line per stage that was called, with its share of the time of all of them */
+void prof_print(FILE *fp, const Profile *p);
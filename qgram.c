@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "qgram.h"
+
+#define QGRAM_NEG (INT_MIN/2)
+
+#ifndef max
+  #define max( a, b ) ( ((a) > (b)) ? (a) : (b) )
+#endif
+
+#ifndef min
+  #define min( a, b ) ( ((a) < (b)) ? (a) : (b) )
+#endif
+
+//2 bit code of a base, -1 for anything but ACGT
+static int qgram_base(char c){
+  switch(c){
+  case 'A': case 'a': return 0;
+  case 'C': case 'c': return 1;
+  case 'G': case 'g': return 2;
+  case 'T': case 't': return 3;
+  default: return -1;
+  }
+}
+
+//score of aligning base a to base b the way aln_stdaln_aux would look it up
+static int qgram_score(const AlnParam *ap, char a, char b){
+  unsigned char *table = ap->row < 10 ? aln_nt4_table : aln_nt16_table;
+  return ap->matrix[table[(unsigned char)a] * ap->row + table[(unsigned char)b]];
+}
+
+/**
+ * The fewest shared k-mers of any local alignment against len adapter
+ * bases scoring at least thresh, INT_MAX if none can. A match scores m,
+ * a mismatch or deletion costs at least x and uses up an adapter base,
+ * an insertion costs at least g and does not. The alignment that gets the
+ * most score out of the fewest k-mers is runs of matches split by single
+ * breaks, so a dp over (adapter bases used, current run, k-mers) finds it.
+ */
+static int qgram_min_hits(int len, int k, int m, int x, int g, int thresh){
+  int *cur = (int*)malloc(sizeof(int) * k * (len + 1));
+  int *nxt = (int*)malloc(sizeof(int) * k * (len + 1));
+  int *best = (int*)malloc(sizeof(int) * (len + 1));
+  int *tmp;
+  int a, r, c, s, min_hits = INT_MAX;
+#define DP(t, r, c) ((t)[(r) * (len + 1) + (c)])
+  for(c=0;c<=len;c++){
+    best[c] = QGRAM_NEG;
+    for(r=0;r<k;r++)
+      DP(cur, r, c) = QGRAM_NEG;
+  }
+  DP(cur, 0, 0) = 0;
+  for(a=0;a<len;a++){
+    for(c=0;c<=len;c++)
+      for(r=0;r<k;r++)
+        DP(nxt, r, c) = QGRAM_NEG;
+    for(c=0;c<=len;c++){
+      //an insertion ends the run without using an adapter base
+      for(r=1;r<k;r++)
+        if(DP(cur, r, c) > QGRAM_NEG && DP(cur, r, c) - g > DP(cur, 0, c))
+          DP(cur, 0, c) = DP(cur, r, c) - g;
+      for(r=0;r<k;r++){
+        s = DP(cur, r, c);
+        if(s == QGRAM_NEG)
+          continue;
+        //one more match, a k-mer once the run reaches k
+        if(r == k - 1){
+          if(c < len && s + m > DP(nxt, r, c + 1))
+            DP(nxt, r, c + 1) = s + m;
+        }else if(s + m > DP(nxt, r + 1, c)){
+          DP(nxt, r + 1, c) = s + m;
+        }
+        //a mismatch or deletion ends the run
+        if(r > 0 && s - x > DP(nxt, 0, c))
+          DP(nxt, 0, c) = s - x;
+      }
+    }
+    tmp = cur; cur = nxt; nxt = tmp;
+    //local alignments end on a match
+    for(c=0;c<=len;c++)
+      for(r=1;r<k;r++)
+        best[c] = max(best[c], DP(cur, r, c));
+  }
+#undef DP
+  for(c=0;c<=len;c++){
+    if(best[c] >= thresh){
+      min_hits = c;
+      break;
+    }
+  }
+  free(cur);
+  free(nxt);
+  free(best);
+  return min_hits;
+}
+
+void qgram_init(QgramFilter *f, const char *adapter, int len, const AlnParam *ap, int thresh){
+  const char *bases = "ACGT";
+  int i, j, k, m = INT_MIN, x = INT_MAX, g, code, hits, best_k = 0, best_hits = 0;
+  double ratio, best_ratio = -1;
+  memset(f, 0, sizeof(QgramFilter));
+  f->len = len;
+  //a threshold every alignment reaches, or a protein matrix: no filtering
+  if(thresh <= 0 || ap->row >= 20 || len < 2)
+    return;
+  for(i=0;i<len;i++)
+    if(qgram_base(adapter[i]) < 0)
+      return;
+  for(i=0;i<4;i++){
+    for(j=0;j<4;j++){
+      if(i == j)
+        m = max(m, qgram_score(ap, bases[i], bases[j]));
+      else
+        x = min(x, -qgram_score(ap, bases[i], bases[j]));
+    }
+  }
+  g = ap->gap_open + ap->gap_ext;
+  if(m <= 0 || x <= 0 || g <= 0)
+    return;
+  //I+D gap columns cost at least gap_open + gap_ext*(I+D) out of at most m*len
+  if(ap->gap_ext <= 0 || ap->gap_open < 0)
+    f->band = INT_MAX;
+  else
+    f->band = max(0, (m * len - thresh - ap->gap_open) / ap->gap_ext);
+
+  /**
+   * Use the k with the highest required count relative to the
+   * hits a random read would have in one band
+   */
+  for(k=2;k<=QGRAM_MAX_K && k<=len;k++){
+    hits = qgram_min_hits(len, k, m, min(x, g), g, thresh);
+    if(hits == INT_MAX){
+      //nothing can reach the threshold
+      best_k = k;
+      best_hits = hits;
+      break;
+    }
+    if(hits < 1)
+      continue;
+    ratio = hits * (double)(1 << (2 * k)) /
+        ((double)(len - k + 1) * ((f->band == INT_MAX ? len : f->band) + 1.0));
+    if(ratio > best_ratio){
+      best_ratio = ratio;
+      best_k = k;
+      best_hits = hits;
+    }
+  }
+  if(best_k == 0)
+    return;
+  f->k = best_k;
+  f->min_hits = best_hits;
+  f->first = (int*)malloc(sizeof(int) << (2 * f->k));
+  f->next = (int*)malloc(sizeof(int) * len);
+  for(i=0;i<(1 << (2 * f->k));i++)
+    f->first[i] = -1;
+  for(i=len-f->k;i>=0;i--){
+    for(code=j=0;j<f->k;j++)
+      code = (code << 2) | qgram_base(adapter[i + j]);
+    f->next[i] = f->first[code];
+    f->first[code] = i;
+  }
+}
+
+void qgram_free(QgramFilter *f){
+  free(f->first);
+  free(f->next);
+  f->first = f->next = NULL;
+}
+
+void qgram_work_free(QgramWork *w){
+  free(w->diag);
+  w->diag = NULL;
+  w->cap = 0;
+}
+
+bool qgram_may_align(const QgramFilter *f, QgramWork *w, const char *seq, size_t len){
+  size_t i, n_diag, band;
+  int b, j, code = 0, mask, hits = 0, sum;
+  if(f->k == 0)
+    return true;
+  if(f->min_hits == INT_MAX || len < (size_t)f->k)
+    return false;
+  //diagonal of a k-mer at read position i and adapter position j is i - j + len - 1
+  n_diag = len + f->len - 1;
+  if(w->cap < n_diag){
+    w->cap = max(n_diag, w->cap << 1);
+    w->diag = (int*)realloc(w->diag, sizeof(int) * w->cap);
+  }
+  memset(w->diag, 0, sizeof(int) * n_diag);
+  mask = (1 << (2 * f->k)) - 1;
+  for(i=0;i<len;i++){
+    b = qgram_base(seq[i]);
+    if(b < 0)
+      return true; //N and friends score too little to be bounded
+    code = ((code << 2) | b) & mask;
+    if(i + 1 < (size_t)f->k)
+      continue;
+    for(j=f->first[code];j>=0;j=f->next[j]){
+      w->diag[i + 1 - f->k + f->len - 1 - j]++;
+      hits++;
+    }
+  }
+  if(hits < f->min_hits)
+    return false;
+  //look for enough hits within band + 1 neighbouring diagonals
+  band = f->band == INT_MAX ? n_diag : (size_t)f->band + 1;
+  for(i=sum=0;i<n_diag;i++){
+    sum += w->diag[i];
+    if(i >= band)
+      sum -= w->diag[i - band];
+    if(sum >= f->min_hits)
+      return true;
+  }
+  return false;
+}
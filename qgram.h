@@ -0,0 +1,42 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include "stdaln.h"
+
+/**
+ * q-gram prefilter for the local alignment of a read against an adapter.
+ *
+ * By the q-gram lemma a local alignment that reaches the score threshold
+ * has to contain some number of exact k-mer matches with the adapter.
+ * That number, and how far apart (in diagonals) the matches of one
+ * gapped alignment can be, follow from the adapter length, the score
+ * matrix and the gap penalties. A read with too few shared k-mers in
+ * every band of that width cannot score the threshold, so the alignment
+ * can be skipped without changing the result.
+ */
+
+//longest k-mer tried, the lookup table has 4^k entries
+#define QGRAM_MAX_K (8)
+
+typedef struct {
+  int k;          //k-mer length, 0 when the filter is off
+  int min_hits;   //shared k-mers an alignment at the threshold must have
+  int band;       //diagonals a gapped alignment can drift across
+  int len;        //adapter length
+  int *first;     //first adapter position of each k-mer, -1 for none
+  int *next;      //next adapter position with the same k-mer
+} QgramFilter;
+
+/* per thread scratch space for the diagonal counts */
+typedef struct {
+  int *diag;
+  size_t cap;
+} QgramWork;
+
+/* set up a filter for local alignments of reads against adapter using ap
+   that score at least thresh, the filter is off if that cannot be bounded */
+void qgram_init(QgramFilter *f, const char *adapter, int len, const AlnParam *ap, int thresh);
+void qgram_free(QgramFilter *f);
+/* false only if no local alignment of seq against the adapter can reach the threshold */
+bool qgram_may_align(const QgramFilter *f, QgramWork *w, const char *seq, size_t len);
+void qgram_work_free(QgramWork *w);
@@ -0,0 +1,121 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "report.h"
+
+void hist_init(Hist *h, int min, int max){
+  h->min = min;
+  h->max = max;
+  h->count = (unsigned long long*)calloc(max - min + 1, sizeof(unsigned long long));
+}
+
+void hist_add(Hist *h, int v){
+  if(h->count == NULL)
+    return;
+  if(v < h->min)
+    v = h->min;
+  else if(v > h->max)
+    v = h->max;
+  h->count[v - h->min]++;
+}
+
+void hist_merge(Hist *dst, const Hist *src){
+  int i;
+  if(dst->count == NULL || src->count == NULL)
+    return;
+  for(i=0;i<=dst->max-dst->min;i++)
+    dst->count[i] += src->count[i];
+}
+
+void hist_free(Hist *h){
+  free(h->count);
+  h->count = NULL;
+}
+
+void json_init(JsonOut *j, FILE *fp){
+  j->fp = fp;
+  j->depth = 0;
+  j->first = true;
+}
+
+/* comma, newline and indentation before the next member, then its key */
+static void json_key(JsonOut *j, const char *key){
+  if(j->depth == 0)
+    return;
+  fprintf(j->fp, "%s\n%*s", j->first ? "" : ",", 2 * j->depth, "");
+  j->first = false;
+  json_string(j, NULL, key);
+  fputs(": ", j->fp);
+}
+
+void json_begin(JsonOut *j, const char *key){
+  json_key(j, key);
+  fputc('{', j->fp);
+  j->depth++;
+  j->first = true;
+}
+
+void json_end(JsonOut *j){
+  j->depth--;
+  if(!j->first)
+    fprintf(j->fp, "\n%*s", 2 * j->depth, "");
+  fputc('}', j->fp);
+  if(j->depth == 0)
+    fputc('\n', j->fp);
+  j->first = false;
+}
+
+void json_int(JsonOut *j, const char *key, long long v){
+  json_key(j, key);
+  fprintf(j->fp, "%lld", v);
+}
+
+void json_double(JsonOut *j, const char *key, double v){
+  json_key(j, key);
+  fprintf(j->fp, "%.6g", v);
+}
+
+void json_string(JsonOut *j, const char *key, const char *v){
+  const unsigned char *p;
+  if(key)
+    json_key(j, key);
+  fputc('"', j->fp);
+  for(p=(const unsigned char*)v;*p;p++){
+    if(*p == '"' || *p == '\\')
+      fprintf(j->fp, "\\%c", *p);
+    else if(*p < 0x20)
+      fprintf(j->fp, "\\u%04x", *p);
+    else
+      fputc(*p, j->fp);
+  }
+  fputc('"', j->fp);
+}
+
+void json_hist(JsonOut *j, const char *key, const Hist *h){
+  int i;
+  bool first = true;
+  json_key(j, key);
+  fputc('[', j->fp);
+  for(i=0;h->count && i<=h->max-h->min;i++){
+    if(h->count[i] == 0)
+      continue;
+    fprintf(j->fp, "%s[%d, %llu]", first ? "" : ", ", h->min + i, h->count[i]);
+    first = false;
+  }
+  fputc(']', j->fp);
+}
+
+double report_wall_seconds(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long report_peak_rss_kb(void){
+  struct rusage ru;
+  if(getrusage(RUSAGE_SELF, &ru) != 0)
+    return -1;
+  return ru.ru_maxrss; //kilobytes on Linux
+}
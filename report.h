@@ -0,0 +1,44 @@
+#pragma once
+#include <stdio.h>
+#include <stdbool.h>
+
+/**
+ * Pieces of the JSON run report (-l).
+ *
+ * Every worker fills histograms of its own, one increment per value,
+ * and they are added up once the run is over. Values outside the range
+ * of a histogram are counted in its first or last bin.
+ */
+
+typedef struct {
+  int min, max;               //values with a bin of their own
+  unsigned long long *count;  //NULL when there is no report, adding is then a no-op
+} Hist;
+
+void hist_init(Hist *h, int min, int max);
+void hist_add(Hist *h, int v);
+/* add the counts of src to dst, they have to share a range */
+void hist_merge(Hist *dst, const Hist *src);
+void hist_free(Hist *h);
+
+/* Just enough of a JSON writer for the report, it keeps track of the commas */
+typedef struct {
+  FILE *fp;
+  int depth;
+  bool first;  //nothing written into the current object yet
+} JsonOut;
+
+void json_init(JsonOut *j, FILE *fp);
+/* key is ignored for the outermost object */
+void json_begin(JsonOut *j, const char *key);
+void json_end(JsonOut *j);
+void json_int(JsonOut *j, const char *key, long long v);
+void json_double(JsonOut *j, const char *key, double v);
+void json_string(JsonOut *j, const char *key, const char *v);
+/* the non-empty bins of h as [[value, count], ...] */
+void json_hist(JsonOut *j, const char *key, const Hist *h);
+
+/* seconds on a clock that only goes forward, for wall time */
+double report_wall_seconds(void);
+/* largest resident set size of the process so far in kilobytes */
+long report_peak_rss_kb(void);
@@ -235,7 +235,7 @@ AlnParam aln_param_aa2aa   = { 10,  2,  2, aln_sm_blosum62, 22, 50 };
 AlnAln *aln_init_AlnAln()
 {
 	AlnAln *aa;
-	aa = (AlnAln*)malloc(sizeof(AlnAln));
+	aa = (AlnAln*)calloc(1, sizeof(AlnAln));
 	aa->path = 0;
 	aa->out1 = aa->out2 = aa->outm = 0;
 	aa->path_len = 0;
@@ -331,6 +331,57 @@ typedef struct
 	int M, I, D;
 } dpscore_t;
 
+struct aln_workspace
+{
+	unsigned char *seq1, *seq2;
+	int m_seq1, m_seq2;
+	/* aln_global_core() */
+	dpcell_t *cells, **dpcell;
+	dpscore_t *score; /* the current and last rows */
+	size_t m_cells;
+	int m_dpcell, m_score;
+	/* aln_global_core() in 16 bit lanes: the score profile of seq1, six rows and the traceback */
+	int16_t *g16;
+	uint8_t *bt, **btrow;
+	size_t m_g16, m_bt;
+	int m_btrow;
+	/* aln_local_core() */
+	int *suba, *eh, *s_mem, **s_array;
+	size_t m_s_mem;
+	int m_suba, m_eh, m_s_array;
+};
+
+static int aln_path_n_cigar(const path_t *path, int path_len);
+static void aln_path_fill_cigar32(const path_t *path, int path_len, uint32_t *cigar);
+static void aln_fill_aln(AlnAln *aa, const char *seq1, const char *seq2,
+						 const unsigned char *seq11, const unsigned char *seq22, const AlnParam *ap, int thres);
+
+/* make room for n elements in ptr, which holds m of them; the contents are not kept */
+#define aln_grow(type, ptr, m, n)								\
+{																	\
+	if ((m) < (n)) {												\
+		(m) = ((n) > (m) * 2)? (n) : (m) * 2;						\
+		free(ptr);													\
+		(ptr) = (type*)malloc(sizeof(type) * (m));					\
+	}																\
+}
+
+AlnWorkspace *aln_init_workspace()
+{
+	return (AlnWorkspace*)calloc(1, sizeof(AlnWorkspace));
+}
+void aln_free_workspace(AlnWorkspace *ws)
+{
+	if (ws == 0) return;
+	free(ws->seq1); free(ws->seq2);
+	free(ws->cells); free(ws->dpcell);
+	free(ws->score);
+	free(ws->g16); free(ws->bt); free(ws->btrow);
+	free(ws->suba); free(ws->eh);
+	free(ws->s_mem); free(ws->s_array);
+	free(ws);
+}
+
 /* build score profile for accelerating alignment, in theory */
 void aln_init_score_array(unsigned char *seq, int len, int row, int *score_matrix, int **s_array)
 {
@@ -342,11 +393,324 @@ void aln_init_score_array(unsigned char *seq, int len, int row, int *score_matri
 			tmp2[k] = tmp[seq[k]];
 	}
 }
+/*****************************************
+ * banded global alignment in SIMD lanes *
+ *****************************************/
+/* The same DP as aln_global_core(), row by row. M and I only depend on
+ * the row above and are filled in a vector at a time; D runs along the
+ * row and is a prefix maximum of the gap openings, done in log steps.
+ * Scores are kept in saturating 16-bit lanes with INT16_MIN standing in
+ * for MINOR_INF. Alignments whose scores could come near that are left
+ * to the scalar code, so every cell that can be on the traced path gets
+ * the same score and the same choice as in aln_global_core(). */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ALN_GLOBAL_SIMD
+#include <immintrin.h>
+
+#define ALN_G16_NEG INT16_MIN
+/* traceback of a cell in one byte */
+#define aln_bt_M(x) ((x) & 3)
+#define aln_bt_I(x) ((x) >> 2 & 3)
+#define aln_bt_D(x) ((x) >> 4 & 3)
+
+/* cells a..z of a row: M, I and D along with their traceback */
+typedef void (*aln_grow_f)(const int16_t *sc, const int16_t *lM, const int16_t *lI, const int16_t *lD,
+						   int16_t *cM, int16_t *cI, int16_t *cD, uint8_t *bt, int a, int z,
+						   int gap_open, int gap_ext, int gap_d);
+
+/* shift v up by s lanes, taking the bottom ones from the top of fill */
+#define aln_shl_avx2(v, fill, s) \
+	_mm256_alignr_epi8((v), _mm256_permute2x128_si256((fill), (v), 0x21), 16 - 2 * (s))
+
+__attribute__((target("avx2")))
+static void aln_grow_avx2(const int16_t *sc, const int16_t *lM, const int16_t *lI, const int16_t *lD,
+						  int16_t *cM, int16_t *cI, int16_t *cD, uint8_t *bt, int a, int z,
+						  int gap_open, int gap_ext, int gap_d)
+{
+	const __m256i go = _mm256_set1_epi16(gap_open), ge = _mm256_set1_epi16(gap_ext);
+	const __m256i gd = _mm256_set1_epi16(gap_d), neg = _mm256_set1_epi16(ALN_G16_NEG);
+	const __m256i one = _mm256_set1_epi16(1), two = _mm256_set1_epi16(2), zero = _mm256_setzero_si256();
+	const __m256i gd2 = _mm256_set1_epi16(2 * gap_d), gd4 = _mm256_set1_epi16(4 * gap_d);
+	const __m256i gd8 = _mm256_set1_epi16(8 * gap_d);
+	const __m256i ramp = _mm256_mullo_epi16(gd, _mm256_setr_epi16(1, 2, 3, 4, 5, 6, 7, 8,
+																	9, 10, 11, 12, 13, 14, 15, 16));
+	__m256i pM, pI, pD, uM, uI, i_gt_m, d_gt_m, mt, it, x, d, prev, dt;
+	__m128i b;
+	int i, carry;
+
+	for (i = a; i <= z; i += 16) {
+		pM = _mm256_loadu_si256((const __m256i*)(lM + i - 1));
+		pI = _mm256_loadu_si256((const __m256i*)(lI + i - 1));
+		pD = _mm256_loadu_si256((const __m256i*)(lD + i - 1));
+		uM = _mm256_loadu_si256((const __m256i*)(lM + i));
+		uI = _mm256_loadu_si256((const __m256i*)(lI + i));
+		/* set_M(): FROM_M if M >= I and M >= D, FROM_I if I > M and I > D, FROM_D otherwise */
+		i_gt_m = _mm256_cmpgt_epi16(pI, pM);
+		d_gt_m = _mm256_cmpgt_epi16(pD, pM);
+		mt = _mm256_blendv_epi8(two, zero, _mm256_cmpeq_epi16(_mm256_or_si256(i_gt_m, d_gt_m), zero));
+		mt = _mm256_blendv_epi8(mt, one, _mm256_and_si256(i_gt_m, _mm256_cmpgt_epi16(pI, pD)));
+		_mm256_storeu_si256((__m256i*)(cM + i), _mm256_adds_epi16(_mm256_max_epi16(_mm256_max_epi16(pM, pI), pD),
+																 _mm256_loadu_si256((const __m256i*)(sc + i))));
+		/* set_I() */
+		x = _mm256_subs_epi16(uM, go);
+		it = _mm256_andnot_si256(_mm256_cmpgt_epi16(x, uI), one);
+		_mm256_storeu_si256((__m256i*)(cI + i), _mm256_subs_epi16(_mm256_max_epi16(x, uI), ge));
+		mt = _mm256_or_si256(mt, _mm256_slli_epi16(it, 2));
+		mt = _mm256_permute4x64_epi64(_mm256_packus_epi16(mt, mt), 0xd8);
+		_mm_storeu_si128((__m128i*)(bt + i), _mm256_castsi256_si128(mt));
+	}
+	/* set_D(): D[i] = max(M[i-1] - go - gd, D[i-1] - gd) */
+	carry = cD[a - 1];
+	for (i = a; i <= z; i += 16) {
+		pM = _mm256_subs_epi16(_mm256_loadu_si256((const __m256i*)(cM + i - 1)), go);
+		x = _mm256_subs_epi16(pM, gd);
+		x = _mm256_max_epi16(x, _mm256_subs_epi16(aln_shl_avx2(x, neg, 1), gd));
+		x = _mm256_max_epi16(x, _mm256_subs_epi16(aln_shl_avx2(x, neg, 2), gd2));
+		x = _mm256_max_epi16(x, _mm256_subs_epi16(aln_shl_avx2(x, neg, 4), gd4));
+		x = _mm256_max_epi16(x, _mm256_subs_epi16(aln_shl_avx2(x, neg, 8), gd8));
+		d = _mm256_max_epi16(x, _mm256_subs_epi16(_mm256_set1_epi16(carry), ramp));
+		prev = aln_shl_avx2(d, _mm256_set1_epi16(carry), 1);
+		dt = _mm256_slli_epi16(_mm256_andnot_si256(_mm256_cmpgt_epi16(pM, prev), two), 4);
+		dt = _mm256_permute4x64_epi64(_mm256_packus_epi16(dt, dt), 0xd8);
+		b = _mm_loadu_si128((const __m128i*)(bt + i));
+		_mm_storeu_si128((__m128i*)(bt + i), _mm_or_si128(b, _mm256_castsi256_si128(dt)));
+		_mm256_storeu_si256((__m256i*)(cD + i), d);
+		carry = (int16_t)_mm256_extract_epi16(d, 15);
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void aln_grow_sse41(const int16_t *sc, const int16_t *lM, const int16_t *lI, const int16_t *lD,
+						   int16_t *cM, int16_t *cI, int16_t *cD, uint8_t *bt, int a, int z,
+						   int gap_open, int gap_ext, int gap_d)
+{
+	const __m128i go = _mm_set1_epi16(gap_open), ge = _mm_set1_epi16(gap_ext);
+	const __m128i gd = _mm_set1_epi16(gap_d), neg = _mm_set1_epi16(ALN_G16_NEG);
+	const __m128i one = _mm_set1_epi16(1), two = _mm_set1_epi16(2), zero = _mm_setzero_si128();
+	const __m128i gd2 = _mm_set1_epi16(2 * gap_d), gd4 = _mm_set1_epi16(4 * gap_d);
+	const __m128i ramp = _mm_mullo_epi16(gd, _mm_setr_epi16(1, 2, 3, 4, 5, 6, 7, 8));
+	__m128i pM, pI, pD, uM, uI, i_gt_m, d_gt_m, mt, it, x, d, prev, dt, c;
+	int i, carry;
+
+	for (i = a; i <= z; i += 8) {
+		pM = _mm_loadu_si128((const __m128i*)(lM + i - 1));
+		pI = _mm_loadu_si128((const __m128i*)(lI + i - 1));
+		pD = _mm_loadu_si128((const __m128i*)(lD + i - 1));
+		uM = _mm_loadu_si128((const __m128i*)(lM + i));
+		uI = _mm_loadu_si128((const __m128i*)(lI + i));
+		i_gt_m = _mm_cmpgt_epi16(pI, pM);
+		d_gt_m = _mm_cmpgt_epi16(pD, pM);
+		mt = _mm_blendv_epi8(two, zero, _mm_cmpeq_epi16(_mm_or_si128(i_gt_m, d_gt_m), zero));
+		mt = _mm_blendv_epi8(mt, one, _mm_and_si128(i_gt_m, _mm_cmpgt_epi16(pI, pD)));
+		_mm_storeu_si128((__m128i*)(cM + i), _mm_adds_epi16(_mm_max_epi16(_mm_max_epi16(pM, pI), pD),
+															_mm_loadu_si128((const __m128i*)(sc + i))));
+		x = _mm_subs_epi16(uM, go);
+		it = _mm_andnot_si128(_mm_cmpgt_epi16(x, uI), one);
+		_mm_storeu_si128((__m128i*)(cI + i), _mm_subs_epi16(_mm_max_epi16(x, uI), ge));
+		mt = _mm_or_si128(mt, _mm_slli_epi16(it, 2));
+		_mm_storel_epi64((__m128i*)(bt + i), _mm_packus_epi16(mt, mt));
+	}
+	carry = cD[a - 1];
+	for (i = a; i <= z; i += 8) {
+		pM = _mm_subs_epi16(_mm_loadu_si128((const __m128i*)(cM + i - 1)), go);
+		x = _mm_subs_epi16(pM, gd);
+		x = _mm_max_epi16(x, _mm_subs_epi16(_mm_alignr_epi8(x, neg, 14), gd));
+		x = _mm_max_epi16(x, _mm_subs_epi16(_mm_alignr_epi8(x, neg, 12), gd2));
+		x = _mm_max_epi16(x, _mm_subs_epi16(_mm_alignr_epi8(x, neg, 8), gd4));
+		c = _mm_set1_epi16(carry);
+		d = _mm_max_epi16(x, _mm_subs_epi16(c, ramp));
+		prev = _mm_alignr_epi8(d, c, 14);
+		dt = _mm_slli_epi16(_mm_andnot_si128(_mm_cmpgt_epi16(pM, prev), two), 4);
+		_mm_storel_epi64((__m128i*)(bt + i), _mm_or_si128(_mm_loadl_epi64((const __m128i*)(bt + i)),
+														  _mm_packus_epi16(dt, dt)));
+		_mm_storeu_si128((__m128i*)(cD + i), d);
+		carry = (int16_t)_mm_extract_epi16(d, 7);
+	}
+}
+
+/* one row of the banded DP, mirroring a row of aln_global_core() */
+typedef struct
+{
+	aln_grow_f grow;
+	const int16_t *prof;
+	int16_t *cM, *cI, *cD, *lM, *lI, *lD;
+	uint8_t **bt;
+	int stride, gap_open, gap_ext, gap_end;
+} aln_g16_t;
+
+/* set_I()/set_end_I() of one cell from the cell above, for the band edges */
+static inline void aln_g16_I(aln_g16_t *g, int i, uint8_t *bt, int gap)
+{
+	int x = g->lM[i] - g->gap_open;
+	int v = (x > g->lI[i])? x - gap : g->lI[i] - gap;
+	g->cI[i] = v < ALN_G16_NEG? ALN_G16_NEG : v;
+	*bt = (*bt & ~(3 << 2)) | ((x > g->lI[i])? FROM_M : FROM_I) << 2;
+}
+
+/* row j: column left is the band edge (or the first column when
+ * first_col is set), cells left+1..z are filled; the I of cell z comes
+ * from set_end_I() when end_I is set and is -inf otherwise */
+static void aln_g16_row(aln_g16_t *g, const unsigned char *seq2, int j, int left, int first_col,
+						int z, int end_I, int end_D)
+{
+	int16_t *t;
+	uint8_t *bt = g->bt[j];
+	g->cM[left] = g->cI[left] = g->cD[left] = ALN_G16_NEG;
+	if (first_col) aln_g16_I(g, left, bt + left, g->gap_end);
+	g->grow(g->prof + seq2[j] * g->stride, g->lM, g->lI, g->lD, g->cM, g->cI, g->cD, bt,
+			left + 1, z, g->gap_open, g->gap_ext, end_D? g->gap_end : g->gap_ext);
+	if (end_I) aln_g16_I(g, z, bt + z, g->gap_end);
+	else g->cI[z] = ALN_G16_NEG;
+	t = g->cM; g->cM = g->lM; g->lM = t;
+	t = g->cI; g->cI = g->lI; g->lI = t;
+	t = g->cD; g->cD = g->lD; g->lD = t;
+}
+
+/* can every path score be told apart from the -inf stand in */
+static int aln_g16_fits(int len1, int len2, const AlnParam *ap)
+{
+	int i, max_sc = 0, step, gap;
+	if (ap->gap_open < 0 || ap->gap_ext < 0 || ap->band_width < 1) return 0;
+	gap = (ap->gap_end > ap->gap_ext)? ap->gap_end : ap->gap_ext;
+	step = ap->gap_open + gap;
+	for (i = 0; i != ap->row * ap->row; ++i) {
+		if (ap->matrix[i] > max_sc) max_sc = ap->matrix[i];
+		if (-ap->matrix[i] > step) step = -ap->matrix[i];
+	}
+	return (double)(len1 + len2 + 2) * (step + max_sc) < 30000.0;
+}
+
+static int aln_global_core_g16(AlnWorkspace *ws, aln_grow_f grow, int lanes, unsigned char *seq1, int len1,
+							   unsigned char *seq2, int len2, const AlnParam *ap, path_t *path, int *path_len)
+{
+	int i, j, c, b1, b2, tmp_end, end, max, b;
+	int stride, N_MATRIX_ROW = ap->row;
+	uint8_t *q;
+	int16_t *sc;
+	path_t *p;
+	unsigned char type, ctype;
+	aln_g16_t g;
+
+	b = ap->band_width;
+	if (len1 > len2) {
+		b1 = len1 - len2 + b;
+		b2 = b;
+	} else {
+		b1 = b;
+		b2 = len2 - len1 + b;
+	}
+	if (b1 > len1) b1 = len1;
+	if (b2 > len2) b2 = len2;
+	--seq1; --seq2;
+
+	/* allocate memory, every row is padded for the lanes running past its end;
+	 * without a path all rows share one row of traceback */
+	stride = len1 + 1 + lanes;
+	end = (b1 + b2 <= len1)? (b1 + b2 + 1) : (len1 + 1);
+	aln_grow(int16_t, ws->g16, ws->m_g16, (size_t)stride * (N_MATRIX_ROW + 6));
+	aln_grow(uint8_t, ws->bt, ws->m_bt, (size_t)end * (path? len2 + 1 : 1) + stride);
+	aln_grow(uint8_t*, ws->btrow, ws->m_btrow, len2 + 1);
+	for (j = 0; j <= len2; ++j)
+		ws->btrow[j] = ws->bt + (path? (size_t)j * end : 0) - (j > b2? j - b2 : 0);
+	for (c = 0; c != N_MATRIX_ROW; ++c) {
+		sc = ws->g16 + c * stride;
+		for (i = 1; i <= len1; ++i)
+			sc[i] = ap->matrix[c * N_MATRIX_ROW + seq1[i]];
+		for (; i != stride; ++i) sc[i] = 0;
+	}
+	g.grow = grow;
+	g.prof = ws->g16;
+	g.stride = stride;
+	g.cM = ws->g16 + N_MATRIX_ROW * stride;
+	g.cI = g.cM + stride; g.cD = g.cI + stride;
+	g.lM = g.cD + stride; g.lI = g.lM + stride; g.lD = g.lI + stride;
+	g.bt = ws->btrow;
+	g.gap_open = ap->gap_open;
+	g.gap_ext = ap->gap_ext;
+	g.gap_end = ap->gap_end >= 0? ap->gap_end : ap->gap_ext;
+	for (i = 0; i != stride; ++i) /* keep the padding lanes defined */
+		g.cM[i] = g.cI[i] = g.cD[i] = g.lM[i] = g.lI[i] = g.lD[i] = ALN_G16_NEG;
+
+	/* set first row */
+	q = g.bt[0];
+	g.cM[0] = 0;
+	for (i = 1; i < b1; ++i) {
+		int x = g.cM[i - 1] - g.gap_open, v;
+		v = (x > g.cD[i - 1])? x - g.gap_end : g.cD[i - 1] - g.gap_end;
+		g.cD[i] = v < ALN_G16_NEG? ALN_G16_NEG : v;
+		q[i] = ((x > g.cD[i - 1])? FROM_M : FROM_D) << 4;
+	}
+	sc = g.cM; g.cM = g.lM; g.lM = sc;
+	sc = g.cI; g.cI = g.lI; g.lI = sc;
+	sc = g.cD; g.cD = g.lD; g.lD = sc;
+
+	/* the same parts as aln_global_core() */
+	tmp_end = (b2 < len2)? b2 : len2 - 1;
+	for (j = 1; j <= tmp_end; ++j) {
+		end = (j + b1 <= len1 + 1)? (j + b1 - 1) : len1;
+		aln_g16_row(&g, seq2, j, 0, 1, end, j + b1 - 1 > len1, 0);
+	}
+	if (j == len2 && b2 != len2 - 1) {
+		end = (j + b1 <= len1 + 1)? (j + b1 - 1) : len1;
+		aln_g16_row(&g, seq2, j, 0, 1, end, j + b1 - 1 > len1, 1);
+		++j;
+	}
+	for (; j <= len2 - b2 + 1; ++j)
+		aln_g16_row(&g, seq2, j, j - b2, 0, j + b1 - 1, 0, 0);
+	for (; j < len2; ++j)
+		aln_g16_row(&g, seq2, j, j - b2, 0, len1, 1, 0);
+	if (j == len2)
+		aln_g16_row(&g, seq2, j, j - b2, 0, len1, 1, 1);
+
+	/* backtrace */
+	i = len1; j = len2;
+	q = g.bt[j] + i;
+	max = g.lM[len1]; type = aln_bt_M(*q); ctype = FROM_M;
+	if (g.lI[len1] > max) { max = g.lI[len1]; type = aln_bt_I(*q); ctype = FROM_I; }
+	if (g.lD[len1] > max) { max = g.lD[len1]; type = aln_bt_D(*q); ctype = FROM_D; }
+	if (path == 0) { /* score only */
+		if (path_len) *path_len = 0;
+		return max;
+	}
+
+	p = path;
+	p->ctype = ctype; p->i = i; p->j = j;
+	++p;
+	do {
+		switch (ctype) {
+			case FROM_M: --i; --j; break;
+			case FROM_I: --j; break;
+			case FROM_D: --i; break;
+		}
+		q = g.bt[j] + i;
+		ctype = type;
+		switch (type) {
+			case FROM_M: type = aln_bt_M(*q); break;
+			case FROM_I: type = aln_bt_I(*q); break;
+			case FROM_D: type = aln_bt_D(*q); break;
+		}
+		p->ctype = ctype; p->i = i; p->j = j;
+		++p;
+	} while (i || j);
+	*path_len = p - path - 1;
+
+	return max;
+}
+#endif
 /***************************
  * banded global alignment *
  ***************************/
 int aln_global_core(unsigned char *seq1, int len1, unsigned char *seq2, int len2, const AlnParam *ap,
 					path_t *path, int *path_len)
+{
+	AlnWorkspace *ws = aln_init_workspace();
+	int score = aln_global_core_ws(ws, seq1, len1, seq2, len2, ap, path, path_len);
+	aln_free_workspace(ws);
+	return score;
+}
+int aln_global_core_ws(AlnWorkspace *ws, unsigned char *seq1, int len1, unsigned char *seq2, int len2,
+					   const AlnParam *ap, path_t *path, int *path_len)
 {
 	register int i, j;
 	dpcell_t **dpcell, *q;
@@ -368,9 +732,17 @@ int aln_global_core(unsigned char *seq1, int len1, unsigned char *seq2, int len2
 	N_MATRIX_ROW = ap->row;
 
 	if (len1 == 0 || len2 == 0) {
-		*path_len = 0;
+		if (path_len) *path_len = 0;
 		return 0;
 	}
+#ifdef ALN_GLOBAL_SIMD
+	if (aln_g16_fits(len1, len2, ap)) {
+		if (__builtin_cpu_supports("avx2"))
+			return aln_global_core_g16(ws, aln_grow_avx2, 16, seq1, len1, seq2, len2, ap, path, path_len);
+		if (__builtin_cpu_supports("sse4.1"))
+			return aln_global_core_g16(ws, aln_grow_sse41, 8, seq1, len1, seq2, len2, ap, path, path_len);
+	}
+#endif
 	/* calculate b1 and b2 */
 	if (len1 > len2) {
 		b1 = len1 - len2 + b;
@@ -385,13 +757,16 @@ int aln_global_core(unsigned char *seq1, int len1, unsigned char *seq2, int len2
 
 	/* allocate memory */
 	end = (b1 + b2 <= len1)? (b1 + b2 + 1) : (len1 + 1);
-	dpcell = (dpcell_t**)malloc(sizeof(dpcell_t*) * (len2 + 1));
+	aln_grow(dpcell_t, ws->cells, ws->m_cells, (size_t)end * (path? len2 + 1 : 1));
+	aln_grow(dpcell_t*, ws->dpcell, ws->m_dpcell, len2 + 1);
+	aln_grow(dpscore_t, ws->score, ws->m_score, 2 * (len1 + 1));
+	dpcell = ws->dpcell;
 	for (j = 0; j <= len2; ++j)
-		dpcell[j] = (dpcell_t*)malloc(sizeof(dpcell_t) * end);
+		dpcell[j] = ws->cells + (path? (size_t)j * end : 0); /* one shared row for the score only */
 	for (j = b2 + 1; j <= len2; ++j)
 		dpcell[j] -= j - b2;
-	curr = (dpscore_t*)malloc(sizeof(dpscore_t) * (len1 + 1));
-	last = (dpscore_t*)malloc(sizeof(dpscore_t) * (len1 + 1));
+	curr = ws->score;
+	last = ws->score + len1 + 1;
 
 	/* set first row */
 	SET_INF(*curr); curr->M = 0;
@@ -494,6 +869,10 @@ int aln_global_core(unsigned char *seq1, int len1, unsigned char *seq2, int len2
 	max = s->M; type = q->Mt; ctype = FROM_M;
 	if (s->I > max) { max = s->I; type = q->It; ctype = FROM_I; }
 	if (s->D > max) { max = s->D; type = q->Dt; ctype = FROM_D; }
+	if (path == 0) { /* score only */
+		if (path_len) *path_len = 0;
+		return max;
+	}
 
 	p = path;
 	p->ctype = ctype; p->i = i; p->j = j; /* bug fixed 040408 */
@@ -516,14 +895,6 @@ int aln_global_core(unsigned char *seq1, int len1, unsigned char *seq2, int len2
 	} while (i || j);
 	*path_len = p - path - 1;
 
-	/* free memory */
-	for (j = b2 + 1; j <= len2; ++j)
-		dpcell[j] += j - b2;
-	for (j = 0; j <= len2; ++j)
-		free(dpcell[j]);
-	free(dpcell);
-	free(curr); free(last);
-
 	return max;
 }
 /*************************************************
@@ -531,6 +902,14 @@ int aln_global_core(unsigned char *seq1, int len1, unsigned char *seq2, int len2
  *************************************************/
 int aln_local_core(unsigned char *seq1, int len1, unsigned char *seq2, int len2, const AlnParam *ap,
 				   path_t *path, int *path_len, int _thres, int *_subo)
+{
+	AlnWorkspace *ws = aln_init_workspace();
+	int score = aln_local_core_ws(ws, seq1, len1, seq2, len2, ap, path, path_len, _thres, _subo);
+	aln_free_workspace(ws);
+	return score;
+}
+int aln_local_core_ws(AlnWorkspace *ws, unsigned char *seq1, int len1, unsigned char *seq2, int len2,
+					  const AlnParam *ap, path_t *path, int *path_len, int _thres, int *_subo)
 {
 	register NT_LOCAL_SCORE *s;
 	register int i;
@@ -559,11 +938,15 @@ int aln_local_core(unsigned char *seq1, int len1, unsigned char *seq2, int len2,
 	if (len1 == 0 || len2 == 0) return -1;
 
 	/* allocate memory */
-	suba = (int*)malloc(sizeof(int) * (len2 + 1));
-	eh = (NT_LOCAL_SCORE*)malloc(sizeof(NT_LOCAL_SCORE) * (len1 + 1));
-	s_array = (int**)malloc(sizeof(int*) * N_MATRIX_ROW);
+	aln_grow(int, ws->suba, ws->m_suba, len2 + 1);
+	aln_grow(NT_LOCAL_SCORE, ws->eh, ws->m_eh, len1 + 1);
+	aln_grow(int, ws->s_mem, ws->m_s_mem, (size_t)N_MATRIX_ROW * len1);
+	aln_grow(int*, ws->s_array, ws->m_s_array, N_MATRIX_ROW);
+	suba = ws->suba;
+	eh = ws->eh;
+	s_array = ws->s_array;
 	for (i = 0; i != N_MATRIX_ROW; ++i)
-		s_array[i] = (int*)malloc(sizeof(int) * len1);
+		s_array[i] = ws->s_mem + (size_t)i * len1;
 	/* initialization */
 	aln_init_score_array(seq1, len1, N_MATRIX_ROW, score_matrix, s_array);
 	q = gap_open;
@@ -731,8 +1114,8 @@ int aln_local_core(unsigned char *seq1, int len1, unsigned char *seq2, int len2,
 			AlnParam ap_real = *ap;
 			ap_real.gap_end = -1;
 			ap_real.band_width = i;
-			score_g = aln_global_core(seq1 + start_i, end_i - start_i + 1, seq2 + start_j,
-									  end_j - start_j + 1, &ap_real, path, path_len);
+			score_g = aln_global_core_ws(ws, seq1 + start_i, end_i - start_i + 1, seq2 + start_j,
+										 end_j - start_j + 1, &ap_real, path, path_len);
 			if (score_g == score_r || score_f == score_g) break;
 			if (i > j) break;
 		}
@@ -753,64 +1136,142 @@ int aln_local_core(unsigned char *seq1, int len1, unsigned char *seq2, int len2,
 	}
 
 end_func:
-	/* free */
-	free(eh); free(suba);
-	for (i = 0; i != N_MATRIX_ROW; ++i) {
-		++s_array[i];
-		free(s_array[i]);
-	}
-	free(s_array);
 	return score_f;
 }
 AlnAln *aln_stdaln_aux(const char *seq1, const char *seq2, const AlnParam *ap,
 					   int type, int thres, int len1, int len2)
+{
+	AlnWorkspace *ws = aln_init_workspace();
+	AlnAln *aa = aln_init_AlnAln();
+	if (aln_stdaln_ws(ws, aa, seq1, seq2, ap, type, thres, len1, len2) == 0) {
+		aln_free_AlnAln(aa);
+		aa = 0;
+	}
+	aln_free_workspace(ws);
+	return aa;
+}
+/* the residue codes of both sequences into ws->seq1 and ws->seq2 */
+static void aln_encode(AlnWorkspace *ws, const char *seq1, const char *seq2, const AlnParam *ap,
+					   int len1, int len2)
+{
+	unsigned char *seq11, *seq22, *table;
+	int i, j;
+
+	aln_grow(unsigned char, ws->seq1, ws->m_seq1, len1);
+	aln_grow(unsigned char, ws->seq2, ws->m_seq2, len2);
+	seq11 = ws->seq1;
+	seq22 = ws->seq2;
+	if (ap->row < 10) table = aln_nt4_table; /* 4-nucleotide alignment */
+	else if (ap->row < 20) table = aln_nt16_table; /* 16-nucleotide alignment */
+	else table = aln_aa_table; /* amino acids */
+	for (i = 0; i < len1; ++i)
+		seq11[i] = table[(int)seq1[i]];
+	for (j = 0; j < len2; ++j)
+		seq22[j] = table[(int)seq2[j]];
+}
+AlnAln *aln_stdaln_score_ws(AlnWorkspace *ws, AlnAln *aa, const char *seq1, const char *seq2,
+							const AlnParam *ap, int type, int thres, int len1, int len2)
+{
+	if (len1 < 0) len1 = strlen(seq1);
+	if (len2 < 0) len2 = strlen(seq2);
+
+	if (type == ALN_TYPE_GLOBAL) {
+		aln_encode(ws, seq1, seq2, ap, len1, len2);
+		aa->score = aln_global_core_ws(ws, ws->seq1, len1, ws->seq2, len2, ap, 0, 0);
+		aa->subo = 0;
+		aa->start1 = aa->start2 = 1;
+		aa->end1 = len1; aa->end2 = len2;
+	} else if (type == ALN_TYPE_LOCAL) {
+		/* a negative threshold has the local core store the end points instead of the path */
+		aln_grow(path_t, aa->path, aa->m_path, 2);
+		aln_encode(ws, seq1, seq2, ap, len1, len2);
+		aa->subo = aa->path_len = 0;
+		aa->score = aln_local_core_ws(ws, ws->seq1, len1, ws->seq2, len2, ap, aa->path, &aa->path_len,
+									  thres > 0? -thres : thres, &aa->subo);
+		if (aa->path_len > 0) {
+			aa->start1 = aa->path[1].i? aa->path[1].i : 1;
+			aa->end1 = aa->path[0].i;
+			aa->start2 = aa->path[1].j? aa->path[1].j : 1;
+			aa->end2 = aa->path[0].j;
+		} else aa->start1 = aa->end1 = aa->start2 = aa->end2 = 0;
+	} else return aln_stdaln_ws(ws, aa, seq1, seq2, ap, type, thres, len1, len2);
+	aa->path_len = aa->n_cigar = 0;
+	return aa;
+}
+AlnAln *aln_stdaln_ws(AlnWorkspace *ws, AlnAln *aa, const char *seq1, const char *seq2,
+					  const AlnParam *ap, int type, int thres, int len1, int len2)
 {
 	unsigned char *seq11, *seq22;
 	int score;
-	int i, j, l;
-	path_t *p;
-	char *out1, *out2, *outm;
-	AlnAln *aa;
 
 	if (len1 < 0) len1 = strlen(seq1);
 	if (len2 < 0) len2 = strlen(seq2);
 
-	aa = aln_init_AlnAln();
-	seq11 = (unsigned char*)malloc(sizeof(unsigned char) * len1);
-	seq22 = (unsigned char*)malloc(sizeof(unsigned char) * len2);
-	aa->path = (path_t*)malloc(sizeof(path_t) * (len1 + len2 + 1));
-
-	if (ap->row < 10) { /* 4-nucleotide alignment */
-		for (i = 0; i < len1; ++i)
-			seq11[i] = aln_nt4_table[(int)seq1[i]];
-		for (j = 0; j < len2; ++j)
-			seq22[j] = aln_nt4_table[(int)seq2[j]];
-	} else if (ap->row < 20) { /* 16-nucleotide alignment */
-		for (i = 0; i < len1; ++i)
-			seq11[i] = aln_nt16_table[(int)seq1[i]];
-		for (j = 0; j < len2; ++j)
-			seq22[j] = aln_nt16_table[(int)seq2[j]];
-	} else { /* amino acids */
-		for (i = 0; i < len1; ++i)
-			seq11[i] = aln_aa_table[(int)seq1[i]];
-		for (j = 0; j < len2; ++j)
-			seq22[j] = aln_aa_table[(int)seq2[j]];
-	}
-	
-	if (type == ALN_TYPE_GLOBAL) score = aln_global_core(seq11, len1, seq22, len2, ap, aa->path, &aa->path_len);
-	else if (type == ALN_TYPE_LOCAL) score = aln_local_core(seq11, len1, seq22, len2, ap, aa->path, &aa->path_len, thres, &aa->subo);
+	aln_grow(path_t, aa->path, aa->m_path, len1 + len2 + 1);
+	aln_encode(ws, seq1, seq2, ap, len1, len2);
+	seq11 = ws->seq1;
+	seq22 = ws->seq2;
+
+	aa->subo = aa->path_len = 0;
+	if (type == ALN_TYPE_GLOBAL) score = aln_global_core_ws(ws, seq11, len1, seq22, len2, ap, aa->path, &aa->path_len);
+	else if (type == ALN_TYPE_LOCAL) score = aln_local_core_ws(ws, seq11, len1, seq22, len2, ap, aa->path, &aa->path_len, thres, &aa->subo);
 	else if (type == ALN_TYPE_EXTEND)  score = aln_extend_core(seq11, len1, seq22, len2, ap, aa->path, &aa->path_len, 1, 0);
-	else {
-		free(seq11); free(seq22); free(aa->path);
-		aln_free_AlnAln(aa);
-		return 0;
+	else return 0;
+	aa->score = score;
+	aln_fill_aln(aa, seq1, seq2, seq11, seq22, ap, thres);
+	return aa;
+}
+/* the diagonal of two sequences of the same length, when nothing gapped can match it */
+AlnAln *aln_ungapped_ws(AlnWorkspace *ws, AlnAln *aa, const char *seq1, const char *seq2,
+						const AlnParam *ap, int thres, int len)
+{
+	unsigned char *seq11, *seq22;
+	int i, score, m, g;
+
+	if (len <= 0) return 0;
+	/* a gapped alignment has one insertion and one deletion, each at least
+	 * gap_open plus one extension, and at most len - 1 aligned pairs */
+	for (i = m = 0; i < ap->row * ap->row; ++i)
+		if (ap->matrix[i] > m) m = ap->matrix[i];
+	g = ap->gap_open + ((ap->gap_end >= 0 && ap->gap_end < ap->gap_ext)? ap->gap_end : ap->gap_ext);
+	if (g < 0) return 0;
+
+	aln_encode(ws, seq1, seq2, ap, len, len);
+	seq11 = ws->seq1;
+	seq22 = ws->seq2;
+	for (i = score = 0; i < len; ++i)
+		score += ap->matrix[seq22[i] * ap->row + seq11[i]];
+	if (score <= m * (len - 1) - 2 * g) return 0;
+
+	/* the path aln_global_core() traces back for it */
+	aln_grow(path_t, aa->path, aa->m_path, len + len + 1);
+	for (i = 0; i <= len; ++i) {
+		aa->path[i].i = aa->path[i].j = len - i;
+		aa->path[i].ctype = FROM_M;
 	}
+	aa->path_len = len;
 	aa->score = score;
+	aa->subo = 0;
+	aln_fill_aln(aa, seq1, seq2, seq11, seq22, ap, thres);
+	return aa;
+}
+/* out strings, coordinates and cigar of the path in aa */
+static void aln_fill_aln(AlnAln *aa, const char *seq1, const char *seq2,
+						 const unsigned char *seq11, const unsigned char *seq22, const AlnParam *ap, int thres)
+{
+	int l;
+	path_t *p;
+	char *out1, *out2, *outm;
 
 	if (thres > 0) {
-		out1 = aa->out1 = (char*)malloc(sizeof(char) * (aa->path_len + 1));
-		out2 = aa->out2 = (char*)malloc(sizeof(char) * (aa->path_len + 1));
-		outm = aa->outm = (char*)malloc(sizeof(char) * (aa->path_len + 1));
+		if (aa->m_out < aa->path_len + 1) {
+			aa->m_out = (aa->path_len + 1 > aa->m_out * 2)? aa->path_len + 1 : aa->m_out * 2;
+			free(aa->out1); free(aa->out2); free(aa->outm);
+			aa->out1 = (char*)malloc(sizeof(char) * aa->m_out);
+			aa->out2 = (char*)malloc(sizeof(char) * aa->m_out);
+			aa->outm = (char*)malloc(sizeof(char) * aa->m_out);
+		}
+		out1 = aa->out1; out2 = aa->out2; outm = aa->outm;
 
 		--seq1; --seq2;
 		--seq11; --seq22;
@@ -830,17 +1291,16 @@ AlnAln *aln_stdaln_aux(const char *seq1, const char *seq2, const AlnParam *ap,
 		++seq11; ++seq22;
 	}
 
-	free(seq11);
-	free(seq22);
-
-	p = aa->path + aa->path_len - 1;
-	aa->start1 = p->i? p->i : 1;
-	aa->end1 = aa->path->i;
-	aa->start2 = p->j? p->j : 1;
-	aa->end2 = aa->path->j;
-	aa->cigar32 = aln_path2cigar32(aa->path, aa->path_len, &aa->n_cigar);
-
-	return aa;
+	if (aa->path_len > 0) {
+		p = aa->path + aa->path_len - 1;
+		aa->start1 = p->i? p->i : 1;
+		aa->end1 = aa->path->i;
+		aa->start2 = p->j? p->j : 1;
+		aa->end2 = aa->path->j;
+	} else aa->start1 = aa->end1 = aa->start2 = aa->end2 = 0; /* nothing aligned */
+	aa->n_cigar = aln_path_n_cigar(aa->path, aa->path_len);
+	aln_grow(uint32_t, aa->cigar32, aa->m_cigar, aa->n_cigar);
+	aln_path_fill_cigar32(aa->path, aa->path_len, aa->cigar32);
 }
 AlnAln *aln_stdaln(const char *seq1, const char *seq2, const AlnParam *ap, int type, int thres)
 {
@@ -1010,25 +1470,25 @@ end_left_func:
 	return score;
 }
 
-uint32_t *aln_path2cigar32(const path_t *path, int path_len, int *n_cigar)
+static int aln_path_n_cigar(const path_t *path, int path_len)
 {
 	int i, n;
-	uint32_t *cigar;
 	unsigned char last_type;
 
-	if (path_len == 0 || path == 0) {
-		*n_cigar = 0;
-		return 0;
-	}
-
+	if (path_len == 0 || path == 0) return 0;
 	last_type = path->ctype;
 	for (i = n = 1; i < path_len; ++i) {
 		if (last_type != path[i].ctype) ++n;
 		last_type = path[i].ctype;
 	}
-	*n_cigar = n;
-	cigar = (uint32_t*)malloc(*n_cigar * 4);
+	return n;
+}
+static void aln_path_fill_cigar32(const path_t *path, int path_len, uint32_t *cigar)
+{
+	int i, n;
+	unsigned char last_type;
 
+	if (path_len == 0 || path == 0) return;
 	cigar[0] = 1u << 4 | path[path_len-1].ctype;
 	last_type = path[path_len-1].ctype;
 	for (i = path_len - 2, n = 0; i >= 0; --i) {
@@ -1038,7 +1498,15 @@ uint32_t *aln_path2cigar32(const path_t *path, int path_len, int *n_cigar)
 			last_type = path[i].ctype;
 		}
 	}
+}
+uint32_t *aln_path2cigar32(const path_t *path, int path_len, int *n_cigar)
+{
+	uint32_t *cigar;
 
+	*n_cigar = aln_path_n_cigar(path, path_len);
+	if (*n_cigar == 0) return 0;
+	cigar = (uint32_t*)malloc(*n_cigar * 4);
+	aln_path_fill_cigar32(path, path_len, cigar);
 	return cigar;
 }
 
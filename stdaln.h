@@ -113,8 +113,14 @@ typedef struct
 
   int n_cigar;
   uint32_t *cigar32;
+
+  int m_path, m_out, m_cigar; /* allocated sizes, for reuse by aln_stdaln_ws() */
 } AlnAln;
 
+/* DP buffers that grow to the largest alignment seen and are reused
+   across calls; create one per thread */
+typedef struct aln_workspace AlnWorkspace;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -122,12 +128,32 @@ extern "C" {
   AlnAln *aln_stdaln_aux(const char *seq1, const char *seq2, const AlnParam *ap,
                int type, int do_align, int len1, int len2);
   AlnAln *aln_stdaln(const char *seq1, const char *seq2, const AlnParam *ap, int type, int do_align);
+  AlnAln *aln_init_AlnAln();
   void aln_free_AlnAln(AlnAln *aa);
+  AlnWorkspace *aln_init_workspace();
+  void aln_free_workspace(AlnWorkspace *ws);
+  /* aln_stdaln_aux() into aa, reusing its buffers and those of ws. out1, out2
+     and outm are only rewritten when thres > 0. Returns 0 for an unknown type. */
+  AlnAln *aln_stdaln_ws(AlnWorkspace *ws, AlnAln *aa, const char *seq1, const char *seq2,
+              const AlnParam *ap, int type, int thres, int len1, int len2);
+  /* the global alignment of two sequences of length len that aln_stdaln_ws() would give, when
+     it is the diagonal because no gapped alignment can score as high; 0 when that is not certain */
+  AlnAln *aln_ungapped_ws(AlnWorkspace *ws, AlnAln *aa, const char *seq1, const char *seq2,
+              const AlnParam *ap, int thres, int len);
+  /* only the score and end points: no path, cigar or out strings, and the
+     global DP keeps no traceback. Local end points come from the reverse pass. */
+  AlnAln *aln_stdaln_score_ws(AlnWorkspace *ws, AlnAln *aa, const char *seq1, const char *seq2,
+              const AlnParam *ap, int type, int thres, int len1, int len2);
 
   int aln_global_core(unsigned char *seq1, int len1, unsigned char *seq2, int len2, const AlnParam *ap,
             path_t *path, int *path_len);
   int aln_local_core(unsigned char *seq1, int len1, unsigned char *seq2, int len2, const AlnParam *ap,
              path_t *path, int *path_len, int _thres, int *_subo);
+  /* path may be 0 for the score only */
+  int aln_global_core_ws(AlnWorkspace *ws, unsigned char *seq1, int len1, unsigned char *seq2, int len2,
+               const AlnParam *ap, path_t *path, int *path_len);
+  int aln_local_core_ws(AlnWorkspace *ws, unsigned char *seq1, int len1, unsigned char *seq2, int len2,
+              const AlnParam *ap, path_t *path, int *path_len, int _thres, int *_subo);
   int aln_extend_core(unsigned char *seq1, int len1, unsigned char *seq2, int len2, const AlnParam *ap,
             path_t *path, int *path_len, int G0, uint8_t *_mem);
   uint16_t *aln_path2cigar(const path_t *path, int path_len, int *n_cigar);
@@ -147,6 +173,9 @@ extern AlnParam aln_param_nt2nt; /* = { 10,  2,  2, aln_sm_nt, 16, 75 }; */
 extern AlnParam aln_param_aa2aa; /* = { 20, 19, 19, aln_sm_read, 16, 75 }; */
 extern AlnParam aln_param_rd2rd; /* = { 12,  2,  2, aln_sm_blosum62, 22, 50 }; */
 
+/* character -> base code, for 4 (+N) and 16 nucleotide matrices */
+extern unsigned char aln_nt4_table[256], aln_nt16_table[256];
+
 /* common nucleotide score matrix for 16 bases */
 extern int           aln_sm_nt[], aln_sm_bwa[];
 
@@ -0,0 +1,393 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "striped.h"
+
+#ifndef max
+  #define max( a, b ) ( ((a) > (b)) ? (a) : (b) )
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+//one read per lane scoring needs a byte shuffle, picked at run time
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STRIPED_BATCH_SIMD
+#include <immintrin.h>
+#endif
+
+struct striped_profile {
+  int len;
+  int row;
+  unsigned char *table;
+  int bias;      //added to every 8 bit profile entry to keep it unsigned
+  int max_score; //best single position score
+  int gap_open;  //cost of the first gap position, gap_open + gap_ext in stdaln terms
+  int gap_ext;
+  int seg8;      //query length in 16 lane vectors
+  int seg16;     //query length in 8 lane vectors
+  __m128i *prof8;  //row * seg8 vectors
+  __m128i *prof16; //row * seg16 vectors
+  __m128i *shuf;   //len vectors: biased score of each read base code at a query position
+};
+
+/**
+ * Lay the query out striped: lane l of vector s holds query position
+ * l * seg + s, past the end of the query the score is 0.
+ */
+StripedProfile *striped_profile_init(const char *query, int len, const AlnParam *ap){
+  StripedProfile *p;
+  int c, s, l, pos, min_score = 0;
+  unsigned char *q8;
+  short *q16;
+  if(ap->row >= 20 || len <= 0)
+    return NULL;
+  p = (StripedProfile*)calloc(1, sizeof(StripedProfile));
+  p->len = len;
+  p->row = ap->row;
+  p->table = ap->row < 10 ? aln_nt4_table : aln_nt16_table;
+  for(c=0;c<p->row*p->row;c++){
+    p->max_score = max(p->max_score, ap->matrix[c]);
+    if(ap->matrix[c] < min_score)
+      min_score = ap->matrix[c];
+  }
+  p->bias = -min_score;
+  p->gap_open = ap->gap_open + ap->gap_ext;
+  p->gap_ext = ap->gap_ext;
+  //lanes are 8 bits, larger penalties or scores are left to stdaln
+  if(p->bias + p->max_score > 255 || p->gap_open > 255 || p->gap_ext < 0){
+    free(p);
+    return NULL;
+  }
+  p->seg8 = (len + 15) / 16;
+  p->seg16 = (len + 7) / 8;
+  p->prof8 = (__m128i*)_mm_malloc(sizeof(__m128i) * p->row * p->seg8, 16);
+  p->prof16 = (__m128i*)_mm_malloc(sizeof(__m128i) * p->row * p->seg16, 16);
+  for(c=0;c<p->row;c++){
+    q8 = (unsigned char*)(p->prof8 + c * p->seg8);
+    for(s=0;s<p->seg8;s++){
+      for(l=0;l<16;l++){
+        pos = l * p->seg8 + s;
+        *q8++ = p->bias + (pos < len ?
+            ap->matrix[p->table[(unsigned char)query[pos]] * p->row + c] : 0);
+      }
+    }
+    q16 = (short*)(p->prof16 + c * p->seg16);
+    for(s=0;s<p->seg16;s++){
+      for(l=0;l<8;l++){
+        pos = l * p->seg16 + s;
+        *q16++ = pos < len ?
+            ap->matrix[p->table[(unsigned char)query[pos]] * p->row + c] : 0;
+      }
+    }
+  }
+  //byte shuffle tables for striped_local_batch(), codes past row score 0 before the bias
+  if(p->row <= 16){
+    p->shuf = (__m128i*)_mm_malloc(sizeof(__m128i) * len, 16);
+    for(pos=0;pos<len;pos++){
+      q8 = (unsigned char*)(p->shuf + pos);
+      for(c=0;c<16;c++)
+        q8[c] = c < p->row ? p->bias + ap->matrix[p->table[(unsigned char)query[pos]] * p->row + c] : 0;
+    }
+  }
+  return p;
+}
+
+void striped_profile_free(StripedProfile *p){
+  if(!p)
+    return;
+  _mm_free(p->prof8);
+  _mm_free(p->prof16);
+  _mm_free(p->shuf);
+  free(p);
+}
+
+void striped_work_free(StripedWork *w){
+  _mm_free(w->mem);
+  w->mem = NULL;
+  w->cap = 0;
+}
+
+static __m128i *striped_reserve(StripedWork *w, size_t n){
+  if(w->cap < n){
+    _mm_free(w->mem);
+    w->cap = max(n, w->cap << 1);
+    w->mem = _mm_malloc(sizeof(__m128i) * w->cap, 32);
+  }
+  return (__m128i*)w->mem;
+}
+
+/**
+ * Farrar's striped local alignment in 16 unsigned saturating 8 bit lanes.
+ * Returns the best score, which is only exact while it stays below
+ * 255 - bias.
+ */
+static int striped_sw8(const StripedProfile *p, __m128i *mem, const char *seq, int len){
+  int seg = p->seg8, i, j, best = 0;
+  unsigned char lanes[16];
+  __m128i *h_store = mem, *h_load = mem + seg, *e_col = mem + 2 * seg, *tmp;
+  const __m128i *prof;
+  __m128i zero = _mm_setzero_si128();
+  __m128i gap_o = _mm_set1_epi8((char)p->gap_open);
+  __m128i gap_e = _mm_set1_epi8((char)p->gap_ext);
+  __m128i bias = _mm_set1_epi8((char)p->bias);
+  __m128i v_max = zero, h, e, f;
+  for(j=0;j<seg;j++)
+    h_store[j] = e_col[j] = zero;
+  for(i=0;i<len;i++){
+    prof = p->prof8 + p->table[(unsigned char)seq[i]] * seg;
+    f = zero;
+    //diagonal of the first segment comes from the last one, one lane down
+    h = _mm_slli_si128(h_store[seg - 1], 1);
+    tmp = h_load; h_load = h_store; h_store = tmp;
+    for(j=0;j<seg;j++){
+      h = _mm_adds_epu8(h, prof[j]);
+      h = _mm_subs_epu8(h, bias);
+      e = e_col[j];
+      h = _mm_max_epu8(h, e);
+      h = _mm_max_epu8(h, f);
+      v_max = _mm_max_epu8(v_max, h);
+      h_store[j] = h;
+      h = _mm_subs_epu8(h, gap_o);
+      e = _mm_subs_epu8(e, gap_e);
+      e_col[j] = _mm_max_epu8(e, h);
+      f = _mm_subs_epu8(f, gap_e);
+      f = _mm_max_epu8(f, h);
+      h = h_load[j];
+    }
+    //carry gaps along the query across segment boundaries until they stop mattering
+    j = 0;
+    f = _mm_slli_si128(f, 1);
+    h = h_store[0];
+    while(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(f, _mm_subs_epu8(h, gap_o)), zero)) != 0xffff){
+      h = _mm_max_epu8(h, f);
+      v_max = _mm_max_epu8(v_max, h);
+      h_store[j] = h;
+      h = _mm_subs_epu8(h, gap_o);
+      e_col[j] = _mm_max_epu8(e_col[j], h);
+      f = _mm_subs_epu8(f, gap_e);
+      if(++j >= seg){
+        j = 0;
+        f = _mm_slli_si128(f, 1);
+      }
+      h = h_store[j];
+    }
+  }
+  _mm_storeu_si128((__m128i*)lanes, v_max);
+  for(j=0;j<16;j++)
+    best = max(best, lanes[j]);
+  return best;
+}
+
+/* the same in 8 signed 16 bit lanes, for scores the 8 bit lanes cannot hold */
+static int striped_sw16(const StripedProfile *p, __m128i *mem, const char *seq, int len){
+  int seg = p->seg16, i, j, best = 0;
+  short lanes[8];
+  __m128i *h_store = mem, *h_load = mem + seg, *e_col = mem + 2 * seg, *tmp;
+  const __m128i *prof;
+  __m128i zero = _mm_setzero_si128();
+  __m128i gap_o = _mm_set1_epi16((short)p->gap_open);
+  __m128i gap_e = _mm_set1_epi16((short)p->gap_ext);
+  __m128i v_max = zero, h, e, f;
+  for(j=0;j<seg;j++)
+    h_store[j] = e_col[j] = zero;
+  for(i=0;i<len;i++){
+    prof = p->prof16 + p->table[(unsigned char)seq[i]] * seg;
+    f = zero;
+    h = _mm_slli_si128(h_store[seg - 1], 2);
+    tmp = h_load; h_load = h_store; h_store = tmp;
+    for(j=0;j<seg;j++){
+      h = _mm_adds_epi16(h, prof[j]);
+      h = _mm_max_epi16(h, zero);
+      e = e_col[j];
+      h = _mm_max_epi16(h, e);
+      h = _mm_max_epi16(h, f);
+      v_max = _mm_max_epi16(v_max, h);
+      h_store[j] = h;
+      h = _mm_subs_epu16(h, gap_o);
+      e = _mm_subs_epu16(e, gap_e);
+      e_col[j] = _mm_max_epi16(e, h);
+      f = _mm_subs_epu16(f, gap_e);
+      f = _mm_max_epi16(f, h);
+      h = h_load[j];
+    }
+    j = 0;
+    f = _mm_slli_si128(f, 2);
+    h = h_store[0];
+    while(_mm_movemask_epi8(_mm_cmpgt_epi16(f, _mm_subs_epu16(h, gap_o)))){
+      h = _mm_max_epi16(h, f);
+      v_max = _mm_max_epi16(v_max, h);
+      h_store[j] = h;
+      h = _mm_subs_epu16(h, gap_o);
+      e_col[j] = _mm_max_epi16(e_col[j], h);
+      f = _mm_subs_epu16(f, gap_e);
+      if(++j >= seg){
+        j = 0;
+        f = _mm_slli_si128(f, 2);
+      }
+      h = h_store[j];
+    }
+  }
+  _mm_storeu_si128((__m128i*)lanes, v_max);
+  for(j=0;j<8;j++)
+    best = max(best, lanes[j]);
+  return best;
+}
+
+int striped_local_score(const StripedProfile *p, StripedWork *w, const char *seq, int len){
+  __m128i *mem;
+  int score;
+  if(len <= 0)
+    return 0;
+  mem = striped_reserve(w, 3 * (size_t)max(p->seg8, p->seg16));
+  score = striped_sw8(p, mem, seq, len);
+  if(score + p->bias < 255)
+    return score;
+  score = striped_sw16(p, mem, seq, len);
+  //saturated again, no usable bound
+  if(score + p->max_score >= SHRT_MAX)
+    return INT_MAX;
+  return score;
+}
+
+#ifdef STRIPED_BATCH_SIMD
+/**
+ * Inter-sequence layout: lane l is a read of its own, aligned against
+ * the whole query. codes holds the base codes of the reads row by row,
+ * a read that is already over has 0x80 there, which the shuffle turns
+ * into a score of -bias so its best score stays put. The recurrences are
+ * those of striped_sw8(), so are the scores and where they saturate.
+ */
+__attribute__((target("ssse3")))
+static void striped_batch_sse(const StripedProfile *p, __m128i *mem, const unsigned char *codes,
+    int len, unsigned char *best){
+  int i, k;
+  __m128i *h_row = mem, *e_col = mem + p->len;
+  __m128i zero = _mm_setzero_si128();
+  __m128i gap_o = _mm_set1_epi8((char)p->gap_open);
+  __m128i gap_e = _mm_set1_epi8((char)p->gap_ext);
+  __m128i bias = _mm_set1_epi8((char)p->bias);
+  __m128i v_max = zero, c, h, diag, e, f;
+  for(k=0;k<p->len;k++)
+    h_row[k] = e_col[k] = zero;
+  for(i=0;i<len;i++){
+    c = _mm_loadu_si128((const __m128i*)(codes + 16 * i));
+    diag = f = zero;
+    for(k=0;k<p->len;k++){
+      h = _mm_adds_epu8(diag, _mm_shuffle_epi8(p->shuf[k], c));
+      h = _mm_subs_epu8(h, bias);
+      diag = h_row[k];
+      e = e_col[k];
+      h = _mm_max_epu8(h, e);
+      h = _mm_max_epu8(h, f);
+      v_max = _mm_max_epu8(v_max, h);
+      h_row[k] = h;
+      h = _mm_subs_epu8(h, gap_o);
+      e_col[k] = _mm_max_epu8(_mm_subs_epu8(e, gap_e), h);
+      f = _mm_max_epu8(_mm_subs_epu8(f, gap_e), h);
+    }
+  }
+  _mm_storeu_si128((__m128i*)best, v_max);
+}
+
+/* the same 32 reads at a time, mem holds 32 byte vectors */
+__attribute__((target("avx2")))
+static void striped_batch_avx2(const StripedProfile *p, __m128i *mem, const unsigned char *codes,
+    int len, unsigned char *best){
+  int i, k;
+  __m256i *h_row = (__m256i*)mem, *e_col = h_row + p->len;
+  __m256i zero = _mm256_setzero_si256();
+  __m256i gap_o = _mm256_set1_epi8((char)p->gap_open);
+  __m256i gap_e = _mm256_set1_epi8((char)p->gap_ext);
+  __m256i bias = _mm256_set1_epi8((char)p->bias);
+  __m256i v_max = zero, c, h, diag, e, f;
+  for(k=0;k<p->len;k++)
+    h_row[k] = e_col[k] = zero;
+  for(i=0;i<len;i++){
+    c = _mm256_loadu_si256((const __m256i*)(codes + 32 * i));
+    diag = f = zero;
+    for(k=0;k<p->len;k++){
+      h = _mm256_adds_epu8(diag, _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(p->shuf[k]), c));
+      h = _mm256_subs_epu8(h, bias);
+      diag = h_row[k];
+      e = e_col[k];
+      h = _mm256_max_epu8(h, e);
+      h = _mm256_max_epu8(h, f);
+      v_max = _mm256_max_epu8(v_max, h);
+      h_row[k] = h;
+      h = _mm256_subs_epu8(h, gap_o);
+      e_col[k] = _mm256_max_epu8(_mm256_subs_epu8(e, gap_e), h);
+      f = _mm256_max_epu8(_mm256_subs_epu8(f, gap_e), h);
+    }
+  }
+  _mm256_storeu_si256((__m256i*)best, v_max);
+}
+#endif
+
+void striped_local_batch(const StripedProfile *p, StripedWork *w, const char *const *seqs,
+    const int *lens, int n, int *scores){
+  int lanes = 0, g, m, l, i, len;
+  size_t vecs;
+  unsigned char best[32], *codes;
+  __m128i *mem;
+#ifdef STRIPED_BATCH_SIMD
+  if(p->shuf)
+    lanes = __builtin_cpu_supports("avx2") ? 32 : __builtin_cpu_supports("ssse3") ? 16 : 0;
+#endif
+  if(lanes == 0){
+    for(i=0;i<n;i++)
+      scores[i] = striped_local_score(p, w, seqs[i], lens[i]);
+    return;
+  }
+#ifdef STRIPED_BATCH_SIMD
+  for(g=0;g<n;g+=lanes){
+    m = n - g < lanes ? n - g : lanes;
+    for(len=l=0;l<m;l++)
+      len = max(len, lens[g + l]);
+    //H and E rows of the query, then the read codes
+    vecs = 2 * (size_t)p->len * (lanes / 16);
+    mem = striped_reserve(w, vecs + (size_t)len * (lanes / 16));
+    codes = (unsigned char*)(mem + vecs);
+    for(i=0;i<len;i++)
+      for(l=0;l<lanes;l++)
+        *codes++ = l < m && i < lens[g + l] ? p->table[(unsigned char)seqs[g + l][i]] : 0x80;
+    codes = (unsigned char*)(mem + vecs);
+    if(lanes == 32)
+      striped_batch_avx2(p, mem, codes, len, best);
+    else
+      striped_batch_sse(p, mem, codes, len, best);
+    for(l=0;l<m;l++)
+      scores[g + l] = best[l];
+  }
+#endif
+  //lanes that saturated get scored again in 16 bits
+  for(i=0;i<n;i++)
+    if(scores[i] + p->bias >= 255)
+      scores[i] = striped_local_score(p, w, seqs[i], lens[i]);
+}
+
+#else
+
+StripedProfile *striped_profile_init(const char *query, int len, const AlnParam *ap){
+  return NULL;
+}
+
+void striped_profile_free(StripedProfile *p){
+}
+
+int striped_local_score(const StripedProfile *p, StripedWork *w, const char *seq, int len){
+  return INT_MAX;
+}
+
+void striped_local_batch(const StripedProfile *p, StripedWork *w, const char *const *seqs,
+    const int *lens, int n, int *scores){
+  int i;
+  for(i=0;i<n;i++)
+    scores[i] = INT_MAX;
+}
+
+void striped_work_free(StripedWork *w){
+}
+
+#endif
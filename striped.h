@@ -0,0 +1,38 @@
+#pragma once
+#include <stddef.h>
+#include "stdaln.h"
+
+/**
+ * Striped (Farrar) Smith-Waterman scoring of reads against a fixed query.
+ *
+ * The query profile is built once and the reads are scored 16 query
+ * positions per instruction in 8 bit saturating lanes, falling back to
+ * 16 bit lanes when a score gets close to saturating. Only the best
+ * score is computed, no traceback.
+ *
+ * The score is that of a plain affine gap local alignment, which is never
+ * below what aln_local_core finds (it drops some gap extensions), so a
+ * read scoring under a threshold here is under it for aln_local_core too.
+ *
+ * A batch of reads can also be scored side by side, one read per 8 bit
+ * lane (16 or 32 of them depending on the CPU), which keeps every lane
+ * busy for short queries such as adapters.
+ */
+
+typedef struct striped_profile StripedProfile;
+
+/* per thread dp columns */
+typedef struct {
+  void *mem;
+  size_t cap;  //in 16 byte vectors
+} StripedWork;
+
+/* NULL if ap is not a nucleotide matrix or there is no SIMD support */
+StripedProfile *striped_profile_init(const char *query, int len, const AlnParam *ap);
+void striped_profile_free(StripedProfile *p);
+/* best local alignment score of seq against the query */
+int striped_local_score(const StripedProfile *p, StripedWork *w, const char *seq, int len);
+/* striped_local_score() of each of n reads into scores */
+void striped_local_batch(const StripedProfile *p, StripedWork *w, const char *const *seqs,
+    const int *lens, int n, int *scores);
+void striped_work_free(StripedWork *w);
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "tpool.h"
+
+typedef struct tpool_job {
+  TPoolFn fn;
+  void *arg;
+  struct tpool_job *next;
+} TPoolJob;
+
+struct tpool {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  TPoolJob *head, *tail;
+  pthread_t *threads;
+  int n_threads;
+  bool shutdown;
+};
+
+static void *tpool_main(void *arg){
+  TPool *p = (TPool*)arg;
+  TPoolJob *job;
+  for(;;){
+    pthread_mutex_lock(&p->lock);
+    while(p->head == NULL && !p->shutdown)
+      pthread_cond_wait(&p->cond, &p->lock);
+    if(p->head == NULL){ //shutting down and nothing left
+      pthread_mutex_unlock(&p->lock);
+      return NULL;
+    }
+    job = p->head;
+    p->head = job->next;
+    if(p->head == NULL)
+      p->tail = NULL;
+    pthread_mutex_unlock(&p->lock);
+
+    job->fn(job->arg);
+    free(job);
+  }
+}
+
+TPool *tpool_init(int n_threads){
+  int i;
+  TPool *p = (TPool*)calloc(1, sizeof(TPool));
+  if(n_threads < 1)
+    n_threads = 1;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  p->n_threads = n_threads;
+  p->threads = (pthread_t*)malloc(sizeof(pthread_t) * n_threads);
+  for(i=0;i<n_threads;i++)
+    pthread_create(&p->threads[i], NULL, tpool_main, p);
+  return p;
+}
+
+void tpool_submit(TPool *p, TPoolFn fn, void *arg){
+  TPoolJob *job = (TPoolJob*)malloc(sizeof(TPoolJob));
+  job->fn = fn;
+  job->arg = arg;
+  job->next = NULL;
+  pthread_mutex_lock(&p->lock);
+  if(p->tail)
+    p->tail->next = job;
+  else
+    p->head = job;
+  p->tail = job;
+  pthread_cond_signal(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+}
+
+void tpool_destroy(TPool *p){
+  int i;
+  if(p == NULL)
+    return;
+  pthread_mutex_lock(&p->lock);
+  p->shutdown = true;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  for(i=0;i<p->n_threads;i++)
+    pthread_join(p->threads[i], NULL);
+  free(p->threads);
+  pthread_cond_destroy(&p->cond);
+  pthread_mutex_destroy(&p->lock);
+  free(p);
+}
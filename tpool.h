@@ -0,0 +1,15 @@
+#pragma once
+
+/**
+ * Minimal fixed size thread pool, jobs are run in
+ * the order they were submitted by whichever thread is free.
+ */
+
+typedef void (*TPoolFn)(void *arg);
+
+typedef struct tpool TPool;
+
+TPool *tpool_init(int n_threads);
+void tpool_submit(TPool *p, TPoolFn fn, void *arg);
+/* finish every job that was submitted and join the threads */
+void tpool_destroy(TPool *p);
@@ -4,13 +4,223 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <math.h>
 #include "stdaln.h"
 #include "utils.h"
 
 
 SQP SQP_init(){
   //allocate an SQP
-  return (SQP) malloc(sizeof(Sqp));
+  SQP sqp = (SQP) calloc(1, sizeof(Sqp));
+  SQP_reserve(sqp, SQP_INIT_LEN);
+  return sqp;
+}
+
+//read buffers of size cap in mem: 10 single ones then the 2 merged ones
+#define SQP_NUM_BUFS (14)
+
+/**
+ * Lay the buffers out in a new block big enough for reads of len bases,
+ * copying over the old contents.
+ */
+void SQP_reserve(SQP sqp, size_t len){
+  char **bufs[SQP_NUM_BUFS - 2] = {
+    &sqp->fseq, &sqp->fqual, &sqp->rseq, &sqp->rqual, &sqp->rc_rseq, &sqp->rc_rqual,
+    &sqp->untrim_fseq, &sqp->untrim_fqual, &sqp->untrim_rseq, &sqp->untrim_rqual,
+    &sqp->merged_seq, &sqp->merged_qual
+  };
+  size_t cap, off;
+  char *mem;
+  int i;
+  if(len + 1 <= sqp->cap)
+    return;
+  cap = max(len + 1, sqp->cap << 1);
+  mem = (char*)calloc(SQP_NUM_BUFS, cap);
+  if(mem == NULL){
+    fprintf(stderr, "Out of memory for a read of length %zu\n", len);
+    exit(1);
+  }
+  for(i=off=0;i<SQP_NUM_BUFS - 2;i++){
+    if(sqp->mem)
+      memcpy(mem + off, *bufs[i], (i < 10 ? 1 : 2) * sqp->cap);
+    *bufs[i] = mem + off;
+    off += (i < 10 ? 1 : 2) * cap;
+  }
+  free(sqp->mem);
+  sqp->mem = mem;
+  sqp->cap = cap;
+}
+
+/**
+ * Empty out the reads so that a new pair can be read in.
+ * Every buffer is written up to its length before it is read,
+ * so there is no need to clear the buffers themselves.
+ */
+void SQP_clear(SQP sqp){
+  sqp->fid[0] = sqp->rid[0] = '\0';
+  sqp->fseq[0] = sqp->fqual[0] = '\0';
+  sqp->rseq[0] = sqp->rqual[0] = '\0';
+  sqp->flen = sqp->rlen = 0;
+  sqp->merged_len = sqp->mpos = 0;
+  sqp->rc_ok = false;
+}
+
+/**
+ * Reverse complement the reverse read into rc_rseq/rc_rqual
+ * unless that has been done since it was last trimmed
+ */
+void SQP_rc(SQP sqp){
+  if(sqp->rc_ok)
+    return;
+  strncpy(sqp->rc_rseq,sqp->rseq,sqp->rlen+1);
+  strncpy(sqp->rc_rqual,sqp->rqual,sqp->rlen+1);
+  rev_qual(sqp->rc_rqual, sqp->rlen);
+  revcom_seq(sqp->rc_rseq, sqp->rlen);
+  sqp->rc_ok = true;
+}
+
+/**
+ * Replace the bases from pos up to the end of seq with N. If seq
+ * already ends before pos its length still becomes pos, and the
+ * gap is filled with nulls in both seq and qual.
+ */
+size_t SQP_mask_tail(SQP sqp, char *seq, char *qual, size_t pos){
+  size_t end = strlen(seq);
+  if(pos < end){
+    memset(seq + pos, 'N', end - pos);
+    return end;
+  }
+  if(end < sqp->cap){
+    memset(seq + end, '\0', min(pos, sqp->cap) - end);
+    memset(qual + end, '\0', min(pos, sqp->cap) - end);
+  }
+  return pos;
+}
+
+/**
+ * Length of a read once its 3' end is quality trimmed the way BWA does it
+ * (Mott's algorithm): going in from the end add up how far each quality
+ * falls short of qcut, stop when the sum goes negative and cut where it peaked.
+ */
+size_t qual_trim_mott(const char *qual, size_t len, char qcut){
+  size_t i, cut = len;
+  int s = 0, best = 0;
+  for(i=len;i>0;i--){
+    s += qcut - qual[i-1];
+    if(s < 0)
+      break;
+    if(s > best){
+      best = s;
+      cut = i-1;
+    }
+  }
+  return cut;
+}
+
+/**
+ * Length of a read once windows of w bases with a mean quality under qcut
+ * are slid off its 3' end, along with the bases under qcut that end up last
+ */
+size_t qual_trim_window(const char *qual, size_t len, char qcut, size_t w){
+  size_t i, end = len;
+  long sum = 0;
+  w = min(w, len);
+  for(i=len-w;i<len;i++)
+    sum += qual[i];
+  while(end > 0 && sum < (long)qcut * (long)w){
+    if(end == w){ //not one window is good enough
+      end = 0;
+      break;
+    }
+    end--;
+    sum += qual[end - w] - qual[end];
+  }
+  while(end > 0 && qual[end-1] < qcut)
+    end--;
+  return end;
+}
+
+/**
+ * Length of the run of base at the 3' end of seq, or of whatever base the
+ * read ends in when base is 0. Sequencing errors are let in at one per 8
+ * bases of the run so far, 5 at the most, and the run always ends on the base.
+ */
+size_t tail_run(const char *seq, size_t len, char base){
+  size_t i, run = 0;
+  int mismatches = 0;
+  if(len == 0)
+    return 0;
+  if(base == 0)
+    base = toupper(seq[len-1]);
+  for(i=0;i<len;i++){
+    if(toupper(seq[len-1-i]) == base){
+      run = i+1;
+    }else if(++mismatches > min(5, (int)(i+1)/8)){
+      break;
+    }
+  }
+  return run;
+}
+
+/**
+ * Shannon entropy in bits (0 to 4) of the dinucleotides of seq that
+ * hold no N, 4 when there are none to go by
+ */
+double dinuc_entropy(const char *seq, size_t len){
+  int count[16], n = 0, a, b = -1, i;
+  size_t j;
+  double p, h = 0.0;
+  memset(count, 0, sizeof(count));
+  for(j=0;j<len;j++){
+    switch(toupper(seq[j])){
+    case 'A': a = 0; break;
+    case 'C': a = 1; break;
+    case 'G': a = 2; break;
+    case 'T': a = 3; break;
+    default: a = -1;
+    }
+    if(a >= 0 && b >= 0){
+      count[(b << 2) | a]++;
+      n++;
+    }
+    b = a;
+  }
+  if(n == 0)
+    return 4.0;
+  for(i=0;i<16;i++){
+    if(count[i]){
+      p = (double)count[i] / n;
+      h -= p * log2(p);
+    }
+  }
+  return h;
+}
+
+void olap_table_init(OlapTable *t, float min_match_frac, float max_mismatch_frac){
+  memset(t, 0, sizeof(OlapTable));
+  t->min_match_frac = min_match_frac;
+  t->max_mismatch_frac = max_mismatch_frac;
+  olap_table_reserve(t, SQP_INIT_LEN);
+}
+
+void olap_table_reserve(OlapTable *t, size_t len){
+  size_t i;
+  if(t->min_match && len <= t->len)
+    return;
+  len = max(len, t->len << 1);
+  t->min_match = (unsigned short*)realloc(t->min_match, sizeof(unsigned short) * (len + 1));
+  t->max_mismatch = (unsigned short*)realloc(t->max_mismatch, sizeof(unsigned short) * (len + 1));
+  for(i=0;i<=len;i++){
+    t->max_mismatch[i] = floor(((float)i)*t->max_mismatch_frac);
+    t->min_match[i] = ceil(((float)i)*t->min_match_frac);
+  }
+  t->len = len;
+}
+
+void olap_table_free(OlapTable *t){
+  free(t->min_match);
+  free(t->max_mismatch);
 }
 
 
@@ -58,25 +268,25 @@ char gap_p33_qual(char q){
 }
 
 
-void pretty_print_alignment_stdaln(gzFile out, SQP sqp, AlnAln *aln, bool first_adapter, bool second_adapter, bool print_merged){
+void pretty_print_alignment_stdaln(OutBuf *out, SQP sqp, AlnAln *aln, bool first_adapter, bool second_adapter, bool print_merged){
   if(!(first_adapter || second_adapter)){
-    gzprintf(out,"Read Alignment Score:%d, Suboptimal Score:%d\nID:%s\n",aln->score, aln->subo ,sqp->fid);
-    gzprintf(out,"READ1: %s\n",aln->out1);
-    gzprintf(out,"       %s\n",aln->outm);
-    gzprintf(out,"READ2: %s\n",aln->out2);
+    outbuf_printf(out,"Read Alignment Score:%d, Suboptimal Score:%d\nID:%s\n",aln->score, aln->subo ,sqp->fid);
+    outbuf_printf(out,"READ1: %s\n",aln->out1);
+    outbuf_printf(out,"       %s\n",aln->outm);
+    outbuf_printf(out,"READ2: %s\n",aln->out2);
     if(print_merged)
-      gzprintf(out,"MERGD: %s\n\n",sqp->merged_seq);
+      outbuf_printf(out,"MERGD: %s\n\n",sqp->merged_seq);
     else
-      gzprintf(out,"\n");
+      outbuf_printf(out,"\n");
     return;
   }else if(first_adapter){
-    gzprintf(out,"Adapter Alignment Score:%d, Suboptimal Score:%d\nID:%s\n",aln->score, aln->subo ,sqp->fid);
+    outbuf_printf(out,"Adapter Alignment Score:%d, Suboptimal Score:%d\nID:%s\n",aln->score, aln->subo ,sqp->fid);
   }else if(second_adapter){
-    gzprintf(out,"Adapter Alignment Score:%d, Suboptimal Score:%d\nID:%s\n",aln->score, aln->subo ,sqp->rid);
+    outbuf_printf(out,"Adapter Alignment Score:%d, Suboptimal Score:%d\nID:%s\n",aln->score, aln->subo ,sqp->rid);
   }
-  gzprintf(out,"READ: %s\n",aln->out1);
-  gzprintf(out,"      %s\n",aln->outm);
-  gzprintf(out,"ADPT: %s\n\n",aln->out2);
+  outbuf_printf(out,"READ: %s\n",aln->out1);
+  outbuf_printf(out,"      %s\n",aln->outm);
+  outbuf_printf(out,"ADPT: %s\n\n",aln->out2);
 }
 
 
@@ -90,7 +300,7 @@ void pretty_print_alignment_stdaln(gzFile out, SQP sqp, AlnAln *aln, bool first_
  * vertical bars represent matches of any type
  *
  */
-void pretty_print_alignment(gzFile out, SQP sqp, char adj_q_cut, bool sort){
+void pretty_print_alignment(OutBuf *out, SQP sqp, char adj_q_cut, bool sort){
   char *queryseq;
   char *queryqual;
   char *subjseq;
@@ -98,6 +308,7 @@ void pretty_print_alignment(gzFile out, SQP sqp, char adj_q_cut, bool sort){
   int querylen = 0;
   int subjlen = 0;
   int i;
+  SQP_rc(sqp);
   if((!sort) || (sqp->flen >= sqp->rlen)){
     subjseq = sqp->fseq;
     subjqual = sqp->fqual;
@@ -113,28 +324,28 @@ void pretty_print_alignment(gzFile out, SQP sqp, char adj_q_cut, bool sort){
     querylen = sqp->flen;
     subjlen = sqp->rlen;
   }
-  gzprintf(out, "ID: %s\n",sqp->fid);
-  gzprintf(out, "SUBJ: %s\n",subjseq);
+  outbuf_printf(out, "ID: %s\n",sqp->fid);
+  outbuf_printf(out, "SUBJ: %s\n",subjseq);
   //now print out the bars
-  gzprintf(out, "      "); //initial space
+  outbuf_printf(out, "      "); //initial space
   for(i=0;i<sqp->merged_len;i++){
     if(i >= sqp->mpos && i < subjlen && i < (querylen + sqp->mpos)){
       //we are in the overlapping region
       if(subjseq[i] == queryseq[i-sqp->mpos])
-        gzputc(out,'|');
+        outbuf_putc(out,'|');
       else if(subjqual[i] < adj_q_cut || queryqual[i-sqp->mpos] < adj_q_cut)
-        gzputc(out,' ');
+        outbuf_putc(out,' ');
       else
-        gzputc(out,'*');
+        outbuf_putc(out,'*');
     }else{
-      gzputc(out,' ');
+      outbuf_putc(out,' ');
     }
   }
-  gzprintf(out,"\nQUER: ");
+  outbuf_printf(out,"\nQUER: ");
   for(i=0;i<sqp->mpos;i++)
-    gzputc(out,' '); //spaces before aln
-  gzprintf(out,"%s",queryseq);
-  gzprintf(out,"\nMERG: %s\n\n",sqp->merged_seq);
+    outbuf_putc(out,' '); //spaces before aln
+  outbuf_printf(out,"%s",queryseq);
+  outbuf_printf(out,"\nMERG: %s\n\n",sqp->merged_seq);
 }
 
 /**
@@ -144,6 +355,7 @@ void pretty_print_alignment(gzFile out, SQP sqp, char adj_q_cut, bool sort){
  *  the same as they were.
  */
 void make_blunt_ends(SQP sqp, AlnAln *aln){
+  SQP_rc(sqp);
   int len = strlen(aln->out1);
   char *out1, *out2;
   out1 = aln->out1;
@@ -246,6 +458,7 @@ void make_blunt_ends(SQP sqp, AlnAln *aln){
 
 
 void fill_merged_sequence(SQP sqp, AlnAln *aln, bool trim_overhang){
+  SQP_rc(sqp);
   int len = strlen(aln->out1);
   char *out1, *out2;
   out1 = aln->out1;
@@ -338,24 +551,50 @@ void fill_merged_sequence(SQP sqp, AlnAln *aln, bool trim_overhang){
 
 void SQP_destroy(SQP sqp){
   //free up an SQP
+  free(sqp->mem);
   free(sqp);
 }
 
 
+/**
+ * Where adapter_trim would cut one read for an adapter: 0 if the
+ * adapter comes before the read's first base, the start of its first
+ * overlap at or after it otherwise, CODE_NOMATCH if it finds neither.
+ */
+int adapter_olap_pos(OlWork *ow, char *seq, char *qual, size_t len,
+    char *primer, char *primer_dummy_qual, int primer_len,
+    size_t min_ol_adapter,
+    unsigned short min_match_adapter[],
+    unsigned short max_mismatch_adapter[],
+    char qcut){
+  int pos = compute_ol(ow,
+      primer, primer_dummy_qual, primer_len,
+      seq, qual, len,
+      max(min((size_t)primer_len,len)-5,0), min_match_adapter, max_mismatch_adapter,
+      false, qcut);
+  if(pos >= 0)
+    return 0;
+  pos = compute_ol(ow, seq, qual, len,
+      primer, primer_dummy_qual, primer_len,
+      min_ol_adapter, min_match_adapter, max_mismatch_adapter,
+      false, qcut);
+  return pos >= 0 ? pos : CODE_NOMATCH;
+}
+
 /**
  * adapter_trim:
  *
  *
  */
-bool adapter_trim(SQP sqp, size_t min_ol_adapter,
+bool adapter_trim(OlWork *ow, SQP sqp, size_t min_ol_adapter,
     char *forward_primer, char *forward_primer_dummy_qual,
     int forward_primer_len,
     char *reverse_primer, char *reverse_primer_dummy_qual,
     int reverse_primer_len,
-    unsigned short min_match_adapter[MAX_SEQ_LEN+1],
-    unsigned short max_mismatch_adapter[MAX_SEQ_LEN+1],
-    unsigned short min_match_reads[MAX_SEQ_LEN+1],
-    unsigned short max_mismatch_reads[MAX_SEQ_LEN+1],
+    unsigned short min_match_adapter[],
+    unsigned short max_mismatch_adapter[],
+    unsigned short min_match_reads[],
+    unsigned short max_mismatch_reads[],
     char qcut, 
     bool use_mask){
   //adapters on reads if the insert size is less than the read length, the adapter
@@ -363,15 +602,16 @@ bool adapter_trim(SQP sqp, size_t min_ol_adapter,
 
 
   /**
-   * First check for adapter match before the first position of the read
+   * First check for adapter match before the first position of the read.
+   * An adapter of length 0 means the read has none to look for.
    */
-  int pfpos = compute_ol(
+  int pfpos = forward_primer_len == 0 ? CODE_NOMATCH : compute_ol(ow,
       forward_primer, forward_primer_dummy_qual, forward_primer_len,
       sqp->fseq,sqp->fqual,sqp->flen,
       max(min(forward_primer_len,sqp->flen)-5,0), min_match_adapter, max_mismatch_adapter,
       false, qcut);
 
-  int prpos = compute_ol(
+  int prpos = reverse_primer_len == 0 ? CODE_NOMATCH : compute_ol(ow,
       reverse_primer, reverse_primer_dummy_qual, reverse_primer_len,
       sqp->rseq,sqp->rqual,sqp->rlen,
       max(min(reverse_primer_len,sqp->rlen)-5,0), min_match_adapter, max_mismatch_adapter,
@@ -385,35 +625,28 @@ bool adapter_trim(SQP sqp, size_t min_ol_adapter,
     sqp->rseq[0] = '\0';
     sqp->rqual[0] = '\0';
     sqp->rlen = 0;
-    sqp->rc_rqual[0] = '\0';
-    sqp->rc_rseq[0] = '\0';
+    SQP_rc_stale(sqp);
     return true;
   }
 
   /**
    * now check for the adapter after the first position of the read
    */
-  int fpos = compute_ol(sqp->fseq,sqp->fqual,sqp->flen,
+  int fpos = forward_primer_len == 0 ? CODE_NOMATCH : compute_ol(ow, sqp->fseq,sqp->fqual,sqp->flen,
       forward_primer, forward_primer_dummy_qual, forward_primer_len,
       min_ol_adapter, min_match_adapter, max_mismatch_adapter,
       false, qcut);
-  int rpos = compute_ol(sqp->rseq,sqp->rqual,sqp->rlen,
+  int rpos = reverse_primer_len == 0 ? CODE_NOMATCH : compute_ol(ow, sqp->rseq,sqp->rqual,sqp->rlen,
       reverse_primer, reverse_primer_dummy_qual, reverse_primer_len,
       min_ol_adapter, min_match_adapter, max_mismatch_adapter,
       false, qcut);
   if(fpos != CODE_NOMATCH || rpos != CODE_NOMATCH){
     //check if reads are long enough to do anything with.
     // trim adapters
-    int sz_sqp;
-    int iter;
     if(fpos >=0){
       
       if(use_mask){
-         sz_sqp = sizeof(sqp->fseq);
-         for(iter=sqp->flen; iter<sz_sqp && (sqp->fseq[iter] != '\0'); iter++){
-            sqp->fseq[iter]='N';
-         }
-         sqp->flen=iter;
+         sqp->flen = SQP_mask_tail(sqp, sqp->fseq, sqp->fqual, sqp->flen);
       }else{
          sqp->fseq[fpos] = '\0';
          sqp->fqual[fpos] = '\0';
@@ -424,11 +657,7 @@ bool adapter_trim(SQP sqp, size_t min_ol_adapter,
     if(rpos >= 0){
        
        if(use_mask){
-         sz_sqp = sizeof(sqp->rseq);
-         for(iter=sqp->rlen; iter<sz_sqp && (sqp->rseq[iter] != '\0'); iter++){
-            sqp->rseq[iter]='N';
-         }
-         sqp->rlen=iter;
+         sqp->rlen = SQP_mask_tail(sqp, sqp->rseq, sqp->rqual, sqp->rlen);
        }else{
          sqp->rseq[rpos] = '\0';
          sqp->rqual[rpos] = '\0';
@@ -437,16 +666,12 @@ bool adapter_trim(SQP sqp, size_t min_ol_adapter,
        
        
     }
-    // now re-reverse complement the sequences
-    strncpy(sqp->rc_rseq,sqp->rseq,sqp->rlen+1);
-    strncpy(sqp->rc_rqual,sqp->rqual,sqp->rlen+1);
-    rev_qual(sqp->rc_rqual, sqp->rlen);
-    revcom_seq(sqp->rc_rseq, sqp->rlen);
+    SQP_rc_stale(sqp);
     //adapters present
     return true;
   }
 
-  return read_olap_adapter_trim(sqp, min_ol_adapter,
+  return read_olap_adapter_trim(ow, sqp, min_ol_adapter,
       min_match_adapter, max_mismatch_adapter,
       min_match_reads, max_mismatch_reads,
       qcut, use_mask);
@@ -458,11 +683,11 @@ bool adapter_trim(SQP sqp, size_t min_ol_adapter,
  * look for adapters by read overlap
  *
  */
-bool read_olap_adapter_trim(SQP sqp, size_t min_ol_adapter,
-    unsigned short min_match_adapter[MAX_SEQ_LEN+1],
-    unsigned short max_mismatch_adapter[MAX_SEQ_LEN+1],
-    unsigned short min_match_reads[MAX_SEQ_LEN+1],
-    unsigned short max_mismatch_reads[MAX_SEQ_LEN+1],
+bool read_olap_adapter_trim(OlWork *ow, SQP sqp, size_t min_ol_adapter,
+    unsigned short min_match_adapter[],
+    unsigned short max_mismatch_adapter[],
+    unsigned short min_match_reads[],
+    unsigned short max_mismatch_reads[],
     char qcut, bool use_mask){
   ////////////
   // Look at the adapter overhang
@@ -477,6 +702,7 @@ bool read_olap_adapter_trim(SQP sqp, size_t min_ol_adapter,
   //...
   //we can get this effect by swapping the query and subj, and then have a high minimum
   //overlap
+  SQP_rc(sqp);
   char *queryseq= sqp->rc_rseq;
   char *queryqual= sqp->rc_rqual;
   char *subjseq= sqp->fseq;
@@ -484,7 +710,7 @@ bool read_olap_adapter_trim(SQP sqp, size_t min_ol_adapter,
   int querylen = sqp->rlen;
   int subjlen = sqp->flen;
 
-  int ppos = compute_ol(
+  int ppos = compute_ol(ow,
       queryseq, queryqual, querylen,
       subjseq, subjqual, subjlen,
       //min(subjlen,min(min_ol_adapter,querylen)),
@@ -497,8 +723,6 @@ bool read_olap_adapter_trim(SQP sqp, size_t min_ol_adapter,
       //no adapter
       return false;
     }else{
-      int sz_sqp;
-      int iter;
       //ppos gives us the shift to the left of the query
       // One case:
       //   ----X------- fread
@@ -525,16 +749,8 @@ bool read_olap_adapter_trim(SQP sqp, size_t min_ol_adapter,
         // -X----X---     rread
         // make initial cut to rc read
         if(use_mask){
-           sz_sqp = sizeof(sqp->fseq);
-           for(iter= sqp->flen + ppos; iter<sz_sqp && (sqp->fseq[iter] != '\0'); iter++){
-              sqp->fseq[iter]='N';
-           }
-           sqp->flen=iter;
-           sz_sqp = sizeof(sqp->rseq);
-           for(iter=sqp->rlen + ppos; iter<sz_sqp && (sqp->rseq[iter] != '\0'); iter++){
-              sqp->rseq[iter]='N';
-           }
-           sqp->rlen=iter;
+           sqp->flen = SQP_mask_tail(sqp, sqp->fseq, sqp->fqual, sqp->flen + ppos);
+           sqp->rlen = SQP_mask_tail(sqp, sqp->rseq, sqp->rqual, sqp->rlen + ppos);
         }else{
           sqp->rc_rqual[ppos + sqp->flen] = '\0';
           sqp->rc_rseq[ppos + sqp->flen] = '\0';
@@ -551,27 +767,15 @@ bool read_olap_adapter_trim(SQP sqp, size_t min_ol_adapter,
 
       //now cases have been handled and length has been determined
       if(use_mask){
-         sz_sqp = sizeof(sqp->fseq);
-         for(iter=sqp->flen; iter<sz_sqp && (sqp->fseq[iter] != '\0'); iter++){
-            sqp->fseq[iter]='N';
-         }
-         sqp->flen=iter;
-         sz_sqp = sizeof(sqp->rseq);
-         for(iter=sqp->rlen; iter<sz_sqp && (sqp->rseq[iter] != '\0'); iter++){
-            sqp->rseq[iter]='N';
-         }
-         sqp->rlen=iter;
+         sqp->flen = SQP_mask_tail(sqp, sqp->fseq, sqp->fqual, sqp->flen);
+         sqp->rlen = SQP_mask_tail(sqp, sqp->rseq, sqp->rqual, sqp->rlen);
       }else{
         sqp->fseq[sqp->flen] = '\0';
         sqp->fqual[sqp->flen] = '\0';
         sqp->rseq[sqp->rlen] = '\0';
         sqp->rqual[sqp->rlen] = '\0';
       }
-      // now re-reverse complement the sequences
-      strncpy(sqp->rc_rseq,sqp->rseq,sqp->rlen+1);
-      strncpy(sqp->rc_rqual,sqp->rqual,sqp->rlen+1);
-      rev_qual(sqp->rc_rqual, sqp->rlen);
-      revcom_seq(sqp->rc_rseq, sqp->rlen);
+      SQP_rc_stale(sqp);
       return true;
     }
   }
@@ -583,12 +787,13 @@ bool read_olap_adapter_trim(SQP sqp, size_t min_ol_adapter,
  * read_merge:
  *    Computes the potential overlap between two reads,
  *    fills the merged_seq items in sqp
- *    return true if a merging was done, and false otherwise
+ *    return true if a merging was done, and false otherwise;
+ *    ambiguous (may be NULL) is set when more than one overlap fit
  */
-bool read_merge(SQP sqp, size_t min_olap,
-    unsigned short min_match[MAX_SEQ_LEN+1],
-    unsigned short max_mismatch[MAX_SEQ_LEN+1],
-    char adj_q_cut){
+bool read_merge(OlWork *ow, SQP sqp, size_t min_olap,
+    unsigned short min_match[],
+    unsigned short max_mismatch[],
+    char adj_q_cut, bool *ambiguous){
   //now compute overlap
   int i;
 
@@ -599,6 +804,7 @@ bool read_merge(SQP sqp, size_t min_olap,
   int querylen = 0;
   int subjlen = 0;
   char c,q;
+  SQP_rc(sqp);
   //  if(sqp->rlen <= sqp->flen){
   subjseq = sqp->fseq;
   subjqual = sqp->fqual;
@@ -626,11 +832,13 @@ bool read_merge(SQP sqp, size_t min_olap,
   // ----------   Subj
   //   ---------- Query
   //...
-  int mpos = compute_ol(
+  int mpos = compute_ol(ow,
       subjseq, subjqual, subjlen,
       queryseq, queryqual, querylen,
       min_olap, min_match, max_mismatch,
       true, adj_q_cut );
+  if(ambiguous)
+    *ambiguous = mpos == CODE_AMBIGUOUS;
   if(mpos == CODE_NOMATCH || mpos == CODE_AMBIGUOUS){
     return false;
   }else{
@@ -690,6 +898,7 @@ void adapter_merge(SQP sqp, bool print_overhang){
   int i = 0;
   int j = 0;
   char c,q;
+  SQP_rc(sqp);
   if(sqp->rlen == sqp->flen){
     //easy.. peezy.. lemaon.... squeezy..
     for(i=0; i< sqp->rlen; i++){
@@ -798,7 +1007,7 @@ void adapter_merge(SQP sqp, bool print_overhang){
    put the results in the next SQP of SQPDB. Grow
    this, if necessary.
  */
-bool next_fastqs( gzFile ffq, gzFile rfq, SQP curr_sqp, bool p64 ) {
+bool next_fastqs( FqReader *ffq, FqReader *rfq, SQP curr_sqp, bool p64 ) {
   int frs; // forward fastq read status
   int rrs; // reverse fastq read status
   size_t id1len = 0;
@@ -807,25 +1016,15 @@ bool next_fastqs( gzFile ffq, gzFile rfq, SQP curr_sqp, bool p64 ) {
      pair of each */
 
   //make sure everything is fresh...
-  memset(curr_sqp->fid,'\0',MAX_SEQ_LEN);
-  memset(curr_sqp->rid,'\0',MAX_SEQ_LEN);
-  memset(curr_sqp->fseq,'\0',MAX_SEQ_LEN);
-  memset(curr_sqp->rseq,'\0',MAX_SEQ_LEN);
-  memset(curr_sqp->rc_rseq,'\0',MAX_SEQ_LEN);
-  memset(curr_sqp->fqual,'\0',MAX_SEQ_LEN);
-  memset(curr_sqp->rqual,'\0',MAX_SEQ_LEN);
-  memset(curr_sqp->merged_seq,'\0',MAX_SEQ_LEN+MAX_SEQ_LEN);
-  memset(curr_sqp->merged_qual,'\0',MAX_SEQ_LEN+MAX_SEQ_LEN);
-  memset(curr_sqp->rc_rqual,'\0',MAX_SEQ_LEN);
-  curr_sqp->flen = curr_sqp->rlen = 0;
+  SQP_clear(curr_sqp);
 
 
   //
 
-  frs = read_fastq( ffq, curr_sqp->fid, curr_sqp->fseq, 
-      curr_sqp->fqual, &id1len, &(curr_sqp->flen), p64 );
-  rrs = read_fastq( rfq, curr_sqp->rid, curr_sqp->rseq, 
-      curr_sqp->rqual, &id2len, &(curr_sqp->rlen), p64 );
+  frs = read_fastq( ffq, curr_sqp, curr_sqp->fid, &curr_sqp->fseq,
+      &curr_sqp->fqual, &id1len, &(curr_sqp->flen), p64 );
+  rrs = read_fastq( rfq, curr_sqp, curr_sqp->rid, &curr_sqp->rseq,
+      &curr_sqp->rqual, &id2len, &(curr_sqp->rlen), p64 );
 
   //  //reverse comp the second read for overlapping and everything.
   //  strcpy(curr_sqp->rc_rseq,curr_sqp->rseq);
@@ -836,18 +1035,75 @@ bool next_fastqs( gzFile ffq, gzFile rfq, SQP curr_sqp, bool p64 ) {
   if ( (frs == 1) &&
       (rrs == 1) &&
       f_r_id_check( curr_sqp->fid, id1len, curr_sqp->rid, id2len ) ) {
-    strncpy(curr_sqp->rc_rseq,curr_sqp->rseq,curr_sqp->rlen+1);
-    strncpy(curr_sqp->rc_rqual,curr_sqp->rqual,curr_sqp->rlen+1);
-    rev_qual(curr_sqp->rc_rqual, curr_sqp->rlen);
-    revcom_seq(curr_sqp->rc_rseq, curr_sqp->rlen);
+    //the reverse complement is left to SQP_rc, many pairs are trimmed first
     return true;
   } else {
     return false;
   }
 }
 
-int write_fastq(gzFile out, char id[], char seq[], char qual[]){
-  return gzprintf(out,"@%s\n%s\n+\n%s\n", id, seq, qual);
+void write_fastq(OutBuf *out, char id[], char seq[], char qual[]){
+  outbuf_putc(out,'@');
+  outbuf_puts(out,id);
+  outbuf_putc(out,'\n');
+  outbuf_puts(out,seq);
+  outbuf_write(out,"\n+\n",3);
+  outbuf_puts(out,qual);
+  outbuf_putc(out,'\n');
+}
+
+
+void outbuf_init(OutBuf *b){
+  b->s = NULL;
+  b->l = b->m = 0;
+}
+
+void outbuf_free(OutBuf *b){
+  free(b->s);
+  outbuf_init(b);
+}
+
+/**
+ * Make room for at least len more characters plus a terminating null
+ */
+static void outbuf_reserve(OutBuf *b, size_t len){
+  if(b->l + len + 1 > b->m){
+    b->m = max(b->m << 1, b->l + len + 1);
+    b->s = (char*)realloc(b->s, b->m);
+    if(b->s == NULL){
+      fprintf(stderr, "Out of memory growing an output buffer\n");
+      exit(1);
+    }
+  }
+}
+
+void outbuf_write(OutBuf *b, const char *s, size_t len){
+  outbuf_reserve(b, len);
+  memcpy(b->s + b->l, s, len);
+  b->l += len;
+}
+
+void outbuf_puts(OutBuf *b, const char *s){
+  outbuf_write(b, s, strlen(s));
+}
+
+void outbuf_putc(OutBuf *b, char c){
+  outbuf_reserve(b, 1);
+  b->s[b->l++] = c;
+}
+
+void outbuf_printf(OutBuf *b, const char *fmt, ...){
+  va_list ap;
+  int len;
+  va_start(ap, fmt);
+  len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if(len < 0) return;
+  outbuf_reserve(b, len);
+  va_start(ap, fmt);
+  vsnprintf(b->s + b->l, len + 1, fmt, ap);
+  va_end(ap);
+  b->l += len;
 }
 
 
@@ -865,115 +1121,36 @@ bool f_r_id_check( char fid[], size_t fid_len, char rid[], size_t rid_len ) {
 }
 
 /* read_fastq
+   seq and qual point at fields of sqp, which is grown to fit the read
    Return 1 => more sequence to be had
           0 => EOF
  */
-int read_fastq( gzFile fastq, char id[], char seq[], char qual[], size_t *id_len, size_t *seq_len, bool p64 ) {
-  char c;
+int read_fastq( FqReader *fastq, SQP sqp, char id[], char **seq, char **qual, size_t *id_len, size_t *seq_len, bool p64 ) {
+  FqRecord rec;
   size_t i;
-  c = gzgetc( fastq );
-  if ( c == EOF ) return 0;
-  if ( c != '@' ) {
-    fprintf( stderr, "fastq record not beginning with @\n" );
-    return 0;
-  }
+  if ( !fq_next_record( fastq, &rec ) ) return 0;
 
-  /* get identifier */
-  i = 0;
-  c = gzgetc( fastq );
-  while(  c != '\n' &&
-      (i < MAX_ID_LEN)) {
-    if ( c == EOF ) {
-      return 0;
-    }
-    id[i] = c;
-    i++;
-    if ( i == MAX_ID_LEN ) {
-      /* Id is too long - truncate it now */
-      id[i] = '\0';
-    }
-    c = gzgetc( fastq );
-  }
+  /* get identifier, truncating it if it is too long */
+  i = min(rec.id_len, MAX_ID_LEN);
+  memcpy(id, rec.id, i);
   id[i] = '\0';
   *id_len = i;
-  /* Now, everything else on the line is description (if anything)
-     although fastq does not appear to formally support description */
-  //  while ( (c != '\n') &&
-  //      (c != EOF) ) {
-  //    c = gzgetc( fastq );
-  //  }
 
-  /* Now, read the sequence. This should all be on a single line */
-  i = 0;
-  c = gzgetc( fastq );
-  while ( (c != '\n') &&
-      (c != EOF) &&
-      (i < MAX_SEQ_LEN) ) {
-    if ( isspace(c) ) {
-      ;
-    }
-    else {
-      c = toupper( c );
-      seq[i++] = (c=='.' ? 'N':c);
-    }
-    c = gzgetc( fastq );
-  }
-  seq[i] = '\0';
+  /* Now, the sequence. This should all be on a single line */
+  SQP_reserve(sqp, max(rec.seq_len, rec.qual_len));
+  i = fq_copy_seq(*seq, rec.seq, rec.seq_len, rec.seq_len);
+  (*seq)[i] = '\0';
   *seq_len = i;
-  /* If the reading stopped because the sequence was longer than
-     INIT_ALN_SEQ_LEN, then we need to advance the file pointer
-     past this line */
-  if ( i == MAX_SEQ_LEN ) {
-    while ( (c != '\n') &&
-        (c != EOF) ) {
-      c = gzgetc( fastq );
-    }
-  }
 
-  /* Now, read the quality score header */
-  c = gzgetc( fastq );
-  if ( c != '+' ) {
+  if ( rec.bad_plus ) {
     fprintf( stderr, "Problem reading quality line for %s\n", id );
-    return 1;
-  }
-  /* Zip through the rest of the line, it should be the same identifier
-     as before or blank */
-  c = gzgetc( fastq );
-  while( (c != '\n') &&
-      (c != EOF) ) {
-    c = gzgetc( fastq );
-  }
-
-  /* Now, get the quality score line */
-  c = gzgetc( fastq );
-  i = 0;
-  while( (c != '\n') &&
-      (c != EOF) &&
-      (i < MAX_SEQ_LEN) ) {
-    if ( isspace(c) ) {
-      ;
-    }
-    else {
-      qual[i++] = (p64)?((c=='B')?'!':c-31):c;
-    }
-    c = gzgetc( fastq );
-  }
-  qual[i] = '\0';
-
-  /* If the reading stopped because the sequence was longer than
-     INIT_ALN_SEQ_LEN, then we need to advance the file pointer
-     past this line */
-  if ( i == MAX_SEQ_LEN ) {
-    while ( (c != '\n') &&
-        (c != EOF) ) {
-      c = gzgetc( fastq );
-    }
-  }
-
-  if ( c == EOF ) {
-    fprintf(stderr,"\nWarning: Your last read may have been discarded because you are missing a new line at the end of the file.\n\n");
-    return 0;
+    i = 0;
+  }else{
+    /* Now, get the quality score line */
+    i = fq_copy_qual(*qual, rec.qual, rec.qual_len, rec.qual_len, p64);
   }
+  /* a short quality line reads as nulls up to the length of the bases */
+  memset(*qual + i, '\0', (*seq_len > i ? *seq_len - i : 0) + 1);
   return 1;
 }
 
@@ -995,6 +1172,183 @@ gzFile fileOpen(const char *name, char access_mode[]) {
 
 
 
+void ol_work_free(OlWork *ow){
+  int i;
+  for(i=0;i<OL_WORK_SLOTS;i++){
+    free(ow->slot[i].lo);
+    ow->slot[i].lo = ow->slot[i].hi = ow->slot[i].inv = ow->slot[i].good = NULL;
+    ow->slot[i].cap = 0;
+  }
+  for(i=0;i<ow->n_fixed;i++)
+    free(ow->fixed[i].lo);
+  free(ow->fixed);
+  ow->fixed = NULL;
+  ow->n_fixed = 0;
+}
+
+static bool ol_bits_encode(OlBits *b, const char *seq, const char *qual,
+    size_t len, char adj_q_cut){
+  size_t i, words = (len >> 6) + 2;
+  uint64_t bit;
+  if(words > b->cap){
+    uint64_t *mem = (uint64_t*)realloc(b->lo, 4 * words * sizeof(uint64_t));
+    if(mem == NULL)
+      return false;
+    b->lo = mem;
+    b->cap = words;
+  }
+  b->hi = b->lo + b->cap;
+  b->inv = b->lo + 2 * b->cap;
+  b->good = b->lo + 3 * b->cap;
+  memset(b->lo, 0, words * sizeof(uint64_t));
+  memset(b->hi, 0, words * sizeof(uint64_t));
+  memset(b->inv, 0, words * sizeof(uint64_t));
+  memset(b->good, 0, words * sizeof(uint64_t));
+  for(i=0;i<len;i++){
+    bit = (uint64_t)1 << (i & 63);
+    switch(seq[i]){
+    case 'A':
+      break;
+    case 'C':
+      b->lo[i >> 6] |= bit;
+      break;
+    case 'G':
+      b->hi[i >> 6] |= bit;
+      break;
+    case 'T':
+      b->lo[i >> 6] |= bit;
+      b->hi[i >> 6] |= bit;
+      break;
+    case 'N':
+      b->inv[i >> 6] |= bit;
+      break;
+    default:
+      //anything else has to be compared character by character
+      return false;
+    }
+    if(qual[i] >= adj_q_cut)
+      b->good[i >> 6] |= bit;
+  }
+  return true;
+}
+
+/**
+ * The planes of a read for the current pair, encoding it only the first
+ * time it is asked for. NULL if the read can't be packed (or there is no
+ * memory), in which case compute_ol falls back to k_match. When every
+ * slot is in use one is overwritten, but never keep, the planes the
+ * caller still holds.
+ */
+static const OlBits *ol_work_get(OlWork *ow, const char *seq,
+    const char *qual, size_t len, char adj_q_cut, const OlBits *keep){
+  OlBits *b = NULL;
+  int i;
+  for(i=0;i<OL_WORK_SLOTS;i++){
+    OlBits *s = &ow->slot[i];
+    if(s->pair != ow->pair || s->seq == NULL){
+      if(b == NULL)
+        b = s; //free for this pair
+    }else if(s->seq == seq && s->qual == qual && s->len == len &&
+        s->adj_q_cut == adj_q_cut){
+      return s->ok ? s : NULL;
+    }
+  }
+  for(i=0;i<ow->n_fixed;i++){
+    OlBits *s = &ow->fixed[i];
+    if(s->seq == seq && s->qual == qual && s->len == len &&
+        s->adj_q_cut == adj_q_cut)
+      return s->ok ? s : NULL;
+  }
+  if(b == NULL){
+    if(&ow->slot[ow->victim] == keep)
+      ow->victim = (ow->victim + 1) % OL_WORK_SLOTS;
+    b = &ow->slot[ow->victim];
+    ow->victim = (ow->victim + 1) % OL_WORK_SLOTS;
+  }
+  b->seq = seq;
+  b->qual = qual;
+  b->len = len;
+  b->adj_q_cut = adj_q_cut;
+  b->pair = ow->pair;
+  b->ok = ol_bits_encode(b, seq, qual, len, adj_q_cut);
+  return b->ok ? b : NULL;
+}
+
+bool ol_work_fix(OlWork *ow, const char *seq, const char *qual, size_t len,
+    char adj_q_cut){
+  OlBits *b, *mem = (OlBits*)realloc(ow->fixed, (ow->n_fixed + 1) * sizeof(OlBits));
+  if(mem == NULL)
+    return false;
+  ow->fixed = mem;
+  b = &ow->fixed[ow->n_fixed];
+  memset(b, 0, sizeof(OlBits));
+  b->seq = seq;
+  b->qual = qual;
+  b->len = len;
+  b->adj_q_cut = adj_q_cut;
+  b->ok = ol_bits_encode(b, seq, qual, len, adj_q_cut);
+  if(b->lo == NULL)
+    return false; //no memory for the planes, leave it out
+  ow->n_fixed++;
+  return true;
+}
+
+//64 bits of a plane starting at bit
+static inline uint64_t ol_bits_word(const uint64_t *v, size_t bit){
+  size_t w = bit >> 6, r = bit & 63;
+  return r ? (v[w] >> r) | (v[w + 1] << (64 - r)) : v[w];
+}
+
+/**
+ * compute_ol over bit planes: at every shift the overlap is scored 64
+ * positions per step, a match is an equal base that is not N and a
+ * mismatch is anything else where both qualities pass, exactly as in
+ * k_match. Returns false, leaving hit alone, if either read holds a
+ * character other than ACGTN.
+ */
+static bool compute_ol_bits(OlWork *ow,
+    const char subjectSeq[], const char subjectQual[], size_t subjectLen,
+    const char querySeq[], const char queryQual[], size_t queryLen,
+    size_t min_olap, unsigned short min_match[],
+    unsigned short max_mismatch[],
+    bool check_unique, char adj_q_cut, int *hit){
+  const OlBits *sb, *qb;
+  size_t pos, len, k;
+  int best_hit = CODE_NOMATCH;
+  if((sb = ol_work_get(ow, subjectSeq, subjectQual, subjectLen, adj_q_cut, NULL)) == NULL ||
+      (qb = ol_work_get(ow, querySeq, queryQual, queryLen, adj_q_cut, sb)) == NULL)
+    return false;
+  for( pos = 0; pos < subjectLen - min_olap + 1; pos++ ) {
+    size_t match = 0, mismatch = 0;
+    len = min(subjectLen - pos, queryLen);
+    for(k=0; k<len; k+=64){
+      uint64_t mask = len - k >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << (len - k)) - 1;
+      uint64_t diff = (ol_bits_word(sb->lo, pos + k) ^ qb->lo[k >> 6]) |
+          (ol_bits_word(sb->hi, pos + k) ^ qb->hi[k >> 6]) |
+          ol_bits_word(sb->inv, pos + k) | qb->inv[k >> 6];
+      uint64_t m = ~diff & mask;
+      uint64_t good = ol_bits_word(sb->good, pos + k) & qb->good[k >> 6] & mask;
+      match += __builtin_popcountll(m);
+      mismatch += __builtin_popcountll(good & ~m);
+      if(mismatch > max_mismatch[len])
+        break;
+    }
+    if(mismatch <= max_mismatch[len] && match >= min_match[len]){
+      if(check_unique && best_hit != CODE_NOMATCH){
+        best_hit = CODE_AMBIGUOUS;
+        break;
+      }
+      if(best_hit == CODE_NOMATCH){
+        best_hit = pos;
+        if(!check_unique)
+          break;
+      }
+    }
+  }
+  *hit = best_hit;
+  return true;
+}
+
 /*
    Supply two sequences in the proper orientation for overlap
    Ie in this example give compute_ol the reversed sequence and quality
@@ -1009,11 +1363,11 @@ gzFile fileOpen(const char *name, char access_mode[]) {
 
  */
 
-int compute_ol(
+int compute_ol(OlWork *ow,
     char subjectSeq[], char subjectQual[], size_t subjectLen,
     char querySeq[], char queryQual[], size_t queryLen,
-    size_t min_olap, unsigned short min_match[MAX_SEQ_LEN+1],
-    unsigned short max_mismatch[MAX_SEQ_LEN+1],
+    size_t min_olap, unsigned short min_match[],
+    unsigned short max_mismatch[],
     bool check_unique, char adj_q_cut ) {
 
   size_t  pos;  
@@ -1021,6 +1375,12 @@ int compute_ol(
      on the forward sequence */
   int best_hit = CODE_NOMATCH;
   int subject_len = subjectLen;
+  //plain ACGTN reads are scored over all shifts a word at a time
+  if(min_olap <= subjectLen + 1 &&
+      compute_ol_bits(ow, subjectSeq, subjectQual, subjectLen,
+        querySeq, queryQual, queryLen, min_olap, min_match, max_mismatch,
+        check_unique, adj_q_cut, &best_hit))
+    return best_hit;
   for( pos = 0; pos < subjectLen - min_olap + 1; pos++ ) {
     subject_len = subjectLen - pos;
     //Round1:
@@ -1064,16 +1424,17 @@ int compute_ol(
    all possible overlapping positions, from longest to
    shortest, until it finds one. It doesn't require a match
    if either read has quality score less that QCUT.
+   On x86 the bulk of the overlap is compared 32 (AVX2) or
+   16 (SSE4.1) positions at a time when the cpu has them,
+   k_match_tail finishes off what is left one base at a time.
    Returns: true if it's a match, false if it's not
  */
-bool k_match( const char* s1, const char* q1, size_t len1, 
-    const char* s2, const char* q2, size_t len2,
+static bool k_match_tail( const char* s1, const char* q1,
+    const char* s2, const char* q2, size_t i, size_t len,
+    size_t match, size_t mismatch,
     unsigned short min_match, unsigned short max_mismatch,
     char adj_q_cut) {
-  size_t i;
-  size_t mismatch = 0;
-  size_t match = 0;
-  for( i = 0; ((i < len1) && (i <len2)); i++ ) {
+  for( ; i < len; i++ ) {
     //if we have a match, or at least good quality bases...
     if ( (s1[i] == s2[i] && s1[i] != 'N') || ((q1[i] >= adj_q_cut) &&
         (q2[i] >= adj_q_cut))){
@@ -1091,6 +1452,88 @@ bool k_match( const char* s1, const char* q1, size_t len1,
   return false;
 }
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define K_MATCH_SIMD
+#include <immintrin.h>
+
+/**
+ * A position is a match when the bases are equal and not N, and a
+ * mismatch when it is not a match but both qualities reach adj_q_cut.
+ * The mismatch count only ever grows, so stopping after the first
+ * vector that takes it over max_mismatch gives the scalar answer.
+ */
+__attribute__((target("avx2,popcnt")))
+static bool k_match_avx2( const char* s1, const char* q1,
+    const char* s2, const char* q2, size_t len,
+    unsigned short min_match, unsigned short max_mismatch,
+    char adj_q_cut) {
+  const __m256i n = _mm256_set1_epi8('N');
+  const __m256i cut = _mm256_set1_epi8(adj_q_cut);
+  size_t i, match = 0, mismatch = 0;
+  for( i = 0; i + 32 <= len; i += 32 ) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(s1 + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(s2 + i));
+    __m256i qa = _mm256_loadu_si256((const __m256i*)(q1 + i));
+    __m256i qb = _mm256_loadu_si256((const __m256i*)(q2 + i));
+    __m256i eq = _mm256_andnot_si256(_mm256_cmpeq_epi8(a, n), _mm256_cmpeq_epi8(a, b));
+    __m256i good = _mm256_and_si256(
+        _mm256_cmpeq_epi8(_mm256_max_epi8(qa, cut), qa),
+        _mm256_cmpeq_epi8(_mm256_max_epi8(qb, cut), qb));
+    unsigned int m_eq = (unsigned int)_mm256_movemask_epi8(eq);
+    unsigned int m_good = (unsigned int)_mm256_movemask_epi8(good);
+    match += __builtin_popcount(m_eq);
+    mismatch += __builtin_popcount(m_good & ~m_eq);
+    if(mismatch > max_mismatch)
+      return false;
+  }
+  return k_match_tail(s1, q1, s2, q2, i, len, match, mismatch,
+      min_match, max_mismatch, adj_q_cut);
+}
+
+__attribute__((target("sse4.1,popcnt")))
+static bool k_match_sse41( const char* s1, const char* q1,
+    const char* s2, const char* q2, size_t len,
+    unsigned short min_match, unsigned short max_mismatch,
+    char adj_q_cut) {
+  const __m128i n = _mm_set1_epi8('N');
+  const __m128i cut = _mm_set1_epi8(adj_q_cut);
+  size_t i, match = 0, mismatch = 0;
+  for( i = 0; i + 16 <= len; i += 16 ) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(s1 + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(s2 + i));
+    __m128i qa = _mm_loadu_si128((const __m128i*)(q1 + i));
+    __m128i qb = _mm_loadu_si128((const __m128i*)(q2 + i));
+    __m128i eq = _mm_andnot_si128(_mm_cmpeq_epi8(a, n), _mm_cmpeq_epi8(a, b));
+    __m128i good = _mm_and_si128(
+        _mm_cmpeq_epi8(_mm_max_epi8(qa, cut), qa),
+        _mm_cmpeq_epi8(_mm_max_epi8(qb, cut), qb));
+    unsigned int m_eq = (unsigned int)_mm_movemask_epi8(eq);
+    unsigned int m_good = (unsigned int)_mm_movemask_epi8(good);
+    match += __builtin_popcount(m_eq);
+    mismatch += __builtin_popcount(m_good & ~m_eq);
+    if(mismatch > max_mismatch)
+      return false;
+  }
+  return k_match_tail(s1, q1, s2, q2, i, len, match, mismatch,
+      min_match, max_mismatch, adj_q_cut);
+}
+#endif
+
+bool k_match( const char* s1, const char* q1, size_t len1, 
+    const char* s2, const char* q2, size_t len2,
+    unsigned short min_match, unsigned short max_mismatch,
+    char adj_q_cut) {
+  size_t len = min(len1, len2);
+#ifdef K_MATCH_SIMD
+  if(len >= 32 && __builtin_cpu_supports("avx2"))
+    return k_match_avx2(s1, q1, s2, q2, len, min_match, max_mismatch, adj_q_cut);
+  if(len >= 16 && __builtin_cpu_supports("sse4.1"))
+    return k_match_sse41(s1, q1, s2, q2, len, min_match, max_mismatch, adj_q_cut);
+#endif
+  return k_match_tail(s1, q1, s2, q2, 0, len, 0, 0,
+      min_match, max_mismatch, adj_q_cut);
+}
+
 
 void revcom_seq( char seq[], int len) {
   //int len = strlen(seq);
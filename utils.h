@@ -4,13 +4,16 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <zlib.h>
 #include <unistd.h>
 #include "stdaln.h"
+#include "fqreader.h"
 
 #define MAX_ID_LEN (256)
 #define MAX_FN_LEN (512)
-#define MAX_SEQ_LEN (256)
+//read length the record buffers start out with, they grow to fit longer reads
+#define SQP_INIT_LEN (256)
 //60+33 = 93 = '[' (was 83='S')
 #define MAX_QUAL (93)
 #define MIN_QUAL (33)
@@ -20,58 +23,154 @@ extern char maximum_quality;
 #define CODE_NOADAPT (9999)
 
 /* Type to hold the forward and reverse read
-   of a sequence pair with quality scores */
+   of a sequence pair with quality scores.
+   The sequences and qualities all point into one block (mem)
+   that is grown by SQP_reserve whenever a longer read arrives.
+   Only the bytes up to each length are meaningful, the buffers
+   are not cleared between pairs. rc_rseq/rc_rqual are filled in
+   by SQP_rc when first needed and go stale whenever rseq is trimmed. */
 typedef struct sqp {
   char fid[MAX_ID_LEN+1];
-  char fseq[MAX_SEQ_LEN+1];
-  char fqual[MAX_SEQ_LEN+1];
+  char *fseq;
+  char *fqual;
   size_t flen;
   char rid[MAX_ID_LEN+1];
-  char rseq[MAX_SEQ_LEN+1];
-  char rqual[MAX_SEQ_LEN+1];
-  char rc_rseq[MAX_SEQ_LEN+1];
-  char rc_rqual[MAX_SEQ_LEN+1];
-  char merged_seq[MAX_SEQ_LEN+MAX_SEQ_LEN+1];
-  char merged_qual[MAX_SEQ_LEN+MAX_SEQ_LEN+1];
+  char *rseq;
+  char *rqual;
+  char *rc_rseq;
+  char *rc_rqual;
+  char *merged_seq;
+  char *merged_qual;
+  //the reads as they were read in, for the discard files
+  char *untrim_fseq;
+  char *untrim_fqual;
+  char *untrim_rseq;
+  char *untrim_rqual;
   size_t merged_len;
   size_t rlen;
   size_t mpos;
+  bool rc_ok; //rc_rseq/rc_rqual hold the reverse complement of rseq/rqual
+  char *mem;
+  size_t cap; //size of each read buffer (merged ones are twice that)
 } Sqp;
 typedef struct sqp* SQP;
 
+/* Growable in-memory output buffer, filled by the workers
+   and handed to the writer to be compressed in input order */
+typedef struct outbuf {
+  char *s;
+  size_t l;
+  size_t m;
+} OutBuf;
+
+void outbuf_init(OutBuf *b);
+void outbuf_free(OutBuf *b);
+void outbuf_write(OutBuf *b, const char *s, size_t len);
+void outbuf_puts(OutBuf *b, const char *s);
+void outbuf_putc(OutBuf *b, char c);
+void outbuf_printf(OutBuf *b, const char *fmt, ...);
+
+/* Minimum matches and maximum mismatches allowed for an overlap
+   of each length, extended on demand to cover longer reads */
+typedef struct {
+  float min_match_frac;
+  float max_mismatch_frac;
+  unsigned short *min_match;
+  unsigned short *max_mismatch;
+  size_t len; //entries 0..len are filled in
+} OlapTable;
+
+void olap_table_init(OlapTable *t, float min_match_frac, float max_mismatch_frac);
+void olap_table_reserve(OlapTable *t, size_t len);
+void olap_table_free(OlapTable *t);
+
+/* A read packed into bit planes for compute_ol, one bit per base:
+   lo/hi hold the 2 bit code of A/C/G/T, inv is set for N and good is
+   set where the quality reaches adj_q_cut. Each plane has one extra
+   zero word at the end so a window can be pulled out at any bit offset. */
+typedef struct {
+  const char *seq, *qual; //what was encoded, compared by address
+  size_t len;
+  char adj_q_cut;
+  unsigned pair;          //ol_work_next_pair count it belongs to
+  bool ok;                //only ACGTN, else compute_ol goes base by base
+  uint64_t *lo, *hi, *inv, *good;
+  size_t cap;             //words allocated for each plane
+} OlBits;
+
+#define OL_WORK_SLOTS (6)
+
+/* Per thread scratch for compute_ol: the reads and adapters of the
+   current pair are encoded the first time they are compared and reused
+   by the rest of its overlaps. Whoever changes a read in place between
+   two compute_ol calls of the same pair has to call ol_work_next_pair.
+   Sequences that never change, the adapters, can be encoded once with
+   ol_work_fix and are then shared by every pair. */
+typedef struct {
+  OlBits slot[OL_WORK_SLOTS];
+  unsigned pair;
+  int victim;             //slot to encode into when all are in use
+  OlBits *fixed;          //ol_work_fix encodings, never evicted
+  int n_fixed;
+} OlWork;
+
+/* forget the encodings of the previous pair */
+#define ol_work_next_pair(ow) ((ow)->pair++)
+/* keep seq encoded for the whole run, false if out of memory */
+bool ol_work_fix(OlWork *ow, const char *seq, const char *qual, size_t len,
+    char adj_q_cut);
+void ol_work_free(OlWork *ow);
+
 SQP SQP_init();
+/* make room for reads of up to len bases, keeping what is already there */
+void SQP_reserve(SQP sqp, size_t len);
+void SQP_clear(SQP sqp);
+/* make sure rc_rseq/rc_rqual are the reverse complement of the current reverse read */
+void SQP_rc(SQP sqp);
+/* rseq/rqual changed, the reverse complement has to be redone before its next use */
+#define SQP_rc_stale(sqp) ((sqp)->rc_ok = false)
+/* mask seq with N from pos to where it ends, returns the new length */
+size_t SQP_mask_tail(SQP sqp, char *seq, char *qual, size_t pos);
+/* length of a read left after quality trimming its 3' end with Mott's algorithm,
+   or by windows of w bases whose mean quality is under qcut */
+size_t qual_trim_mott(const char *qual, size_t len, char qcut);
+size_t qual_trim_window(const char *qual, size_t len, char qcut, size_t w);
+/* length of the (error tolerant) run of base ending seq, base 0 for the base it ends in */
+size_t tail_run(const char *seq, size_t len, char base);
+/* Shannon entropy of the dinucleotides of seq in bits, low for repeats and junk */
+double dinuc_entropy(const char *seq, size_t len);
 void SQP_destroy(SQP sqp);
 void adapter_merge(SQP sqp, bool print_overhang);
 void fill_merged_sequence(SQP sqp, AlnAln *aln, bool include_overhang);
-void pretty_print_alignment(gzFile out, SQP sqp, char adj_q_cut, bool sort);
-void pretty_print_alignment_stdaln(gzFile out, SQP sqp, AlnAln *aln, bool first_adapter, bool second_adapter, bool print_merged);
+void pretty_print_alignment(OutBuf *out, SQP sqp, char adj_q_cut, bool sort);
+void pretty_print_alignment_stdaln(OutBuf *out, SQP sqp, AlnAln *aln, bool first_adapter, bool second_adapter, bool print_merged);
 extern char mismatch_p33_merge(char pA, char pB);
 extern char gap_p33_qual(char q);
 extern char match_p33_merge(char pA, char pB);
 void make_blunt_ends(SQP sqp, AlnAln *aln);
-bool read_olap_adapter_trim(SQP sqp, size_t min_ol_adapter,
-    unsigned short min_match_adapter[MAX_SEQ_LEN+1],
-    unsigned short max_mismatch_adapter[MAX_SEQ_LEN+1],
-    unsigned short min_match_reads[MAX_SEQ_LEN+1],
-    unsigned short max_mismatch_reads[MAX_SEQ_LEN+1],
+bool read_olap_adapter_trim(OlWork *ow, SQP sqp, size_t min_ol_adapter,
+    unsigned short min_match_adapter[],
+    unsigned short max_mismatch_adapter[],
+    unsigned short min_match_reads[],
+    unsigned short max_mismatch_reads[],
     char qcut,
     bool use_mask);
-bool read_merge(SQP sqp, size_t min_olap,
-    unsigned short min_match[MAX_SEQ_LEN+1],
-    unsigned short max_mismatch[MAX_SEQ_LEN+1],
-    char adj_q_cut);
-extern bool next_fastqs( gzFile ffq, gzFile rfq, SQP curr_sqp, bool p64 );
-extern int write_fastq(gzFile out, char id[], char seq[], char qual[]);
+bool read_merge(OlWork *ow, SQP sqp, size_t min_olap,
+    unsigned short min_match[],
+    unsigned short max_mismatch[],
+    char adj_q_cut, bool *ambiguous);
+extern bool next_fastqs( FqReader *ffq, FqReader *rfq, SQP curr_sqp, bool p64 );
+extern void write_fastq(OutBuf *out, char id[], char seq[], char qual[]);
 extern bool f_r_id_check( char fid[], size_t fid_len, char rid[], size_t rid_len );
-int read_fastq( gzFile fastq, char id[], char seq[], char qual[],
+int read_fastq( FqReader *fastq, SQP sqp, char id[], char **seq, char **qual,
     size_t *id_len, size_t *seq_len, bool p64 );
 gzFile fileOpen(const char *name, char access_mode[]);
-int compute_ol(
+int compute_ol(OlWork *ow,
     char subjectSeq[], char subjectQual[], size_t subjectLen,
     char querySeq[], char queryQual[], size_t queryLen,
     size_t min_olap,
-    unsigned short min_match[MAX_SEQ_LEN+1],
-    unsigned short max_mismatch[MAX_SEQ_LEN+1],
+    unsigned short min_match[],
+    unsigned short max_mismatch[],
     bool check_unique, char adj_q_cut );
 bool k_match( const char* s1, const char* q1, size_t len1,
     const char* s2, const char* q2, size_t len2,
@@ -80,15 +179,21 @@ bool k_match( const char* s1, const char* q1, size_t len1,
 void revcom_seq( char seq[], int len);
 extern char revcom_char(const char base);
 extern void rev_qual( char q[], int len );
-bool adapter_trim(SQP sqp, size_t min_ol_adapter,
+int adapter_olap_pos(OlWork *ow, char *seq, char *qual, size_t len,
+    char *primer, char *primer_dummy_qual, int primer_len,
+    size_t min_ol_adapter,
+    unsigned short min_match_adapter[],
+    unsigned short max_mismatch_adapter[],
+    char qcut);
+bool adapter_trim(OlWork *ow, SQP sqp, size_t min_ol_adapter,
     char *forward_primer, char *forward_primer_dummy_qual,
     int forward_primer_len,
     char *reverse_primer, char *reverse_primer_dummy_qual,
     int reverse_primer_len,
-    unsigned short min_match_adapter[MAX_SEQ_LEN+1],
-    unsigned short max_mismatch_adapter[MAX_SEQ_LEN+1],
-    unsigned short min_match_reads[MAX_SEQ_LEN+1],
-    unsigned short max_mismatch_reads[MAX_SEQ_LEN+1],
+    unsigned short min_match_adapter[],
+    unsigned short max_mismatch_adapter[],
+    unsigned short min_match_reads[],
+    unsigned short max_mismatch_reads[],
     char adj_q_cut,
     bool use_mask);
 